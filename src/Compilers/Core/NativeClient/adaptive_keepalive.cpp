@@ -0,0 +1,135 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include "adaptive_keepalive.h"
+#include "client_state.h"
+#include "logging.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The name of the build history in the client state directory. It holds
+// the time, in UTC file time units, each recent build was last active,
+// most recent first.
+const wchar_t * const CADENCEFILENAME = L"cadence";
+
+// Number of builds which are remembered. Older ones are forgotten first.
+const size_t MaxBuilds = 50;
+
+// Don't adapt until this many idle gaps have been seen.
+const size_t MinIdleGaps = 5;
+
+// Requests closer together than this belong to the same build.
+const ULONGLONG BuildGapMs = 60 * 1000;
+
+// The longest keep alive ever asked for, and the memory available above
+// and below which the longest or only the default keep alive is used.
+const DWORD MaxAdaptiveKeepAliveSeconds = 60 * 60;
+const DWORDLONG AmpleMemory = 4ULL << 30;
+const DWORDLONG TightMemory = 1ULL << 30;
+
+// An idle server still holds on to its memory, so long keep alives are
+// only asked for when there is memory to spare.
+DWORD GetMaxAdaptiveKeepAliveSeconds()
+{
+    MEMORYSTATUSEX memoryStatus = {};
+    memoryStatus.dwLength = sizeof(memoryStatus);
+    if (!GlobalMemoryStatusEx(&memoryStatus) || memoryStatus.ullAvailPhys <= TightMemory)
+    {
+        return DefaultServerKeepAliveSeconds;
+    }
+
+    if (memoryStatus.ullAvailPhys >= AmpleMemory)
+    {
+        return MaxAdaptiveKeepAliveSeconds;
+    }
+
+    return DefaultServerKeepAliveSeconds + (DWORD)(
+        (MaxAdaptiveKeepAliveSeconds - DefaultServerKeepAliveSeconds)
+        * (memoryStatus.ullAvailPhys - TightMemory)
+        / (AmpleMemory - TightMemory));
+}
+
+bool ComputeAdaptiveKeepAlive(
+    _In_ vector<DWORD> idleGapsSeconds,
+    DWORD maxSeconds,
+    _Out_ DWORD& keepAliveSeconds)
+{
+    keepAliveSeconds = 0;
+
+    // Gaps too long to cover are times nobody was building at all.
+    idleGapsSeconds.erase(
+        remove_if(idleGapsSeconds.begin(), idleGapsSeconds.end(), [=](DWORD gap) { return gap > maxSeconds; }),
+        idleGapsSeconds.end());
+    if (idleGapsSeconds.size() < MinIdleGaps)
+    {
+        return false;
+    }
+
+    // Cover nine gaps out of ten, with a margin.
+    sort(idleGapsSeconds.begin(), idleGapsSeconds.end());
+    auto gap = idleGapsSeconds[idleGapsSeconds.size() * 9 / 10];
+    keepAliveSeconds = min(gap + gap / 4, maxSeconds);
+    return keepAliveSeconds > DefaultServerKeepAliveSeconds;
+}
+
+bool GetAdaptiveKeepAlive(
+    _In_ const wstring& stateDirectory,
+    _Out_ wstring& keepAlive)
+{
+    keepAlive.clear();
+
+    wstring enabled;
+    if (stateDirectory.empty() || !GetEnvVar(ADAPTIVEKEEPALIVE_ENV_VAR, enabled) || enabled != L"1")
+    {
+        return false;
+    }
+
+    vector<wstring> lines;
+    {
+        LockedStateFile history(stateDirectory + CADENCEFILENAME);
+        if (!history.ReadLines(lines))
+        {
+            return false;
+        }
+
+        // Only the last activity of the current build is remembered.
+        auto now = GetCurrentFileTime();
+        if (!lines.empty() && now - _wcstoui64(lines[0].c_str(), nullptr, 10) < BuildGapMs * FileTimeUnitsPerMs)
+        {
+            lines[0] = to_wstring(now);
+        }
+        else
+        {
+            lines.insert(lines.begin(), to_wstring(now));
+        }
+
+        if (lines.size() > MaxBuilds)
+        {
+            lines.resize(MaxBuilds);
+        }
+        history.WriteLines(lines);
+    }
+
+    vector<DWORD> idleGapsSeconds;
+    for (size_t i = 0; i + 1 < lines.size(); i++)
+    {
+        auto later = _wcstoui64(lines[i].c_str(), nullptr, 10);
+        auto earlier = _wcstoui64(lines[i + 1].c_str(), nullptr, 10);
+        // Skip gaps made up by a clock which was moved back.
+        if (later > earlier)
+        {
+            idleGapsSeconds.push_back((DWORD)min<ULONGLONG>((later - earlier) / FileTimeUnitsPerMs / 1000, MAXDWORD));
+        }
+    }
+
+    DWORD keepAliveSeconds;
+    if (!ComputeAdaptiveKeepAlive(move(idleGapsSeconds), GetMaxAdaptiveKeepAliveSeconds(), keepAliveSeconds))
+    {
+        return false;
+    }
+
+    LogFormatted(IDS_AdaptiveKeepAlive, keepAliveSeconds);
+    keepAlive = to_wstring(keepAliveSeconds);
+    return true;
+}
@@ -0,0 +1,35 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A server left idle for longer than its keep alive shuts down, so someone
+// who builds every 12 minutes against a shorter keep alive gets a cold
+// server nearly every time. In the opt-in adaptive mode clients remember
+// when builds happen and ask for a keep alive which covers the usual gap
+// between them, as long as there is memory to spare for an idle server.
+
+// Set this environment variable to 1 to have requests without a /keepalive
+// switch ask for an adaptive keep alive.
+const wchar_t * const ADAPTIVEKEEPALIVE_ENV_VAR = L"RoslynCommandLineAdaptiveKeepAlive";
+
+// The keep alive, in seconds, the server uses unless a client asks for more.
+const DWORD DefaultServerKeepAliveSeconds = 5 * 60;
+
+// Get a keep alive, in seconds, covering most of the given idle gaps
+// between builds without going over the maximum. Returns false if there
+// are too few gaps to go by, or the default keep alive covers them.
+bool ComputeAdaptiveKeepAlive(
+    _In_ vector<DWORD> idleGapsSeconds,
+    DWORD maxSeconds,
+    _Out_ DWORD& keepAliveSeconds);
+
+// Remember that a build is running now and get the keep alive to ask for,
+// if adaptive keep alives are enabled and the default isn't enough.
+bool GetAdaptiveKeepAlive(
+    _In_ const wstring& stateDirectory,
+    _Out_ wstring& keepAlive);
@@ -0,0 +1,147 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <vector>
+#include "affinity.h"
+#include "arguments.h"
+#include "client_state.h"
+
+using namespace std;
+
+// The name of the affinity table in the client state directory.
+const wchar_t * const AFFINITYFILENAME = L"affinity";
+
+// The name of the file in the client state directory which holds the id of
+// the server that last accepted a connection.
+const wchar_t * const LASTSERVERFILENAME = L"server";
+
+// Number of projects remembered. The least recently compiled are forgotten first.
+const size_t MaxAffinityEntries = 64;
+
+wstring ComputeAffinityKey(
+    _In_ const wstring& currentDirectory,
+    _In_ const list<wstring>& commandLineArgs)
+{
+    list<wstring> expandedArgs;
+    ExpandResponseFiles(commandLineArgs, currentDirectory, expandedArgs);
+
+    vector<wstring> references;
+    GetReferences(expandedArgs, references);
+
+    wstring keySource(currentDirectory);
+    for (auto& reference : references)
+    {
+        keySource += L'|';
+        keySource += reference;
+    }
+
+    return FormatHash(HashString(keySource));
+}
+
+// Each line of the table is "<key> <process id>", most recently used first.
+bool ParseAffinityEntry(_In_ const wstring& line, _Out_ wstring& key, _Out_ DWORD& processId)
+{
+    auto separator = line.find(L' ');
+    if (separator == wstring::npos)
+    {
+        return false;
+    }
+
+    key = line.substr(0, separator);
+    processId = wcstoul(line.c_str() + separator + 1, nullptr, 10);
+    return processId != 0;
+}
+
+bool LookupServerAffinity(
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& affinityKey,
+    _Out_ DWORD& processId)
+{
+    processId = 0;
+
+    LockedStateFile table(stateDirectory + AFFINITYFILENAME);
+    vector<wstring> lines;
+    if (!table.ReadLines(lines))
+    {
+        return false;
+    }
+
+    for (auto& line : lines)
+    {
+        wstring key;
+        DWORD entryProcessId;
+        if (ParseAffinityEntry(line, key, entryProcessId) && key == affinityKey)
+        {
+            processId = entryProcessId;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void RecordServerAffinity(
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& affinityKey,
+    DWORD processId)
+{
+    LockedStateFile table(stateDirectory + AFFINITYFILENAME);
+    vector<wstring> lines;
+    if (!table.ReadLines(lines))
+    {
+        return;
+    }
+
+    vector<wstring> newLines;
+    newLines.push_back(affinityKey + L" " + to_wstring(processId));
+    for (auto& line : lines)
+    {
+        wstring key;
+        DWORD entryProcessId;
+        if (newLines.size() < MaxAffinityEntries
+            && ParseAffinityEntry(line, key, entryProcessId)
+            && key != affinityKey)
+        {
+            newLines.push_back(line);
+        }
+    }
+
+    table.WriteLines(newLines);
+}
+
+bool LookupLastServer(
+    _In_ const wstring& stateDirectory,
+    _Out_ DWORD& processId)
+{
+    processId = 0;
+
+    LockedStateFile file(stateDirectory + LASTSERVERFILENAME);
+    vector<wstring> lines;
+    if (!file.ReadLines(lines) || lines.empty())
+    {
+        return false;
+    }
+
+    processId = wcstoul(lines.front().c_str(), nullptr, 10);
+    return processId != 0;
+}
+
+void RecordLastServer(
+    _In_ const wstring& stateDirectory,
+    DWORD processId)
+{
+    LockedStateFile file(stateDirectory + LASTSERVERFILENAME);
+    vector<wstring> lines;
+    if (!file.ReadLines(lines))
+    {
+        return;
+    }
+
+    // Most connections go to the server that is already recorded, so
+    // avoid rewriting the file in that case.
+    auto line = to_wstring(processId);
+    if (lines.empty() || lines.front() != line)
+    {
+        lines.assign(1, line);
+        file.WriteLines(lines);
+    }
+}
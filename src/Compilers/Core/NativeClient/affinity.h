@@ -0,0 +1,42 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <list>
+#include <string>
+
+using namespace std;
+
+// When more than one server is running, compiles of the same project should
+// go to the same server so that the references it loaded into its metadata
+// cache the last time are reused. Clients remember which server last handled
+// each project in a small per-user table.
+
+// Compute the key identifying a project: its directory and the set of
+// references it compiles against.
+wstring ComputeAffinityKey(
+    _In_ const wstring& currentDirectory,
+    _In_ const list<wstring>& commandLineArgs);
+
+// Find the server process which last compiled the project with the given key.
+bool LookupServerAffinity(
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& affinityKey,
+    _Out_ DWORD& processId);
+
+// Remember that the given server process compiled the project with the given key.
+void RecordServerAffinity(
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& affinityKey,
+    DWORD processId);
+
+// Find the server process which most recently accepted a connection from
+// any client. Clients try it before taking the server creation mutex.
+bool LookupLastServer(
+    _In_ const wstring& stateDirectory,
+    _Out_ DWORD& processId);
+
+// Remember that the given server process accepted a connection.
+void RecordLastServer(
+    _In_ const wstring& stateDirectory,
+    DWORD processId);
@@ -0,0 +1,320 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include <memory>
+#include "arguments.h"
+#include "logging.h"
+#include "smart_resources.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// Response files nested deeper than this are not expanded.
+const int MaxResponseFileDepth = 8;
+
+// Read the text of a response file. Response files are either UTF-16
+// with a byte order mark or UTF-8, with or without a byte order mark.
+bool ReadResponseFileText(_In_ const wstring& path, _Out_ wstring& text)
+{
+    text.clear();
+
+    SmartHandle file(CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr, // security attributes
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr)); // no template file
+
+    if (file.get() == INVALID_HANDLE_VALUE)
+    {
+        LogWin32Error(IDS_ReadResponseFileFailed);
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file.get(), &size) || size.HighPart != 0)
+    {
+        return false;
+    }
+
+    string bytes;
+    bytes.resize(size.LowPart);
+    DWORD read = 0;
+    if (size.LowPart != 0
+        && (!ReadFile(file.get(), &bytes[0], size.LowPart, &read, nullptr) || read != size.LowPart))
+    {
+        LogWin32Error(IDS_ReadResponseFileFailed);
+        return false;
+    }
+
+    if (bytes.size() >= 2 && (BYTE)bytes[0] == 0xFF && (BYTE)bytes[1] == 0xFE)
+    {
+        text.assign(reinterpret_cast<const wchar_t*>(bytes.data() + 2), (bytes.size() - 2) / sizeof(wchar_t));
+        return true;
+    }
+
+    size_t offset = 0;
+    if (bytes.size() >= 3 && (BYTE)bytes[0] == 0xEF && (BYTE)bytes[1] == 0xBB && (BYTE)bytes[2] == 0xBF)
+    {
+        offset = 3;
+    }
+
+    auto length = (int)(bytes.size() - offset);
+    if (length > 0)
+    {
+        auto charsNeeded = MultiByteToWideChar(CP_UTF8, 0, bytes.data() + offset, length, nullptr, 0);
+        text.resize(charsNeeded);
+        MultiByteToWideChar(CP_UTF8, 0, bytes.data() + offset, length, &text[0], charsNeeded);
+    }
+
+    return true;
+}
+
+// Split a single response file line into arguments using the same rules
+// as the process command line. Lines starting with '#' are comments.
+void SplitResponseFileLine(_In_ wstring line, _Inout_ list<wstring>& args)
+{
+    auto first = line.find_first_not_of(L" \t");
+    if (first == wstring::npos || line[first] == L'#')
+    {
+        return;
+    }
+
+    // CommandLineToArgvW treats the first token as a program name, which
+    // has different quoting rules, so give it a dummy one to skip.
+    line.insert(0, L"x ");
+
+    int count;
+    auto argv = unique_ptr<LPWSTR, decltype(&::LocalFree)>(
+        CommandLineToArgvW(line.c_str(), &count), ::LocalFree);
+    if (argv == nullptr)
+    {
+        return;
+    }
+
+    for (int i = 1; i < count; i++)
+    {
+        args.emplace_back(argv.get()[i]);
+    }
+}
+
+bool IsRelativePath(_In_ const wstring& path)
+{
+    // Rooted paths start with a slash ("\dir", "\\server\share") or a drive ("c:").
+    return !(path.size() >= 1 && (path[0] == L'\\' || path[0] == L'/'))
+        && !(path.size() >= 2 && path[1] == L':');
+}
+
+wstring MakeAbsolutePath(_In_ const wstring& path, _In_ const wstring& currentDirectory)
+{
+    if (IsRelativePath(path) && !currentDirectory.empty())
+    {
+        auto combined = currentDirectory;
+        if (combined.back() != L'\\')
+        {
+            combined += L'\\';
+        }
+        return combined + path;
+    }
+    return path;
+}
+
+void ExpandResponseFilesCore(
+    _In_ const list<wstring>& args,
+    _In_ const wstring& currentDirectory,
+    int depth,
+    _Inout_ list<wstring>& expandedArgs)
+{
+    for (auto& arg : args)
+    {
+        if (arg.size() > 1 && arg[0] == L'@' && depth < MaxResponseFileDepth)
+        {
+            wstring text;
+            if (ReadResponseFileText(MakeAbsolutePath(arg.substr(1), currentDirectory), text))
+            {
+                list<wstring> fileArgs;
+                size_t start = 0;
+                while (start <= text.size())
+                {
+                    auto end = text.find_first_of(L"\r\n", start);
+                    if (end == wstring::npos)
+                    {
+                        end = text.size();
+                    }
+                    SplitResponseFileLine(text.substr(start, end - start), fileArgs);
+                    start = end + 1;
+                }
+
+                ExpandResponseFilesCore(fileArgs, currentDirectory, depth + 1, expandedArgs);
+                continue;
+            }
+        }
+
+        expandedArgs.push_back(arg);
+    }
+}
+
+void ExpandResponseFiles(
+    _In_ const list<wstring>& args,
+    _In_ const wstring& currentDirectory,
+    _Out_ list<wstring>& expandedArgs)
+{
+    expandedArgs.clear();
+    ExpandResponseFilesCore(args, currentDirectory, 0, expandedArgs);
+}
+
+bool TryGetSwitchValue(
+    _In_ const wstring& arg,
+    _In_z_ LPCWSTR switchName,
+    _Out_ wstring& value)
+{
+    value.clear();
+
+    auto nameLength = wcslen(switchName);
+    if (arg.size() < nameLength + 2
+        || (arg[0] != L'/' && arg[0] != L'-')
+        || _wcsnicmp(arg.c_str() + 1, switchName, nameLength) != 0
+        || arg[nameLength + 1] != L':')
+    {
+        return false;
+    }
+
+    value = arg.substr(nameLength + 2);
+    return true;
+}
+
+// Whether the argument is exactly the given switch, e.g. "debug+".
+bool IsSwitch(
+    _In_ const wstring& arg,
+    _In_z_ LPCWSTR switchName)
+{
+    return !arg.empty()
+        && (arg[0] == L'/' || arg[0] == L'-')
+        && _wcsicmp(arg.c_str() + 1, switchName) == 0;
+}
+
+bool HasUtf8Output(_In_ const list<wstring>& expandedArgs)
+{
+    for (auto& arg : expandedArgs)
+    {
+        if (IsSwitch(arg, L"utf8output"))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Remove the quotes around a path given as a switch value.
+wstring UnquotePath(_In_ wstring path)
+{
+    path.erase(remove(path.begin(), path.end(), L'"'), path.end());
+    return path;
+}
+
+bool GetOutputPaths(
+    _In_ const list<wstring>& expandedArgs,
+    _Out_ OutputPaths& paths)
+{
+    paths = OutputPaths();
+
+    for (auto& arg : expandedArgs)
+    {
+        wstring value;
+        if (TryGetSwitchValue(arg, L"out", value))
+        {
+            paths.out = UnquotePath(value);
+        }
+        else if (TryGetSwitchValue(arg, L"pdb", value))
+        {
+            paths.pdb = UnquotePath(value);
+        }
+        else if (TryGetSwitchValue(arg, L"doc", value))
+        {
+            paths.doc = UnquotePath(value);
+        }
+        else if (TryGetSwitchValue(arg, L"debug", value)
+            || IsSwitch(arg, L"debug")
+            || IsSwitch(arg, L"debug+"))
+        {
+            paths.debug = true;
+        }
+        else if (IsSwitch(arg, L"debug-"))
+        {
+            paths.debug = false;
+        }
+        else if (TryGetSwitchValue(arg, L"touchedfiles", value)
+            || TryGetSwitchValue(arg, L"bugreport", value))
+        {
+            return false;
+        }
+    }
+
+    return !paths.out.empty();
+}
+
+void GetReferences(
+    _In_ const list<wstring>& expandedArgs,
+    _Out_ vector<wstring>& references)
+{
+    references.clear();
+
+    for (auto& arg : expandedArgs)
+    {
+        wstring value;
+        if (!TryGetSwitchValue(arg, L"reference", value)
+            && !TryGetSwitchValue(arg, L"r", value))
+        {
+            continue;
+        }
+
+        // A reference switch takes a list of files separated by ',' or ';'.
+        size_t start = 0;
+        while (start < value.size())
+        {
+            auto end = value.find_first_of(L",;", start);
+            if (end == wstring::npos)
+            {
+                end = value.size();
+            }
+
+            auto reference = value.substr(start, end - start);
+            reference.erase(remove(reference.begin(), reference.end(), L'"'), reference.end());
+            if (!reference.empty())
+            {
+                transform(reference.begin(), reference.end(), reference.begin(), towlower);
+                references.push_back(move(reference));
+            }
+            start = end + 1;
+        }
+    }
+
+    sort(references.begin(), references.end());
+    references.erase(unique(references.begin(), references.end()), references.end());
+}
+
+void GetSourceFiles(
+    _In_ const list<wstring>& expandedArgs,
+    _In_ const wstring& currentDirectory,
+    _Out_ vector<wstring>& sources)
+{
+    sources.clear();
+
+    // Anything other than a switch or a response file is a source file.
+    for (auto& arg : expandedArgs)
+    {
+        if (arg.empty() || arg[0] == L'/' || arg[0] == L'-' || arg[0] == L'@'
+            || arg.find_first_of(L"*?") != wstring::npos)
+        {
+            continue;
+        }
+
+        auto source = UnquotePath(arg);
+        if (!source.empty())
+        {
+            sources.push_back(MakeAbsolutePath(source, currentDirectory));
+        }
+    }
+}
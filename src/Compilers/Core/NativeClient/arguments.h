@@ -0,0 +1,72 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <list>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Helpers for looking inside the compiler command line. The client never
+// changes the command line it sends to the server based on these; they only
+// feed heuristics such as picking a server for a project or telling the
+// server which files to load early.
+
+// Replace every response file argument (@file) with the arguments it
+// contains. Response files that can't be read are left in place.
+void ExpandResponseFiles(
+    _In_ const list<wstring>& args,
+    _In_ const wstring& currentDirectory,
+    _Out_ list<wstring>& expandedArgs);
+
+// Resolve a path relative to the given directory. Rooted paths are
+// returned unchanged.
+wstring MakeAbsolutePath(
+    _In_ const wstring& path,
+    _In_ const wstring& currentDirectory);
+
+// If the argument is the switch with the given name (e.g. "reference"),
+// followed by ':' and a value, return the value. The leading '/' or '-'
+// and the switch name are matched without regard to case.
+bool TryGetSwitchValue(
+    _In_ const wstring& arg,
+    _In_z_ LPCWSTR switchName,
+    _Out_ wstring& value);
+
+// Get the metadata references named by /reference switches, lower cased,
+// sorted and without duplicates.
+void GetReferences(
+    _In_ const list<wstring>& expandedArgs,
+    _Out_ vector<wstring>& references);
+
+// Get the source files named on the command line, made absolute. Names with
+// wildcards are left out since only the compiler knows what they match.
+void GetSourceFiles(
+    _In_ const list<wstring>& expandedArgs,
+    _In_ const wstring& currentDirectory,
+    _Out_ vector<wstring>& sources);
+
+// The files a compilation writes which are named on its command line. A
+// path is empty if the corresponding switch isn't given; the compiler
+// then derives the file name from the output assembly.
+struct OutputPaths
+{
+    wstring out;
+    wstring pdb;
+    wstring doc;
+    // Whether a PDB is written (/debug), whose path is recorded in the
+    // output assembly.
+    bool debug;
+};
+
+// Whether the compiler writes its output as UTF-8 (/utf8output).
+bool HasUtf8Output(_In_ const list<wstring>& expandedArgs);
+
+// Get the output paths named on the command line. As for the compiler, the
+// last occurrence of a switch wins. Returns false if the command line has
+// no /out switch or writes files other than these (/touchedfiles,
+// /bugreport), in which case not all outputs are known.
+bool GetOutputPaths(
+    _In_ const list<wstring>& expandedArgs,
+    _Out_ OutputPaths& paths);
@@ -0,0 +1,174 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include "build_manifest.h"
+#include "client_state.h"
+#include "fingerprint.h"
+#include "logging.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The directory in the client state directory which holds a manifest for
+// each output, named by a hash of the output's path.
+const wchar_t * const MANIFESTDIRECTORYNAME = L"manifests";
+
+// A manifest is UTF-16 text, since it holds compiler output. Its lines are
+// the key, then the exit code, whether the output is UTF-8 and the number
+// of outputs, then for each output its volume serial number, file index,
+// size, last write time and path, and then the lengths of the standard
+// output and standard error text, which follow.
+bool ReadManifestLine(
+    _In_ const wstring& text,
+    _Inout_ size_t& position,
+    _Out_ wstring& line)
+{
+    auto end = text.find(L'\n', position);
+    if (end == wstring::npos)
+    {
+        return false;
+    }
+
+    line = text.substr(position, end - position);
+    position = end + 1;
+    return true;
+}
+
+BuildManifest::BuildManifest(_In_ const wstring& stateDirectory)
+{
+    wstring enabled;
+    if (!stateDirectory.empty() && GetEnvVar(UPTODATECHECK_ENV_VAR, enabled) && enabled == L"1")
+    {
+        directory = stateDirectory + MANIFESTDIRECTORYNAME + L'\\';
+    }
+}
+
+bool BuildManifest::IsEnabled()
+{
+    return !directory.empty();
+}
+
+wstring BuildManifest::GetManifestPath(_In_ const CompilationKey& compilationKey)
+{
+    return directory + FormatHash(HashString(compilationKey.outputs[0]));
+}
+
+bool BuildManifest::IsUpToDate(
+    _In_ const CompilationKey& compilationKey,
+    _Out_ CompletedResponse& response)
+{
+    wstring text;
+    if (!IsEnabled() || !ReadUnicodeFile(GetManifestPath(compilationKey), text))
+    {
+        return false;
+    }
+
+    size_t position = 0;
+    wstring line;
+    if (!ReadManifestLine(text, position, line) || line != compilationKey.key
+        || !ReadManifestLine(text, position, line))
+    {
+        return false;
+    }
+
+    LPWSTR next;
+    auto exitCode = static_cast<int>(wcstol(line.c_str(), &next, 10));
+    auto utf8Output = wcstol(next, &next, 10) != 0;
+    auto outputCount = wcstoul(next, &next, 10);
+    if (outputCount == 0)
+    {
+        return false;
+    }
+
+    for (unsigned long i = 0; i < outputCount; i++)
+    {
+        if (!ReadManifestLine(text, position, line))
+        {
+            return false;
+        }
+
+        // Any change to an output, including its deletion, means a build
+        // step other than this compilation wrote it.
+        FileIdentity recorded;
+        recorded.volume = wcstoul(line.c_str(), &next, 10);
+        recorded.index = wcstoull(next, &next, 10);
+        recorded.size = wcstoull(next, &next, 10);
+        recorded.lastWriteTime = wcstoull(next, &next, 10);
+        FileIdentity current;
+        if (*next != L' ' || !GetFileIdentity(next + 1, current) || !(current == recorded))
+        {
+            return false;
+        }
+    }
+
+    if (!ReadManifestLine(text, position, line))
+    {
+        return false;
+    }
+
+    auto outputLength = wcstoul(line.c_str(), &next, 10);
+    auto errorLength = wcstoul(next, &next, 10);
+    if (text.size() - position != static_cast<size_t>(outputLength) + errorLength)
+    {
+        return false;
+    }
+
+    response = CompletedResponse(
+        exitCode,
+        utf8Output,
+        text.substr(position, outputLength),
+        text.substr(position + outputLength));
+    LogFormatted(IDS_OutputsUpToDate, compilationKey.outputs[0].c_str());
+    return true;
+}
+
+void BuildManifest::Record(
+    _In_ const CompilationKey& compilationKey,
+    _In_ const CompletedResponse& response)
+{
+    if (!IsEnabled() || response.ExitCode != 0)
+    {
+        return;
+    }
+
+    // Only outputs this compilation wrote are recorded. It must at least
+    // have written the assembly.
+    wstring outputLines;
+    unsigned long outputCount = 0;
+    for (auto& output : compilationKey.outputs)
+    {
+        FileIdentity identity;
+        if (!GetFileIdentity(output, identity) || identity.lastWriteTime < compilationKey.startTime)
+        {
+            if (outputCount == 0)
+            {
+                return;
+            }
+            continue;
+        }
+
+        outputLines += to_wstring(identity.volume)
+            + L' ' + to_wstring(identity.index)
+            + L' ' + to_wstring(identity.size)
+            + L' ' + to_wstring(identity.lastWriteTime)
+            + L' ' + output + L'\n';
+        outputCount++;
+    }
+
+    auto text = compilationKey.key + L'\n'
+        + to_wstring(response.ExitCode) + L' ' + (response.Utf8Output ? L'1' : L'0') + L' ' + to_wstring(outputCount) + L'\n'
+        + outputLines
+        + to_wstring(response.Output.size()) + L' ' + to_wstring(response.ErrorOutput.size()) + L'\n'
+        + response.Output
+        + response.ErrorOutput;
+
+    // Readers see either the old manifest or the new one, never a part.
+    auto path = GetManifestPath(compilationKey);
+    auto temporary = path + L'.' + to_wstring(GetCurrentProcessId()) + L".tmp";
+    if ((!CreateDirectoryW(directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        || !WriteUnicodeFile(temporary, text)
+        || !MoveFileExW(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        LogWin32Error(IDS_RecordManifestFailed);
+        DeleteFileW(temporary.c_str());
+    }
+}
@@ -0,0 +1,46 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include "compilation_key.h"
+#include "protocol.h"
+
+using namespace std;
+
+// Incremental builds often invoke the compiler for a project none of whose
+// inputs changed, for instance when a build system compares timestamps
+// coarsely. When the up-to-date check is enabled, the client records in a
+// manifest per output the key of the compilation which last wrote it, the
+// identities of the files it wrote and its output text. If a compilation
+// has the same key and its outputs haven't been touched since, the client
+// replays the recorded warnings and exits without compiling.
+
+// Set this environment variable to 1 to skip compilations whose outputs
+// are up to date.
+const wchar_t * const UPTODATECHECK_ENV_VAR = L"RoslynCommandLineUpToDateCheck";
+
+class BuildManifest
+{
+private:
+    wstring directory;
+
+    wstring GetManifestPath(_In_ const CompilationKey& compilationKey);
+
+public:
+    BuildManifest(_In_ const wstring& stateDirectory);
+
+    bool IsEnabled();
+
+    // Get the response of the compilation which last wrote the outputs.
+    // Returns false unless it had the same key and the outputs are
+    // unchanged since.
+    bool IsUpToDate(
+        _In_ const CompilationKey& compilationKey,
+        _Out_ CompletedResponse& response);
+
+    // Record the outputs of the compilation, which must have succeeded.
+    void Record(
+        _In_ const CompilationKey& compilationKey,
+        _In_ const CompletedResponse& response);
+};
@@ -0,0 +1,124 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <atomic>
+#include <mutex>
+#include "cancellation.h"
+#include "logging.h"
+#include "protocol.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// Set once the user cancels. The client exits soon after, so it's never reset.
+atomic<bool> cancelled(false);
+
+// The thread reading the response of the outstanding request, if any. The
+// lock keeps the console control handler from interrupting anything once
+// the reader is done with the pipe.
+mutex readerLock;
+HANDLE currentReaderThread = nullptr;
+
+// Set when the outstanding request runs out of time.
+atomic<bool> timedOut(false);
+
+// The reader may be between reads, so keep interrupting it until it's done
+// with the pipe.
+void InterruptReader()
+{
+    for (;;)
+    {
+        {
+            lock_guard<mutex> lock(readerLock);
+            if (currentReaderThread == nullptr)
+            {
+                break;
+            }
+            CancelSynchronousIo(currentReaderThread);
+        }
+        Sleep(10);
+    }
+}
+
+// Runs on a thread of its own when a console control event arrives.
+BOOL WINAPI HandleConsoleControl(DWORD)
+{
+    cancelled = true;
+    InterruptReader();
+    return TRUE;
+}
+
+// Runs on a thread pool thread when the request runs out of time.
+VOID CALLBACK HandleTimeout(PVOID, BOOLEAN)
+{
+    timedOut = true;
+    InterruptReader();
+}
+
+RequestCancellation::RequestCancellation(HANDLE pipeHandle, DWORD timeoutMs)
+    : pipeHandle(pipeHandle),
+      readerThread(OpenThread(THREAD_TERMINATE, FALSE, GetCurrentThreadId())),
+      timer(nullptr)
+{
+    timedOut = false;
+
+    if (readerThread == nullptr)
+    {
+        LogWin32Error(IDS_HandleCancellationFailed);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(readerLock);
+        currentReaderThread = readerThread.get();
+    }
+
+    if (!SetConsoleCtrlHandler(HandleConsoleControl, TRUE))
+    {
+        LogWin32Error(IDS_HandleCancellationFailed);
+    }
+
+    if (timeoutMs != INFINITE
+        && !CreateTimerQueueTimer(&timer, nullptr, HandleTimeout, nullptr, timeoutMs, 0, WT_EXECUTEONLYONCE))
+    {
+        LogWin32Error(IDS_HandleCancellationFailed);
+        timer = nullptr;
+    }
+}
+
+RequestCancellation::~RequestCancellation()
+{
+    if (readerThread == nullptr)
+    {
+        return;
+    }
+
+    SetConsoleCtrlHandler(HandleConsoleControl, FALSE);
+
+    {
+        lock_guard<mutex> lock(readerLock);
+        if (cancelled || timedOut)
+        {
+            Log(IDS_SendingCancel);
+            RealPipe wrapper(pipeHandle);
+            WriteCancelRequest(wrapper);
+        }
+        currentReaderThread = nullptr;
+    }
+
+    // Wait for the timeout handler, if it's running. It returns now that
+    // the reader is gone.
+    if (timer != nullptr)
+    {
+        DeleteTimerQueueTimer(nullptr, timer, INVALID_HANDLE_VALUE);
+    }
+}
+
+bool IsCompilationCancelled()
+{
+    return cancelled;
+}
+
+bool HasRequestTimedOut()
+{
+    return timedOut;
+}
@@ -0,0 +1,39 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include "smart_resources.h"
+
+// Pressing Ctrl+C, or closing the console, while the server compiles a
+// request would otherwise leave the server compiling for nobody, and the
+// server takes an unexplained disconnect as a sign that it should shut
+// down. While a request is outstanding the client handles console control
+// events instead: the read of the response is interrupted, the server is
+// sent a cancel frame and the client exits with CancelledExitCode. A
+// request with a deadline is given up on the same way once it passes.
+
+// The exit code of a client whose compilation was cancelled, the same as
+// that of a process ended by Ctrl+C.
+const int CancelledExitCode = STATUS_CONTROL_C_EXIT;
+
+// Handles console control events while it exists, and interrupts the read
+// once timeoutMs have passed. Create it on the thread which reads the
+// response, once the request has been sent. If the user cancelled or the
+// time ran out while it existed, the cancel frame is sent when it goes away.
+class RequestCancellation
+{
+private:
+    HANDLE pipeHandle;
+    SmartHandle readerThread;
+    HANDLE timer;
+
+public:
+    RequestCancellation(HANDLE pipeHandle, DWORD timeoutMs);
+    ~RequestCancellation();
+};
+
+// Whether the user cancelled an outstanding request.
+bool IsCompilationCancelled();
+
+// Whether the last outstanding request ran out of time.
+bool HasRequestTimedOut();
@@ -0,0 +1,286 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include "client_state.h"
+#include "logging.h"
+#include "native_client.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The name of the directory under the temp path which holds client state.
+const wchar_t * const STATEDIRECTORYNAME = L"VBCSCompiler";
+
+const DWORD StateFileLockTimeoutMs = 1000;    // State files are only ever locked briefly.
+
+unsigned long long HashString(_In_ const wstring& value)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (auto ch : value)
+    {
+        hash ^= static_cast<unsigned long long>(towlower(ch));
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+wstring FormatHash(unsigned long long hash)
+{
+    wchar_t buffer[17];
+    StringCchPrintfW(buffer, _countof(buffer), L"%016llx", hash);
+    return wstring(buffer);
+}
+
+bool CreateDirectoryIfMissing(_In_ const wstring& path)
+{
+    if (CreateDirectoryW(path.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        return true;
+    }
+
+    LogWin32Error(IDS_CreateStateDirectoryFailed);
+    return false;
+}
+
+bool GetClientStateDirectory(
+    _In_ const wstring& serverPath,
+    _Out_ wstring& stateDirectory)
+{
+    // The temp path is already specific to the user. Servers from different
+    // installs get different directories so they never share state.
+    stateDirectory = GetTempPath();
+    stateDirectory += STATEDIRECTORYNAME;
+    if (!CreateDirectoryIfMissing(stateDirectory))
+    {
+        return false;
+    }
+
+    stateDirectory += L'\\';
+    stateDirectory += FormatHash(HashString(serverPath));
+    if (!CreateDirectoryIfMissing(stateDirectory))
+    {
+        return false;
+    }
+
+    stateDirectory += L'\\';
+    return true;
+}
+
+LockedStateFile::LockedStateFile(_In_ const wstring& path)
+    : handle(CreateFileW(
+        path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr, // security attributes
+        OPEN_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr)) // no template file
+{
+    if (handle.get() == INVALID_HANDLE_VALUE)
+    {
+        LogWin32Error(IDS_OpenStateFileFailed);
+        handle.reset(nullptr);
+        return;
+    }
+
+#pragma warning(suppress: 28159)
+    DWORD startTicks = GetTickCount();
+    for (;;)
+    {
+        OVERLAPPED overlapped = {};
+        if (LockFileEx(handle.get(),
+                       LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY,
+                       0, // reserved
+                       MAXDWORD,
+                       MAXDWORD,
+                       &overlapped))
+        {
+            return;
+        }
+
+#pragma warning(suppress: 28159)
+        if (GetLastError() != ERROR_LOCK_VIOLATION
+            || GetTickCount() - startTicks > StateFileLockTimeoutMs)
+        {
+            LogWin32Error(IDS_LockStateFileFailed);
+            handle.reset(nullptr);
+            return;
+        }
+
+        Sleep(1);
+    }
+}
+
+bool LockedStateFile::IsLocked()
+{
+    return handle != nullptr;
+}
+
+bool LockedStateFile::ReadLines(_Out_ vector<wstring>& lines)
+{
+    lines.clear();
+    if (!IsLocked())
+    {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle.get(), &size) || size.HighPart != 0)
+    {
+        return false;
+    }
+
+    string bytes;
+    bytes.resize(size.LowPart);
+
+    DWORD read = 0;
+    if (size.LowPart != 0
+        && (!ReadFile(handle.get(), &bytes[0], size.LowPart, &read, nullptr) || read != size.LowPart))
+    {
+        LogWin32Error(IDS_ReadStateFileFailed);
+        return false;
+    }
+
+    wstring text;
+    if (!bytes.empty())
+    {
+        auto charsNeeded = MultiByteToWideChar(CP_UTF8, 0, bytes.data(), (int)bytes.size(), nullptr, 0);
+        text.resize(charsNeeded);
+        MultiByteToWideChar(CP_UTF8, 0, bytes.data(), (int)bytes.size(), &text[0], charsNeeded);
+    }
+
+    size_t start = 0;
+    while (start < text.size())
+    {
+        auto end = text.find(L'\n', start);
+        if (end == wstring::npos)
+        {
+            end = text.size();
+        }
+
+        auto line = text.substr(start, end - start);
+        if (!line.empty() && line.back() == L'\r')
+        {
+            line.pop_back();
+        }
+
+        if (!line.empty())
+        {
+            lines.push_back(move(line));
+        }
+        start = end + 1;
+    }
+
+    return true;
+}
+
+bool LockedStateFile::WriteLines(_In_ const vector<wstring>& lines)
+{
+    if (!IsLocked())
+    {
+        return false;
+    }
+
+    wstring text;
+    for (auto& line : lines)
+    {
+        text += line;
+        text += L"\r\n";
+    }
+
+    string bytes;
+    if (!text.empty())
+    {
+        auto bytesNeeded = WideCharToMultiByte(CP_UTF8, 0, text.data(), (int)text.size(), nullptr, 0, nullptr, nullptr);
+        bytes.resize(bytesNeeded);
+        WideCharToMultiByte(CP_UTF8, 0, text.data(), (int)text.size(), &bytes[0], bytesNeeded, nullptr, nullptr);
+    }
+
+    LARGE_INTEGER start = {};
+    DWORD written = 0;
+    if (!SetFilePointerEx(handle.get(), start, nullptr, FILE_BEGIN)
+        || !SetEndOfFile(handle.get())
+        || (!bytes.empty()
+            && (!WriteFile(handle.get(), bytes.data(), (DWORD)bytes.size(), &written, nullptr)
+                || written != bytes.size())))
+    {
+        LogWin32Error(IDS_WriteStateFileFailed);
+        return false;
+    }
+
+    return true;
+}
+
+ULONGLONG ToFileTime(_In_ const FILETIME& time)
+{
+    ULARGE_INTEGER value;
+    value.LowPart = time.dwLowDateTime;
+    value.HighPart = time.dwHighDateTime;
+    return value.QuadPart;
+}
+
+ULONGLONG GetCurrentFileTime()
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ToFileTime(now);
+}
+
+bool ReadUnicodeFile(_In_ const wstring& path, _Out_ wstring& text)
+{
+    text.clear();
+
+    SmartHandle file(CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        nullptr, // security attributes
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr)); // no template file
+    LARGE_INTEGER size;
+    if (file.get() == INVALID_HANDLE_VALUE || !GetFileSizeEx(file.get(), &size) || size.HighPart != 0)
+    {
+        return false;
+    }
+
+    text.resize(size.LowPart / sizeof(wchar_t));
+    DWORD read = 0;
+    return text.empty()
+        || (ReadFile(file.get(), &text[0], size.LowPart, &read, nullptr) && read == size.LowPart);
+}
+
+bool WriteUnicodeFile(_In_ const wstring& path, _In_ const wstring& text)
+{
+    SmartHandle file(CreateFileW(
+        path.c_str(),
+        GENERIC_WRITE,
+        0, // no sharing
+        nullptr, // security attributes
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr)); // no template file
+    auto size = static_cast<DWORD>(text.size() * sizeof(wchar_t));
+    DWORD written = 0;
+    return file.get() != INVALID_HANDLE_VALUE
+        && (size == 0 || (WriteFile(file.get(), text.data(), size, &written, nullptr) && written == size));
+}
+
+void DeleteDirectoryFiles(_In_ const wstring& directory)
+{
+    WIN32_FIND_DATAW findData;
+    auto findHandle = FindFirstFileW((directory + L"*").c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            DeleteFileW((directory + findData.cFileName).c_str());
+        }
+    } while (FindNextFileW(findHandle, &findData));
+
+    FindClose(findHandle);
+}
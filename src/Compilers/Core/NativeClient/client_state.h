@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <string>
+#include <vector>
+#include "smart_resources.h"
+
+using namespace std;
+
+// Returns a 64-bit FNV-1a hash of the given string, ignoring case.
+unsigned long long HashString(_In_ const wstring& value);
+
+// Formats a hash value as a fixed width hexadecimal string.
+wstring FormatHash(unsigned long long hash);
+
+// Get the directory which holds the state shared between all clients of
+// the same user that talk to the server at the given path. The directory
+// is created if it doesn't exist.
+bool GetClientStateDirectory(
+    _In_ const wstring& serverPath,
+    _Out_ wstring& stateDirectory);
+
+// Delete the files in a directory, which must end with a backslash and is
+// expected to hold no subdirectories.
+void DeleteDirectoryFiles(_In_ const wstring& directory);
+
+// File times count 100 nanosecond intervals.
+const ULONGLONG FileTimeUnitsPerMs = 10000;
+
+// Get the current time in UTC file time units, the form in which state
+// files record times.
+ULONGLONG GetCurrentFileTime();
+
+ULONGLONG ToFileTime(_In_ const FILETIME& time);
+
+// Read or write a whole file of UTF-16 text, for files which hold
+// compiler output and so may contain any character.
+bool ReadUnicodeFile(_In_ const wstring& path, _Out_ wstring& text);
+bool WriteUnicodeFile(_In_ const wstring& path, _In_ const wstring& text);
+
+// A small text file in the client state directory. The file is held under
+// an exclusive lock for the lifetime of this object so that concurrent
+// clients see consistent read-modify-write cycles. State files only
+// ever hold hints, so failing to lock one is never fatal.
+class LockedStateFile
+{
+private:
+    SmartHandle handle;
+
+public:
+    LockedStateFile(_In_ const wstring& path);
+    bool IsLocked();
+    bool ReadLines(_Out_ vector<wstring>& lines);
+    bool WriteLines(_In_ const vector<wstring>& lines);
+};
@@ -0,0 +1,187 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include "client_state.h"
+#include "coalescing.h"
+#include "fingerprint.h"
+#include "logging.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The directory in the client state directory which holds the published
+// response to each request, named by its key.
+const wchar_t * const COALESCEDDIRECTORYNAME = L"coalesced";
+
+// Published responses older than this are no longer of use to anybody.
+const ULONGLONG StaleResponseMs = 60 * 60 * 1000;
+
+// The longest a client without a deadline waits for an identical request.
+// Longer than any sane compilation, but a hung client doesn't hang every
+// later one with it.
+const DWORD MaxJoinWaitMs = 10 * 60 * 1000;
+
+// The key of a request is a hash of the compilation's key, which covers
+// its expanded arguments and the contents of every file it reads, along
+// with the server it would be sent to.
+wstring GetRequestKey(
+    _In_ const CompilationKey& compilationKey,
+    _In_ const wstring& serverPath)
+{
+    // The terminator keeps the strings from running together.
+    auto request = compilationKey.key + L'\0' + serverPath;
+    return FormatHash(HashBuffer(request.data(), request.size() * sizeof(wchar_t)));
+}
+
+// A published response is the exit code, whether the output is UTF-8 and
+// the lengths of the standard output and standard error text, which follow
+// the first line.
+bool ReadPublishedResponse(
+    _In_ const wstring& path,
+    ULONGLONG publishedAfter,
+    _Out_ CompletedResponse& response)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    wstring text;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes)
+        || ToFileTime(attributes.ftLastWriteTime) < publishedAfter
+        || !ReadUnicodeFile(path, text))
+    {
+        return false;
+    }
+
+    auto position = text.find(L'\n');
+    if (position == wstring::npos)
+    {
+        return false;
+    }
+
+    LPWSTR next;
+    auto exitCode = static_cast<int>(wcstol(text.c_str(), &next, 10));
+    auto utf8Output = wcstol(next, &next, 10) != 0;
+    auto outputLength = wcstoul(next, &next, 10);
+    auto errorLength = wcstoul(next, &next, 10);
+    position++;
+    if (text.size() - position != static_cast<size_t>(outputLength) + errorLength)
+    {
+        return false;
+    }
+
+    response = CompletedResponse(
+        exitCode,
+        utf8Output,
+        text.substr(position, outputLength),
+        text.substr(position + outputLength));
+    return true;
+}
+
+// Delete responses published long ago.
+void DeleteStaleResponses(_In_ const wstring& directory)
+{
+    auto now = GetCurrentFileTime();
+    WIN32_FIND_DATAW findData;
+    auto findHandle = FindFirstFileW((directory + L"*").c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            && now - ToFileTime(findData.ftLastWriteTime) > StaleResponseMs * FileTimeUnitsPerMs)
+        {
+            DeleteFileW((directory + findData.cFileName).c_str());
+        }
+    } while (FindNextFileW(findHandle, &findData));
+    FindClose(findHandle);
+}
+
+CoalescedCompilation::CoalescedCompilation(_In_ const wstring& stateDirectory)
+    : waitStart(0)
+{
+    wstring enabled;
+    if (!stateDirectory.empty() && GetEnvVar(COALESCING_ENV_VAR, enabled) && enabled == L"1")
+    {
+        this->stateDirectory = stateDirectory;
+        directory = stateDirectory + COALESCEDDIRECTORYNAME + L'\\';
+    }
+}
+
+bool CoalescedCompilation::IsEnabled()
+{
+    return !directory.empty();
+}
+
+bool CoalescedCompilation::Claim(
+    _In_ const CompilationKey& compilationKey,
+    _In_ const wstring& serverPath)
+{
+    // The state directory is per user, so its hash keeps the mutexes of
+    // different users apart.
+    auto key = GetRequestKey(compilationKey, serverPath);
+    auto mutexName = L"VBCSCompiler/" + FormatHash(HashString(stateDirectory)) + L"/coalesce/" + key;
+    resultPath = directory + key;
+
+    waitStart = GetCurrentFileTime();
+    mutex.reset(new SmartMutex(mutexName.c_str()));
+    if (mutex->HoldsMutex())
+    {
+        return true;
+    }
+
+    LogFormatted(IDS_WaitingForIdenticalRequest, key.c_str());
+    return false;
+}
+
+bool CoalescedCompilation::Join(
+    ULONGLONG deadlineTicks,
+    _Out_ CompletedResponse& response)
+{
+    DWORD waitTime = MaxJoinWaitMs;
+    if (deadlineTicks != 0)
+    {
+        auto now = GetTickCount64();
+        waitTime = deadlineTicks > now
+            ? static_cast<DWORD>(min<ULONGLONG>(deadlineTicks - now, MaxJoinWaitMs))
+            : 0;
+    }
+    if (!mutex->Wait(waitTime))
+    {
+        return false;
+    }
+
+    // Only a response published while this client waited answers its
+    // request. Without one the request is this client's to compile.
+    if (!ReadPublishedResponse(resultPath, waitStart, response))
+    {
+        return false;
+    }
+
+    Log(IDS_ReplayedIdenticalRequest);
+    mutex->release();
+    return true;
+}
+
+void CoalescedCompilation::Publish(_In_ const CompletedResponse& response)
+{
+    if (!mutex || !mutex->HoldsMutex())
+    {
+        return;
+    }
+
+    auto text = to_wstring(response.ExitCode) + L' ' + (response.Utf8Output ? L'1' : L'0')
+        + L' ' + to_wstring(response.Output.size())
+        + L' ' + to_wstring(response.ErrorOutput.size()) + L'\n'
+        + response.Output
+        + response.ErrorOutput;
+    if ((!CreateDirectoryW(directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        || !WriteUnicodeFile(resultPath, text))
+    {
+        LogWin32Error(IDS_PublishResponseFailed);
+        DeleteFileW(resultPath.c_str());
+        return;
+    }
+
+    DeleteStaleResponses(directory);
+}
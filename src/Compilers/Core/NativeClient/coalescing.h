@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <list>
+#include <memory>
+#include <string>
+#include "compilation_key.h"
+#include "protocol.h"
+#include "smart_resources.h"
+
+using namespace std;
+
+// Parallel builds sometimes run the same compilation twice at once, for
+// instance for a project referenced from two solution configurations.
+// Rather than have the server compile it twice, a client claims its
+// request by creating a named mutex for the request's key, a hash of the
+// compilation key and the server, and holds the mutex until it is done.
+// Only compilations with a key are coalesced, since only their inputs are
+// known. A client with an identical request finds the mutex taken, waits
+// for it and then replays the response the first client published in the
+// client state directory, which is per user. The first client publishes
+// the response whether the server or the fallback compiler produced it.
+// If there is no response, because the first client failed, the waiting
+// client compiles the request itself while holding the mutex. A client
+// waits no longer than its deadline, or ten minutes without one, in case
+// the first client hangs.
+
+// Set this environment variable to 1 to wait for identical requests
+// instead of compiling them again.
+const wchar_t * const COALESCING_ENV_VAR = L"RoslynCommandLineCoalescing";
+
+class CoalescedCompilation
+{
+private:
+    wstring stateDirectory;
+    wstring directory;
+    wstring resultPath;
+    ULONGLONG waitStart;
+    unique_ptr<SmartMutex> mutex;
+
+public:
+    CoalescedCompilation(_In_ const wstring& stateDirectory);
+
+    bool IsEnabled();
+
+    // Claim the request. Returns false if another client claimed it first,
+    // in which case Join waits for that client.
+    bool Claim(
+        _In_ const CompilationKey& compilationKey,
+        _In_ const wstring& serverPath);
+
+    // Wait until the client which claimed the request first is done and
+    // get the response it published. Returns false if the request should
+    // be compiled, in which case it is claimed unless the wait ran out of
+    // time.
+    bool Join(
+        ULONGLONG deadlineTicks,
+        _Out_ CompletedResponse& response);
+
+    // Publish the response to the claimed request for clients waiting on
+    // it.
+    void Publish(_In_ const CompletedResponse& response);
+};
@@ -0,0 +1,347 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include <wincrypt.h>
+#include "arguments.h"
+#include "client_state.h"
+#include "compilation_key.h"
+#include "fingerprint.h"
+#include "logging.h"
+
+using namespace std;
+
+// Part of every key, so that clients never use a result recorded by a
+// client which computed keys or stored results differently.
+const wchar_t * const COMPILATIONKEYFORMAT = L"2";
+
+// Switches whose value is a list of files the compilation reads, separated
+// by ',' or ';'.
+LPCWSTR InputListSwitches[] = {
+    L"reference", L"r", L"link", L"l", L"addmodule", L"analyzer", L"a", L"additionalfile",
+};
+
+// Switches whose value is a file the compilation reads, optionally
+// followed by ',' and further options.
+LPCWSTR InputFileSwitches[] = {
+    L"resource", L"res", L"linkresource", L"linkres", L"keyfile", L"win32icon",
+    L"win32res", L"win32manifest", L"ruleset", L"appconfig", L"vbruntime",
+};
+
+// Switches after which the files a compilation reads or writes can't be
+// told from its command line.
+LPCWSTR UncacheableSwitches[] = {
+    L"recurse", L"keycontainer", L"errorlog", L"sdkpath",
+};
+
+// Whether the arguments include the given switch without a value, as in
+// "/noconfig" or "-nostdlib+".
+bool HasSwitch(_In_ const list<wstring>& args, _In_z_ LPCWSTR switchName)
+{
+    for (auto& arg : args)
+    {
+        if (arg.size() > 1
+            && (arg[0] == L'/' || arg[0] == L'-')
+            && (_wcsicmp(arg.c_str() + 1, switchName) == 0
+                || (_wcsnicmp(arg.c_str() + 1, switchName, wcslen(switchName)) == 0
+                    && arg.substr(wcslen(switchName) + 1) == L"+")))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Add the files named in a switch value to the inputs. The value is either
+// a list, or a single file which may be followed by other options.
+void AddSwitchInputs(
+    _In_ const wstring& value,
+    bool isList,
+    _In_ const wstring& currentDirectory,
+    _Inout_ vector<wstring>& inputs)
+{
+    size_t start = 0;
+    while (start < value.size())
+    {
+        auto end = value.find_first_of(isList ? L",;" : L",", start);
+        if (end == wstring::npos)
+        {
+            end = value.size();
+        }
+
+        auto input = value.substr(start, end - start);
+        input.erase(remove(input.begin(), input.end(), L'"'), input.end());
+        if (!input.empty() && input != L"+" && input != L"-")
+        {
+            inputs.push_back(MakeAbsolutePath(input, currentDirectory));
+        }
+
+        if (!isList)
+        {
+            break;
+        }
+        start = end + 1;
+    }
+}
+
+// Get the files a compilation reads, other than the response files which
+// have been expanded. Returns false if they can't all be determined.
+bool GetInputFiles(
+    _In_ const list<wstring>& expandedArgs,
+    _In_ const wstring& currentDirectory,
+    _Out_ vector<wstring>& inputs)
+{
+    inputs.clear();
+
+    // Without these the compiler reads a response file and references of
+    // its own choosing.
+    if (!HasSwitch(expandedArgs, L"noconfig") || !HasSwitch(expandedArgs, L"nostdlib"))
+    {
+        return false;
+    }
+
+    for (auto& arg : expandedArgs)
+    {
+        if (arg.empty())
+        {
+            continue;
+        }
+
+        if (arg[0] != L'/' && arg[0] != L'-')
+        {
+            if (arg.find_first_of(L"*?") != wstring::npos)
+            {
+                return false;
+            }
+            continue;
+        }
+
+        wstring value;
+        for (auto switchName : UncacheableSwitches)
+        {
+            if (TryGetSwitchValue(arg, switchName, value) || _wcsicmp(arg.c_str() + 1, switchName) == 0)
+            {
+                return false;
+            }
+        }
+
+        for (auto switchName : InputListSwitches)
+        {
+            if (TryGetSwitchValue(arg, switchName, value))
+            {
+                AddSwitchInputs(value, true, currentDirectory, inputs);
+            }
+        }
+
+        for (auto switchName : InputFileSwitches)
+        {
+            if (TryGetSwitchValue(arg, switchName, value))
+            {
+                AddSwitchInputs(value, false, currentDirectory, inputs);
+            }
+        }
+    }
+
+    vector<wstring> sources;
+    GetSourceFiles(expandedArgs, currentDirectory, sources);
+    inputs.insert(inputs.end(), sources.begin(), sources.end());
+    return true;
+}
+
+// Computes the SHA-256 hash of everything that goes into a key.
+class KeyHasher
+{
+private:
+    HCRYPTPROV provider;
+    HCRYPTHASH hash;
+
+public:
+    KeyHasher()
+        : provider(0), hash(0)
+    {
+        if (!CryptAcquireContextW(&provider, nullptr, nullptr, PROV_RSA_AES, CRYPT_VERIFYCONTEXT))
+        {
+            provider = 0;
+        }
+        else if (!CryptCreateHash(provider, CALG_SHA_256, 0, 0, &hash))
+        {
+            hash = 0;
+        }
+    }
+
+    ~KeyHasher()
+    {
+        if (hash != 0)
+        {
+            CryptDestroyHash(hash);
+        }
+        if (provider != 0)
+        {
+            CryptReleaseContext(provider, 0);
+        }
+    }
+
+    bool Add(_In_reads_bytes_(size) const void * data, DWORD size)
+    {
+        return hash != 0 && CryptHashData(hash, static_cast<const BYTE*>(data), size, 0);
+    }
+
+    // The terminator is included so that adjacent strings can't run together.
+    bool Add(_In_ const wstring& value)
+    {
+        return Add(value.c_str(), static_cast<DWORD>((value.size() + 1) * sizeof(wchar_t)));
+    }
+
+    // Get the first half of the hash in hexadecimal, which is plenty to
+    // tell compilations apart and keeps entry names short.
+    bool Finish(_Out_ wstring& digest)
+    {
+        digest.clear();
+
+        BYTE value[32];
+        DWORD size = sizeof(value);
+        if (hash == 0 || !CryptGetHashParam(hash, HP_HASHVAL, value, &size, 0) || size != sizeof(value))
+        {
+            return false;
+        }
+
+        for (DWORD i = 0; i < size / 2; i++)
+        {
+            wchar_t hex[3];
+            StringCchPrintfW(hex, _countof(hex), L"%02x", value[i]);
+            digest += hex;
+        }
+        return true;
+    }
+};
+
+// Add the name, size and time of every file in the client's directory,
+// which holds the compiler, so that a different compiler gets different keys.
+bool AddCompilerFiles(_Inout_ KeyHasher& hasher)
+{
+    wchar_t modulePath[MAX_PATH];
+    auto length = GetModuleFileNameW(nullptr, modulePath, _countof(modulePath));
+    if (length == 0 || length == _countof(modulePath))
+    {
+        return false;
+    }
+
+    wstring directory(modulePath, length);
+    directory.erase(directory.find_last_of(L'\\') + 1);
+    if (!hasher.Add(directory))
+    {
+        return false;
+    }
+
+    WIN32_FIND_DATAW findData;
+    auto findHandle = FindFirstFileW((directory + L"*").c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    vector<wstring> files;
+    do
+    {
+        if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            files.push_back(wstring(findData.cFileName)
+                + L' ' + to_wstring(ToFileTime(findData.ftLastWriteTime))
+                + L' ' + to_wstring(findData.nFileSizeLow));
+        }
+    } while (FindNextFileW(findHandle, &findData));
+    FindClose(findHandle);
+
+    sort(files.begin(), files.end());
+    for (auto& file : files)
+    {
+        if (!hasher.Add(file))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GetCompilationKey(
+    RequestLanguage language,
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& currentDirectory,
+    _In_ const wstring& stateDirectory,
+    _Out_ CompilationKey& compilationKey)
+{
+    compilationKey.key.clear();
+    compilationKey.outputs.clear();
+
+    // Anything written from now on may be an output of the compilation.
+    compilationKey.startTime = GetCurrentFileTime();
+
+    list<wstring> expandedArgs;
+    ExpandResponseFiles(commandLineArgs, currentDirectory, expandedArgs);
+
+    OutputPaths paths;
+    vector<wstring> inputs;
+    if (!GetOutputPaths(expandedArgs, paths) || !GetInputFiles(expandedArgs, currentDirectory, inputs))
+    {
+        return false;
+    }
+
+    // The compiler writes the PDB next to the assembly unless told otherwise.
+    auto& outputs = compilationKey.outputs;
+    outputs.push_back(MakeAbsolutePath(paths.out, currentDirectory));
+    if (!paths.pdb.empty())
+    {
+        outputs.push_back(MakeAbsolutePath(paths.pdb, currentDirectory));
+    }
+    else
+    {
+        auto pdb = outputs[0];
+        auto extension = pdb.find_last_of(L".\\");
+        if (extension != wstring::npos && pdb[extension] == L'.')
+        {
+            pdb.erase(extension);
+        }
+        outputs.push_back(pdb + L".pdb");
+    }
+    if (!paths.doc.empty())
+    {
+        outputs.push_back(MakeAbsolutePath(paths.doc, currentDirectory));
+    }
+
+    wstring libEnvVariable;
+    GetEnvVar(L"LIB", libEnvVariable);
+
+    KeyHasher hasher;
+    if (!hasher.Add(COMPILATIONKEYFORMAT)
+        || !hasher.Add(&language, sizeof(language))
+        || !AddCompilerFiles(hasher)
+        || !hasher.Add(currentDirectory)
+        || !hasher.Add(libEnvVariable))
+    {
+        return false;
+    }
+
+    for (auto& arg : expandedArgs)
+    {
+        if (!hasher.Add(arg))
+        {
+            return false;
+        }
+    }
+
+    vector<Fingerprint> fingerprints;
+    if (!GetFileFingerprints(stateDirectory, currentDirectory, inputs, fingerprints))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (!hasher.Add(inputs[i]) || !hasher.Add(&fingerprints[i], sizeof(fingerprints[i])))
+        {
+            return false;
+        }
+    }
+
+    return hasher.Finish(compilationKey.key);
+}
@@ -0,0 +1,37 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <list>
+#include <string>
+#include <vector>
+#include "protocol.h"
+
+using namespace std;
+
+// Client features which reuse the result of an earlier compilation, like
+// the result cache and the up-to-date check, need to know that nothing the
+// compilation reads has changed since. The key of a compilation is a hash
+// of its arguments, the compiler and every file it reads, the latter by
+// their fingerprints. Only compilations whose inputs can all be told from
+// the command line have a key.
+struct CompilationKey
+{
+    wstring key;
+    // The files the compilation may write, in a fixed order: the assembly,
+    // its PDB and, if requested, its documentation file.
+    vector<wstring> outputs;
+    // When the key was computed. Outputs written since were written by
+    // this compilation.
+    ULONGLONG startTime;
+};
+
+// Compute the key of a compilation. Returns false if the compilation
+// reads files which can't be determined from its command line, or if any
+// of its inputs can't be read.
+bool GetCompilationKey(
+    RequestLanguage language,
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& currentDirectory,
+    _In_ const wstring& stateDirectory,
+    _Out_ CompilationKey& compilationKey);
@@ -0,0 +1,426 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "client_state.h"
+#include "fingerprint.h"
+#include "logging.h"
+#include "smart_resources.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The directory in the client state directory which holds a file of
+// remembered fingerprints for each scope.
+const wchar_t * const FINGERPRINTDIRECTORYNAME = L"fingerprints";
+
+// Number of files whose fingerprints are remembered per scope. Files not
+// asked about for the longest are forgotten first.
+const size_t MaxRememberedFingerprints = 20000;
+
+// A file written this recently may be written again without its last
+// write time changing, so its fingerprint isn't remembered.
+const ULONGLONG UnsettledFileMs = 2000;
+
+// Files are mapped a view of this size at a time, so that large files fit
+// in the address space of a 32-bit process.
+const ULONGLONG FingerprintViewSize = 64 * 1024 * 1024;
+
+// Hash this few files on the calling thread alone.
+const size_t FilesPerFingerprintThread = 16;
+
+// The hash is XXH64. Its four independent lanes of 64-bit multiplies keep
+// the processor busy on several 8 byte words at once, which makes it many
+// times faster than a cryptographic hash. Nothing here relies on it being
+// hard to find collisions.
+const unsigned long long Prime1 = 0x9E3779B185EBCA87ULL;
+const unsigned long long Prime2 = 0xC2B2AE3D27D4EB4FULL;
+const unsigned long long Prime3 = 0x165667B19E3779F9ULL;
+const unsigned long long Prime4 = 0x85EBCA77C2B2AE63ULL;
+const unsigned long long Prime5 = 0x27D4EB2F165667C5ULL;
+
+// Each of the four lanes consumes 8 bytes of every 32 byte stripe.
+const size_t StripeSize = 32;
+
+inline unsigned long long RotateLeft(unsigned long long value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+inline unsigned long long Read64(_In_reads_bytes_(8) const BYTE * data)
+{
+    unsigned long long value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline unsigned long long Read32(_In_reads_bytes_(4) const BYTE * data)
+{
+    UINT32 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline unsigned long long Round(unsigned long long lane, unsigned long long input)
+{
+    lane += input * Prime2;
+    lane = RotateLeft(lane, 31);
+    return lane * Prime1;
+}
+
+inline unsigned long long MergeRound(unsigned long long hash, unsigned long long lane)
+{
+    hash ^= Round(0, lane);
+    return hash * Prime1 + Prime4;
+}
+
+// The state of a hash computed over a sequence of buffers. Every buffer
+// but the last must be a whole number of stripes.
+class StreamingHash
+{
+private:
+    unsigned long long lanes[4];
+    unsigned long long length;
+
+public:
+    StreamingHash()
+        : length(0)
+    {
+        lanes[0] = Prime1 + Prime2;
+        lanes[1] = Prime2;
+        lanes[2] = 0;
+        lanes[3] = 0 - Prime1;
+    }
+
+    void Update(_In_reads_bytes_(size) const BYTE * data, size_t size)
+    {
+        length += size;
+        for (auto end = data + size - size % StripeSize; data < end; data += StripeSize)
+        {
+            lanes[0] = Round(lanes[0], Read64(data));
+            lanes[1] = Round(lanes[1], Read64(data + 8));
+            lanes[2] = Round(lanes[2], Read64(data + 16));
+            lanes[3] = Round(lanes[3], Read64(data + 24));
+        }
+    }
+
+    // Get the hash, given the last buffer passed to Update.
+    Fingerprint Finish(_In_reads_bytes_(size) const BYTE * data, size_t size)
+    {
+        unsigned long long hash;
+        if (length >= StripeSize)
+        {
+            hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7)
+                + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+            for (auto lane : lanes)
+            {
+                hash = MergeRound(hash, lane);
+            }
+        }
+        else
+        {
+            hash = Prime5;
+        }
+        hash += length;
+
+        // The bytes after the last whole stripe.
+        auto tail = data + size - size % StripeSize;
+        auto end = data + size;
+        for (; tail + 8 <= end; tail += 8)
+        {
+            hash ^= Round(0, Read64(tail));
+            hash = RotateLeft(hash, 27) * Prime1 + Prime4;
+        }
+        if (tail + 4 <= end)
+        {
+            hash ^= Read32(tail) * Prime1;
+            hash = RotateLeft(hash, 23) * Prime2 + Prime3;
+            tail += 4;
+        }
+        for (; tail < end; tail++)
+        {
+            hash ^= *tail * Prime5;
+            hash = RotateLeft(hash, 11) * Prime1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= Prime2;
+        hash ^= hash >> 29;
+        hash *= Prime3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+};
+
+Fingerprint HashBuffer(
+    _In_reads_bytes_(size) const void * data,
+    size_t size)
+{
+    StreamingHash hash;
+    hash.Update(static_cast<const BYTE*>(data), size);
+    return hash.Finish(static_cast<const BYTE*>(data), size);
+}
+
+// Get the identity of an open file.
+bool GetHandleIdentity(HANDLE file, _Out_ FileIdentity& identity)
+{
+    BY_HANDLE_FILE_INFORMATION information;
+    if (!GetFileInformationByHandle(file, &information))
+    {
+        return false;
+    }
+
+    identity.volume = information.dwVolumeSerialNumber;
+    identity.index = (static_cast<ULONGLONG>(information.nFileIndexHigh) << 32) | information.nFileIndexLow;
+    identity.size = (static_cast<ULONGLONG>(information.nFileSizeHigh) << 32) | information.nFileSizeLow;
+    identity.lastWriteTime = ToFileTime(information.ftLastWriteTime);
+    return true;
+}
+
+bool GetFileIdentity(
+    _In_ const wstring& path,
+    _Out_ FileIdentity& identity)
+{
+    SmartHandle file(CreateFileW(
+        path.c_str(),
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, // security attributes
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr)); // no template file
+    return file.get() != INVALID_HANDLE_VALUE && GetHandleIdentity(file.get(), identity);
+}
+
+struct RememberedFingerprint
+{
+    FileIdentity identity;
+    Fingerprint fingerprint;
+};
+
+// A line of the state file is the fingerprint, the volume serial number,
+// file index, size and last write time, then the path.
+bool ParseRememberedFingerprint(
+    _In_ const wstring& line,
+    _Out_ wstring& path,
+    _Out_ RememberedFingerprint& remembered)
+{
+    LPWSTR next;
+    remembered.fingerprint = wcstoull(line.c_str(), &next, 16);
+    remembered.identity.volume = wcstoul(next, &next, 10);
+    remembered.identity.index = wcstoull(next, &next, 10);
+    remembered.identity.size = wcstoull(next, &next, 10);
+    remembered.identity.lastWriteTime = wcstoull(next, &next, 10);
+    if (*next != L' ')
+    {
+        return false;
+    }
+
+    path.assign(next + 1);
+    return !path.empty();
+}
+
+wstring FormatRememberedFingerprint(
+    _In_ const wstring& path,
+    _In_ const RememberedFingerprint& remembered)
+{
+    return FormatHash(remembered.fingerprint)
+        + L' ' + to_wstring(remembered.identity.volume)
+        + L' ' + to_wstring(remembered.identity.index)
+        + L' ' + to_wstring(remembered.identity.size)
+        + L' ' + to_wstring(remembered.identity.lastWriteTime)
+        + L' ' + path;
+}
+
+// Get a file's identity and, unless it matches the remembered one, hash
+// its contents.
+bool FingerprintFile(
+    _In_ const wstring& path,
+    _In_opt_ const RememberedFingerprint * remembered,
+    _Out_ RememberedFingerprint& result)
+{
+    SmartHandle file(CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr, // security attributes
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr)); // no template file
+    if (file.get() == INVALID_HANDLE_VALUE || !GetHandleIdentity(file.get(), result.identity))
+    {
+        return false;
+    }
+
+    if (remembered != nullptr && remembered->identity == result.identity)
+    {
+        result.fingerprint = remembered->fingerprint;
+        return true;
+    }
+
+    // Empty files can't be mapped.
+    StreamingHash hash;
+    if (result.identity.size == 0)
+    {
+        result.fingerprint = hash.Finish(nullptr, 0);
+        return true;
+    }
+
+    SmartHandle mapping(CreateFileMappingW(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr));
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+
+    for (ULONGLONG offset = 0; offset < result.identity.size; offset += FingerprintViewSize)
+    {
+        auto viewSize = static_cast<size_t>(min(FingerprintViewSize, result.identity.size - offset));
+        auto view = static_cast<const BYTE*>(MapViewOfFile(
+            mapping.get(),
+            FILE_MAP_READ,
+            static_cast<DWORD>(offset >> 32),
+            static_cast<DWORD>(offset),
+            viewSize));
+        if (view == nullptr)
+        {
+            return false;
+        }
+
+        hash.Update(view, viewSize);
+        if (offset + viewSize == result.identity.size)
+        {
+            result.fingerprint = hash.Finish(view, viewSize);
+        }
+        UnmapViewOfFile(view);
+    }
+
+    return true;
+}
+
+bool GetFileFingerprints(
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& scope,
+    _In_ const vector<wstring>& paths,
+    _Out_ vector<Fingerprint>& fingerprints)
+{
+    fingerprints.clear();
+
+    auto startTime = GetCurrentFileTime();
+
+    // Without a state directory every file is hashed.
+    wstring statePath;
+    vector<wstring> lines;
+    if (!stateDirectory.empty())
+    {
+        auto directory = stateDirectory + FINGERPRINTDIRECTORYNAME;
+        if (CreateDirectoryW(directory.c_str(), nullptr) || GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            statePath = directory + L'\\' + FormatHash(HashString(scope));
+            LockedStateFile state(statePath);
+            state.ReadLines(lines);
+        }
+    }
+
+    unordered_map<wstring, RememberedFingerprint> rememberedByPath;
+    for (auto& line : lines)
+    {
+        wstring path;
+        RememberedFingerprint remembered;
+        if (ParseRememberedFingerprint(line, path, remembered))
+        {
+            rememberedByPath.emplace(move(path), remembered);
+        }
+    }
+
+    vector<wstring> keys;
+    vector<const RememberedFingerprint *> known;
+    for (auto& path : paths)
+    {
+        auto key = path;
+        transform(key.begin(), key.end(), key.begin(), towlower);
+        auto found = rememberedByPath.find(key);
+        known.push_back(found == rememberedByPath.end() ? nullptr : &found->second);
+        keys.push_back(move(key));
+    }
+
+    // Each thread takes the next file nobody has taken yet.
+    vector<RememberedFingerprint> results(paths.size());
+    unique_ptr<bool[]> succeeded(new bool[paths.size()]);
+    atomic<size_t> nextFile(0);
+    auto work = [&]()
+    {
+        for (auto i = nextFile++; i < paths.size(); i = nextFile++)
+        {
+            succeeded[i] = FingerprintFile(paths[i], known[i], results[i]);
+        }
+    };
+
+    auto threadCount = min(
+        static_cast<size_t>(max(thread::hardware_concurrency(), 1U)),
+        (paths.size() + FilesPerFingerprintThread - 1) / FilesPerFingerprintThread);
+    vector<thread> workers;
+    for (size_t i = 1; i < threadCount; i++)
+    {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (!succeeded[i])
+        {
+            return false;
+        }
+        fingerprints.push_back(results[i].fingerprint);
+    }
+
+    if (statePath.empty())
+    {
+        return true;
+    }
+
+    // The files asked about now go first. Other clients may have added
+    // fingerprints in the meantime, so the state file is read again.
+    LockedStateFile state(statePath);
+    if (!state.ReadLines(lines))
+    {
+        return true;
+    }
+
+    vector<wstring> updated;
+    unordered_set<wstring> updatedPaths;
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        if (results[i].identity.lastWriteTime + UnsettledFileMs * FileTimeUnitsPerMs < startTime
+            && updatedPaths.insert(keys[i]).second)
+        {
+            updated.push_back(FormatRememberedFingerprint(keys[i], results[i]));
+        }
+    }
+
+    for (auto& line : lines)
+    {
+        if (updated.size() >= MaxRememberedFingerprints)
+        {
+            break;
+        }
+
+        wstring path;
+        RememberedFingerprint remembered;
+        if (ParseRememberedFingerprint(line, path, remembered)
+            && updatedPaths.find(path) == updatedPaths.end())
+        {
+            updated.push_back(line);
+        }
+    }
+
+    state.WriteLines(updated);
+    return true;
+}
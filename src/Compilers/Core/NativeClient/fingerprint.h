@@ -0,0 +1,56 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Client features which need to know whether a compilation's inputs
+// changed, like the result cache, fingerprint thousands of files per
+// compilation, which must cost far less than the compilation saved.
+// Files are memory mapped and hashed with a fast non-cryptographic hash
+// on several threads. The fingerprints are remembered in the client state
+// directory along with each file's identity, size and last write time, so
+// a file which hasn't changed since is never read again.
+
+// A 64-bit hash of a file's contents.
+typedef unsigned long long Fingerprint;
+
+// Hash a buffer. Exposed for testing.
+Fingerprint HashBuffer(
+    _In_reads_bytes_(size) const void * data,
+    size_t size);
+
+// Get the fingerprint of every file in the list. Fingerprints are
+// remembered separately for each scope, typically a project directory, so
+// that unrelated compilations don't contend for the same state file.
+// Returns false if any of the files can't be read.
+bool GetFileFingerprints(
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& scope,
+    _In_ const vector<wstring>& paths,
+    _Out_ vector<Fingerprint>& fingerprints);
+
+// What identifies a version of a file without reading it.
+struct FileIdentity
+{
+    DWORD volume;
+    ULONGLONG index;
+    ULONGLONG size;
+    ULONGLONG lastWriteTime;
+
+    bool operator==(const FileIdentity& other) const
+    {
+        return volume == other.volume
+            && index == other.index
+            && size == other.size
+            && lastWriteTime == other.lastWriteTime;
+    }
+};
+
+// Get the identity of a file. Returns false if it doesn't exist.
+bool GetFileIdentity(
+    _In_ const wstring& path,
+    _Out_ FileIdentity& identity);
@@ -0,0 +1,333 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include "arguments.h"
+#include "client_state.h"
+#include "hedging.h"
+#include "logging.h"
+#include "run_inproc_compiler.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The name of the latency history in the client state directory.
+const wchar_t * const LATENCYFILENAME = L"latency";
+
+// Number of requests whose latency is remembered. Older ones are forgotten first.
+const size_t MaxLatencySamples = 100;
+
+// Don't hedge until this many latencies have been recorded.
+const size_t MinLatencySamples = 20;
+
+void RecordServerLatency(
+    _In_ const wstring& stateDirectory,
+    DWORD latencyMs)
+{
+    LockedStateFile history(stateDirectory + LATENCYFILENAME);
+    vector<wstring> lines;
+    if (!history.ReadLines(lines))
+    {
+        return;
+    }
+
+    // The history is kept most recent first.
+    lines.insert(lines.begin(), to_wstring(latencyMs));
+    if (lines.size() > MaxLatencySamples)
+    {
+        lines.resize(MaxLatencySamples);
+    }
+
+    history.WriteLines(lines);
+}
+
+bool GetHedgeDelay(
+    _In_ const wstring& stateDirectory,
+    _Out_ DWORD& delayMs)
+{
+    delayMs = INFINITE;
+
+    wstring value;
+    if (stateDirectory.empty() || !GetEnvVar(HEDGEPERCENTILE_ENV_VAR, value))
+    {
+        return false;
+    }
+
+    auto percentile = wcstoul(value.c_str(), nullptr, 10);
+    if (percentile < 1 || percentile > 99)
+    {
+        return false;
+    }
+
+    vector<wstring> lines;
+    {
+        LockedStateFile history(stateDirectory + LATENCYFILENAME);
+        if (!history.ReadLines(lines) || lines.size() < MinLatencySamples)
+        {
+            return false;
+        }
+    }
+
+    vector<DWORD> latencies;
+    for (auto& line : lines)
+    {
+        latencies.push_back(wcstoul(line.c_str(), nullptr, 10));
+    }
+    sort(latencies.begin(), latencies.end());
+
+    delayMs = latencies[min(latencies.size() - 1, latencies.size() * percentile / 100)];
+    return true;
+}
+
+// Get the file name part of a path.
+wstring GetFileNamePart(_In_ const wstring& path)
+{
+    auto separator = path.find_last_of(L"\\/");
+    return separator == wstring::npos ? path : path.substr(separator + 1);
+}
+
+HedgedCompilation::HedgedCompilation()
+    : cancelEvent(nullptr), doneEvent(nullptr), succeeded(false)
+{
+}
+
+HedgedCompilation::~HedgedCompilation()
+{
+    Cancel();
+    if (!outputDirectory.empty())
+    {
+        RemoveDirectoryW(outputDirectory.c_str());
+    }
+}
+
+bool HedgedCompilation::Initialize(
+    _In_ const wstring& compilerPath,
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& currentDirectory,
+    _In_ const wstring& stateDirectory)
+{
+    list<wstring> expandedArgs;
+    ExpandResponseFiles(commandLineArgs, currentDirectory, expandedArgs);
+
+    // A PDB's path is recorded in the assembly, so the copy's assembly
+    // would name a PDB in the private directory.
+    OutputPaths paths;
+    if (!GetOutputPaths(expandedArgs, paths) || paths.debug)
+    {
+        return false;
+    }
+
+    this->compilerPath = compilerPath;
+    this->args = commandLineArgs;
+    this->outputDirectory = stateDirectory + L"hedge" + to_wstring(GetCurrentProcessId()) + L"\\";
+
+    if (!CreateDirectoryW(this->outputDirectory.c_str(), nullptr)
+        && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        LogWin32Error(IDS_CreateHedgeDirectoryFailed);
+        this->outputDirectory.clear();
+        return false;
+    }
+
+    // Left over from an earlier client with the same process id.
+    DeleteDirectoryFiles(this->outputDirectory);
+
+    auto out = MakeAbsolutePath(paths.out, currentDirectory);
+    this->derivedOutputDirectory = out.substr(0, out.size() - GetFileNamePart(out).size());
+
+    // Switches added after the command line override the ones on it. Files
+    // the compiler derives from the output assembly, like a default PDB,
+    // follow it into the private directory.
+    pair<LPCWSTR, wstring> switches[] =
+    {
+        { L"out", out },
+        { L"pdb", paths.pdb },
+        { L"doc", paths.doc },
+    };
+    for (auto& outputSwitch : switches)
+    {
+        if (outputSwitch.second.empty())
+        {
+            continue;
+        }
+
+        auto privatePath = this->outputDirectory + GetFileNamePart(outputSwitch.second);
+        for (auto& output : this->outputs)
+        {
+            if (_wcsicmp(output.first.c_str(), privatePath.c_str()) == 0)
+            {
+                return false;
+            }
+        }
+
+        this->outputs.emplace_back(privatePath, MakeAbsolutePath(outputSwitch.second, currentDirectory));
+        this->args.push_back(wstring(L"/") + outputSwitch.first + L":\"" + privatePath + L"\"");
+    }
+
+    return true;
+}
+
+bool HedgedCompilation::Start()
+{
+    // A hedge is only worth running if it doesn't have to queue behind
+    // other fallback compilers.
+    fallbackSlot = make_unique<SmartSlot>(GetFallbackSlotsName(compilerPath).c_str(), GetFallbackSlotCount());
+    bool eventSignaled;
+    if (!fallbackSlot->WaitOrEvent(nullptr, 0, eventSignaled))
+    {
+        return false;
+    }
+
+    cancelEvent.reset(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    doneEvent.reset(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (cancelEvent == nullptr || doneEvent == nullptr)
+    {
+        LogWin32Error(IDS_StartHedgeFailed);
+        return false;
+    }
+
+    worker = thread([this]()
+    {
+        try
+        {
+            // The output is only printed if the copy wins.
+            OutputSink stdOut, stdErr;
+            result.exitCode = RunInProcCompiler(
+                compilerPath,
+                args,
+                stdOut,
+                stdErr,
+                cancelEvent.get());
+            stdOut.TakeBuffer(result.stdOut);
+            stdErr.TakeBuffer(result.stdErr);
+
+            // The compiler exits with 0, or with 1 once it has reported
+            // errors. Anything else means it crashed, and the server's
+            // result is worth more.
+            succeeded = WaitForSingleObject(cancelEvent.get(), 0) != WAIT_OBJECT_0
+                && (result.exitCode == 0
+                    || (result.exitCode == 1 && !(result.stdOut.empty() && result.stdErr.empty())));
+        }
+        catch (FatalError&)
+        {
+            succeeded = false;
+        }
+
+        SetEvent(doneEvent.get());
+    });
+
+    return true;
+}
+
+HANDLE HedgedCompilation::GetDoneEvent()
+{
+    return doneEvent.get();
+}
+
+void HedgedCompilation::Join()
+{
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+    fallbackSlot.reset();
+}
+
+void HedgedCompilation::Cancel()
+{
+    if (worker.joinable())
+    {
+        SetEvent(cancelEvent.get());
+        Join();
+    }
+
+    if (!outputDirectory.empty())
+    {
+        DeleteDirectoryFiles(outputDirectory);
+    }
+}
+
+bool HedgedCompilation::Wait()
+{
+    Join();
+    return succeeded;
+}
+
+bool HedgedCompilation::Finish(_Out_ FallbackResult& fallbackResult)
+{
+    if (!Wait())
+    {
+        return false;
+    }
+
+    // Each output is first moved next to where it belongs, which may mean
+    // a copy to another volume. Only once all of them are there are they
+    // renamed into place, the assembly last, so that a failure part way
+    // leaves the assembly older than the rest and the build runs again.
+    vector<pair<wstring, wstring>> staged;
+    auto unstage = [&]()
+    {
+        for (auto& file : staged)
+        {
+            DeleteFileW(file.first.c_str());
+        }
+    };
+
+    WIN32_FIND_DATAW findData;
+    auto findHandle = FindFirstFileW((outputDirectory + L"*").c_str(), &findData);
+    if (findHandle != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                continue;
+            }
+
+            auto privatePath = outputDirectory + findData.cFileName;
+            auto path = derivedOutputDirectory + findData.cFileName;
+            for (auto& output : outputs)
+            {
+                if (_wcsicmp(output.first.c_str(), privatePath.c_str()) == 0)
+                {
+                    path = output.second;
+                }
+            }
+
+            auto stagedPath = path + L".hedge";
+            if (!MoveFileExW(privatePath.c_str(), stagedPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED))
+            {
+                LogWin32Error(IDS_MoveHedgeOutputFailed);
+                FindClose(findHandle);
+                unstage();
+                return false;
+            }
+            staged.emplace_back(stagedPath, path);
+        } while (FindNextFileW(findHandle, &findData));
+
+        FindClose(findHandle);
+    }
+
+    // The assembly is the first output.
+    if (!outputs.empty())
+    {
+        auto& assemblyPath = outputs.front().second;
+        stable_partition(staged.begin(), staged.end(), [&](const pair<wstring, wstring>& file)
+        {
+            return _wcsicmp(file.second.c_str(), assemblyPath.c_str()) != 0;
+        });
+    }
+
+    for (size_t i = 0; i < staged.size(); i++)
+    {
+        if (!MoveFileExW(staged[i].first.c_str(), staged[i].second.c_str(), MOVEFILE_REPLACE_EXISTING))
+        {
+            LogWin32Error(IDS_MoveHedgeOutputFailed);
+            staged.erase(staged.begin(), staged.begin() + i);
+            unstage();
+            return false;
+        }
+    }
+
+    fallbackResult = move(result);
+    return true;
+}
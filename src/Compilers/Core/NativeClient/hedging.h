@@ -0,0 +1,89 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "smart_resources.h"
+
+using namespace std;
+
+// A server which is alive but stalled (in a long GC, or busy with another
+// client's huge compilation) can hold a client far beyond its usual
+// latency. When hedging is enabled, a request which takes longer than a
+// chosen percentile of recent requests is also run with the fallback
+// compiler, and the client uses whichever result arrives first.
+
+// Set this environment variable to a percentile between 1 and 99 to enable
+// hedging for requests slower than that percentile.
+const wchar_t * const HEDGEPERCENTILE_ENV_VAR = L"RoslynCommandLineHedgePercentile";
+
+// Remember how long the server took to respond to a request.
+void RecordServerLatency(
+    _In_ const wstring& stateDirectory,
+    DWORD latencyMs);
+
+// Get how long to wait for the server before hedging. Returns false if
+// hedging is disabled or there isn't enough history yet.
+bool GetHedgeDelay(
+    _In_ const wstring& stateDirectory,
+    _Out_ DWORD& delayMs);
+
+// The output of a run of the fallback compiler.
+struct FallbackResult
+{
+    int exitCode;
+    vector<BYTE> stdOut;
+    vector<BYTE> stdErr;
+};
+
+// A copy of a compilation run with the fallback compiler. Its output files
+// are written to a private directory and only moved into place once it is
+// known to have won, so the server and the copy never write the same files.
+class HedgedCompilation
+{
+private:
+    wstring compilerPath;
+    list<wstring> args;
+    wstring outputDirectory;
+    vector<pair<wstring, wstring>> outputs;
+    wstring derivedOutputDirectory;
+    SmartHandle cancelEvent;
+    SmartHandle doneEvent;
+    unique_ptr<SmartSlot> fallbackSlot;
+    thread worker;
+    bool succeeded;
+    FallbackResult result;
+
+    void Join();
+
+public:
+    HedgedCompilation();
+    ~HedgedCompilation();
+
+    // Prepare the copy. Returns false if the command line's outputs can't
+    // be redirected, or it writes a PDB, in which case the compilation
+    // can't be hedged.
+    bool Initialize(
+        _In_ const wstring& compilerPath,
+        _In_ const list<wstring>& commandLineArgs,
+        _In_ const wstring& currentDirectory,
+        _In_ const wstring& stateDirectory);
+    // Start the copy. Returns false if it couldn't be started, including
+    // when no fallback compiler slot is free.
+    bool Start();
+    HANDLE GetDoneEvent();
+    // Stop the copy, if it's running, and discard anything it produced.
+    void Cancel();
+    // Wait for the copy to finish. Returns false if it was cancelled or
+    // crashed.
+    bool Wait();
+    // Wait for the copy to finish and move its outputs into place. Returns
+    // false if it failed or crashed, in which case nothing was moved, or if
+    // an output couldn't be moved, in which case the assembly was left as
+    // it was. The server must have stopped writing the same outputs first.
+    bool Finish(_Out_ FallbackResult& fallbackResult);
+};
@@ -55,6 +55,11 @@ bool GetEnvVar(_In_z_ LPCWSTR name, _Out_ wstring &value)
 
 void InitializeLogging()
 {
+    if (logFile != nullptr)
+    {
+        return;
+    }
+
     wstring loggingFileName;
     if (GetEnvVar(LOGGING_ENV_VAR, loggingFileName))
     {
@@ -113,7 +118,7 @@ void LogFormatted(UINT loadResource, ...)
 {
     va_list varargs;
     va_start(varargs, loadResource);
-    LogFormatted(GetResourceString(loadResource).c_str(), varargs);
+    vLogFormatted(GetResourceString(loadResource).c_str(), varargs);
     va_end(varargs);
 }
 
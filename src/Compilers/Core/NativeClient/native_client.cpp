@@ -1,20 +1,34 @@
 ﻿// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
 #include "stdafx.h"
+#include <sddl.h>
 #include <memory>
 #include <algorithm>
 #include <string>
+#include <thread>
+#include "adaptive_keepalive.h"
+#include "affinity.h"
+#include "arguments.h"
+#include "build_manifest.h"
+#include "cancellation.h"
+#include "client_state.h"
+#include "coalescing.h"
+#include "hedging.h"
 #include "logging.h"
 #include "native_client.h"
 #include "pipe_utils.h"
+#include "result_cache.h"
+#include "run_inproc_compiler.h"
 #include "smart_resources.h"
 #include "satellite.h"
+#include "shared_memory_pipe.h"
+#include "spawn_backoff.h"
+#include "transcode.h"
 #include "UIStrings.h"
+#include "warmup_profile.h"
 
-int RunInProcCompiler(
-    _In_ const std::wstring& processPath,
-    _In_ const std::list<std::wstring> args,
-    _Out_ std::vector<BYTE>& stdOut,
-    _Out_ std::vector<BYTE>& stdErr);
+void GetCurrentUserAndElevation(
+    _Out_ unique_ptr<TOKEN_USER>& userInfo,
+    _Out_ unique_ptr<TOKEN_ELEVATION>& elevationInfo);
 
 // This is small, native code executable which opens a named pipe 
 // to the compiler server to do the actual compilation. It is a native code
@@ -36,6 +50,43 @@ const wchar_t * const SERVERNAME = L"VBCSCompiler.exe";
 // The name of the named pipe. A process id is appended to the end.
 const wchar_t * const PIPENAME = L"VBCSCompiler";
 
+// Appended to the pipe name of a new server to name the event it signals
+// once it is listening for connections.
+const wchar_t * const READYEVENTSUFFIX = L".ready";
+
+// Set this environment variable to 1 to have a client which finds no
+// running server compile with the fallback compiler while the server it
+// starts warms up in the background, instead of waiting for the server.
+const wchar_t * const HEDGEDSTART_ENV_VAR = L"RoslynCommandLineHedgedStart";
+
+// Set this environment variable to give requests without a /priority
+// switch a priority class.
+const wchar_t * const PRIORITY_ENV_VAR = L"RoslynCommandLinePriority";
+
+// Set this environment variable to a number of seconds to give requests
+// without a /deadline switch a deadline. Once it passes, the server
+// abandons the request and the client gives up.
+const wchar_t * const DEADLINE_ENV_VAR = L"RoslynCommandLineDeadline";
+
+// Deadlines are counted down in milliseconds, which must fit a DWORD.
+const DWORD MaxDeadlineSeconds = 7 * 24 * 60 * 60;
+
+// Appended to the pipe name of a new server to name the file mapping
+// through which pipe instances created by the client are handed to it.
+const wchar_t * const LISTENERMAPPINGSUFFIX = L".listener";
+
+// Appended to the pipe name of a server to name the event through which it
+// tells clients that it supports the shared memory transport.
+const wchar_t * const SHAREDMEMORYTRANSPORTSUFFIX = L".ring";
+
+// Appended to the pipe name of a server to name the event through which it
+// tells clients that it understands PROTOCOL_VERSION.
+const wchar_t * const PROTOCOLVERSIONSUFFIX = L".v3";
+
+// Appended to the pipe name of a server to name the event through which it
+// tells clients that it accepts a PREPARE request ahead of the request.
+const wchar_t * const PREPAREREQUESTSUFFIX = L".prepare";
+
 // Module to load resources from.
 HINSTANCE g_hinstMessages;
 
@@ -98,6 +149,7 @@ std::unique_ptr<LPCWSTR, decltype(&::LocalFree)> GetCommandLineArgs(
 const DWORD MinConnectionAttempts = 3;        // Always make at least three attempts (matters when each attempt takes a long time (under load)).
 const DWORD TimeOutMsExistingProcess = 2000;  // Spend up to 2s connecting to existing process (existing processes should be always responsive).
 const DWORD TimeOutMsNewProcess = 60000;      // Spend up to 60s connection to new process, to allow time for it to start.
+const DWORD TimeOutMsPreferredProcess = 500;  // Spend up to 0.5s connecting to the server that last compiled the project before trying others.
 
 // Is the give FILE* a console? Stolen from native compiler.
 bool IsConsole(FILE *fd)
@@ -120,9 +172,14 @@ bool IsConsole(FILE *fd)
     return GetConsoleMode(hFile, &dwMode) != 0;
 }
 
+// Characters of output transcoded at a time. A character takes at most four
+// bytes in any code page, so output of any size goes through a buffer of
+// four times this many bytes.
+const size_t OutputChunkChars = 16 * 1024;
+
 // Output a unicode string, taking into account console code pages 
 // and possible /utf8output options.
-void OutputWideString(_In_ FILE * outputFile, _In_ const wstring str, bool utf8Output)
+void OutputWideString(_In_ FILE * outputFile, _In_ const wstring& str, bool utf8Output)
 {
     UINT cp;
 
@@ -135,12 +192,26 @@ void OutputWideString(_In_ FILE * outputFile, _In_ const wstring str, bool utf8O
         cp = GetConsoleOutputCP();
     }
 
-    int strLength = (int)str.length();
+    // Only the string itself is ever held in full, however much the
+    // compiler printed. A chunk never ends between the halves of a
+    // surrogate pair, which would turn both into replacement characters.
+    const auto bufferSize = static_cast<int>(OutputChunkChars * 4);
+    auto outputBuffer = make_unique<char[]>(bufferSize);
+    auto chars = str.data();
+    auto remaining = str.length();
+    while (remaining > 0)
+    {
+        auto count = min(remaining, OutputChunkChars);
+        if (count < remaining && IS_HIGH_SURROGATE(chars[count - 1]))
+        {
+            count--;
+        }
 
-    auto bytesNeeded = WideCharToMultiByte(cp, 0, str.c_str(), strLength, NULL, 0, NULL, NULL);
-    auto outputBuffer = make_unique<char[]>(bytesNeeded);
-    WideCharToMultiByte(cp, 0, str.c_str(), strLength, outputBuffer.get(), bytesNeeded, NULL, NULL);
-    fwrite(outputBuffer.get(), 1, bytesNeeded, outputFile);
+        auto bytes = TranscodeOutput(cp, chars, static_cast<int>(count), outputBuffer.get(), bufferSize);
+        fwrite(outputBuffer.get(), 1, bytes, outputFile);
+        chars += count;
+        remaining -= count;
+    }
 }
 
 // Output the response we got back from the server onto our stdout and stderr.
@@ -151,6 +222,56 @@ void OutputResponse(_In_ const CompletedResponse& response)
     OutputWideString(stderr, response.ErrorOutput, utf8output);
 }
 
+// Print the output of the fallback compiler and return the exit code.
+int OutputFallbackResult(_In_ const FallbackResult& result)
+{
+    if (result.exitCode != 0 && result.stdOut.empty() && result.stdErr.empty())
+    {
+        OutputWideString(stderr, GetResourceString(IDS_ExceptionFilterCrash), true);
+        return -1;
+    }
+
+    fwrite(result.stdOut.data(), sizeof(BYTE), result.stdOut.size(), stdout);
+    fwrite(result.stdErr.data(), sizeof(BYTE), result.stdErr.size(), stderr);
+    return result.exitCode;
+}
+
+// Publish the output of the fallback compiler to clients waiting on the
+// same request. A crash isn't published, so that they compile themselves.
+void PublishFallbackResult(
+    _Inout_ CoalescedCompilation& coalescedCompilation,
+    _In_ const FallbackResult& result,
+    _In_ const list<wstring>& commandLineArgs)
+{
+    if (!coalescedCompilation.IsEnabled()
+        || (result.exitCode != 0 && result.exitCode != 1)
+        || (result.exitCode != 0 && result.stdOut.empty() && result.stdErr.empty()))
+    {
+        return;
+    }
+
+    // The compiler writes in the console's code page unless told to use
+    // UTF-8.
+    list<wstring> expandedArgs;
+    ExpandResponseFiles(commandLineArgs, GetCurrentDirectory(), expandedArgs);
+    auto utf8Output = HasUtf8Output(expandedArgs);
+    auto cp = utf8Output ? CP_UTF8 : GetConsoleOutputCP();
+    auto decode = [cp](_In_ const vector<BYTE>& bytes)
+    {
+        wstring text;
+        if (!bytes.empty())
+        {
+            auto source = reinterpret_cast<LPCSTR>(bytes.data());
+            auto size = static_cast<int>(bytes.size());
+            text.resize(MultiByteToWideChar(cp, 0, source, size, nullptr, 0));
+            MultiByteToWideChar(cp, 0, source, size, &text[0], static_cast<int>(text.size()));
+        }
+        return text;
+    };
+
+    coalescedCompilation.Publish(CompletedResponse(result.exitCode, utf8Output, decode(result.stdOut), decode(result.stdErr)));
+}
+
 // Get the expected process path of a compiler EXE. We assume that the EXE
 // will be in the same directory as the client EXE. This allows us to support
 // side-by-side install of different compilers. We only connect to servers that
@@ -207,21 +328,91 @@ HANDLE ConnectToProcess(DWORD processID, int timeoutMs)
     return NULL;
 }
 
+// Don't let the paths make a prepare request anywhere near the server's
+// 1MB limit on requests. Paths beyond this many characters are left out.
+const size_t MaxPreparePathChars = 0x20000;
+
+// Get the references and source files a compilation reads.
+void GetPreparePaths(
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& currentDirectory,
+    _Out_ vector<wstring>& references,
+    _Out_ vector<wstring>& sources)
+{
+    list<wstring> expandedArgs;
+    ExpandResponseFiles(commandLineArgs, currentDirectory, expandedArgs);
+
+    GetReferences(expandedArgs, references);
+    for (auto& reference : references)
+    {
+        reference = MakeAbsolutePath(reference, currentDirectory);
+    }
+    GetSourceFiles(expandedArgs, currentDirectory, sources);
+
+    // References come first; each one the server loads early saves more
+    // than a source file does.
+    size_t chars = 0;
+    for (auto paths : { &references, &sources })
+    {
+        auto end = paths->begin();
+        while (end != paths->end() && chars + end->size() <= MaxPreparePathChars)
+        {
+            chars += end->size();
+            ++end;
+        }
+        paths->erase(end, paths->end());
+    }
+}
+
+/// <summary>
+/// Send the server the files the compilation reads ahead of the request,
+/// so it can load them while the client finishes the request.
+/// </summary>
+bool WritePrepareRequest(IPipe& pipe,
+                         int protocolVersion,
+                         _In_ const vector<wstring>& references,
+                         _In_ const vector<wstring>& sources)
+{
+    auto request = Request(PREPARE, GetCurrentDirectory());
+    request.ProtocolVersion = protocolVersion;
+    request.AddPaths(REFERENCEPATH, references);
+    request.AddPaths(SOURCEPATH, sources);
+
+    if (!request.WriteToPipe(pipe))
+    {
+        Log(IDS_FailedToWritePrepareRequest);
+        return false;
+    }
+
+    return true;
+}
+
 /// <summary>
-/// Perform the compilation. If the compilation completes, this function
-/// never returns, exiting with the exit code of the compilation.
+/// Send the compilation request to the server.
 /// </summary>
 /// <param name='keepAlive'>
 /// Set to the empty string if no keepAlive should be used
 /// </param>
-_Success_(return != false)
-bool TryCompile(HANDLE pipeHandle,
-                RequestLanguage language,
-                _In_ const list<wstring>& commandLineArgs,
-                _In_ const wstring& keepAlive,
-                _Out_ CompletedResponse& response)
+/// <param name='priority'>
+/// Set to the empty string to leave the priority to the server
+/// </param>
+/// <param name='deadlineMs'>
+/// How long the result is still wanted, or INFINITE
+/// </param>
+/// <param name='protocolVersion'>
+/// The version the server understands. Set to the version the request was
+/// sent in, which the response comes back in
+/// </param>
+bool WriteCompileRequest(IPipe& pipe,
+                         _Inout_ int& protocolVersion,
+                         RequestLanguage language,
+                         _In_ const list<wstring>& commandLineArgs,
+                         _In_ const wstring& keepAlive,
+                         _In_ const wstring& priority,
+                         DWORD deadlineMs)
 {
     auto request = Request(language, GetCurrentDirectory());
+    request.ProtocolVersion = protocolVersion;
     request.AddCommandLineArguments(commandLineArgs);
 
     wstring libEnvVariable;
@@ -235,26 +426,27 @@ bool TryCompile(HANDLE pipeHandle,
         request.AddKeepAlive(wstring(keepAlive));
     }
 
+    if (!priority.empty())
+    {
+        request.AddPriority(wstring(priority));
+    }
+
+    if (deadlineMs != INFINITE)
+    {
+        request.AddDeadline(to_wstring(deadlineMs));
+    }
+
     request.AddTempPath(GetTempPath());
 
-    RealPipe wrapper(pipeHandle);
-    if (!request.WriteToPipe(wrapper))
+    if (!request.WriteToPipe(pipe))
     {
         Log(IDS_FailedToWriteRequest);
         return false;
     }
+    protocolVersion = request.ProtocolVersion;
 
     Log(IDS_SuccessfullyWroteRequest);
-
-    // We should expect a completed response since
-    // the only other option is a an erroroneous response
-    // which will generate an exception.
-    if (ReadResponse(wrapper, response))
-    {
-        Log(IDS_SuccessfullyReadResponse);
-        return true;
-    }
-    return false;
+    return true;
 }
 
 // Get the process ids of all processes on the system.
@@ -317,11 +509,235 @@ void SetupDevDivEnvironment()
         FailWithGetLastError(L"SetEnvironmentVariable version");
 }
 
+// Hand the server with the given process id a shared memory transport if
+// the user enabled it and the server supports it.
+bool ConnectSharedMemoryTransport(SharedMemoryPipe& transport, DWORD processId)
+{
+    wstring enabled;
+    if (!GetEnvVar(SHAREDMEMORYTRANSPORT_ENV_VAR, enabled) || enabled != L"1")
+    {
+        return false;
+    }
+
+    TCHAR szEventName[MAX_PATH];
+    StringCchPrintf(szEventName, MAX_PATH, L"%ws%d%ws", PIPENAME, processId, SHAREDMEMORYTRANSPORTSUFFIX);
+    SmartHandle transportEvent(OpenEventW(SYNCHRONIZE, FALSE, szEventName));
+    if (transportEvent == nullptr)
+    {
+        return false;
+    }
+
+    if (!transport.Connect())
+    {
+        LogWin32Error(IDS_SharedMemoryTransportFailed);
+        return false;
+    }
+
+    Log(IDS_SharedMemoryTransport);
+    return true;
+}
+
+// Get the protocol version to send requests to the server with the given
+// process id in: the latest if the server advertises it, otherwise the last
+// one every server understands.
+int GetServerProtocolVersion(DWORD processId)
+{
+    TCHAR szEventName[MAX_PATH];
+    StringCchPrintf(szEventName, MAX_PATH, L"%ws%d%ws", PIPENAME, processId, PROTOCOLVERSIONSUFFIX);
+    SmartHandle versionEvent(OpenEventW(SYNCHRONIZE, FALSE, szEventName));
+    auto protocolVersion = versionEvent == nullptr ? UTF16_PROTOCOL_VERSION : PROTOCOL_VERSION;
+    LogFormatted(IDS_ProtocolVersion, protocolVersion);
+    return protocolVersion;
+}
+
+// Whether the server with the given process id accepts a PREPARE request.
+// Servers which don't fail the compilation it precedes.
+bool ServerAcceptsPrepareRequest(DWORD processId)
+{
+    TCHAR szEventName[MAX_PATH];
+    StringCchPrintf(szEventName, MAX_PATH, L"%ws%d%ws", PIPENAME, processId, PREPAREREQUESTSUFFIX);
+    SmartHandle prepareEvent(OpenEventW(SYNCHRONIZE, FALSE, szEventName));
+    return prepareEvent != nullptr;
+}
+
+// Create the event a new server signals once it is listening for connections.
+HANDLE CreateServerReadyEvent(DWORD processId)
+{
+    TCHAR szEventName[MAX_PATH];
+    StringCchPrintf(szEventName, MAX_PATH, L"%ws%d%ws", PIPENAME, processId, READYEVENTSUFFIX);
+
+    HANDLE readyEvent = CreateEventW(nullptr,
+                                     TRUE, // manual reset
+                                     FALSE, // initially not signaled
+                                     szEventName);
+    if (readyEvent == nullptr)
+    {
+        LogWin32Error(IDS_CreateServerReadyEventFailed);
+    }
+    return readyEvent;
+}
+
+// Number of pipe instances a client creates for a server it starts. One is
+// for the client itself, the others for clients which were waiting for
+// the server to start.
+const unsigned PreCreatedPipeInstances = 4;
+
+// Size of the server's pipe buffers. This must match the server.
+const DWORD PipeBufferSize = 0x10000;  // 64K
+
+// The contents of the mapping which hands pre-created pipe instances to a
+// new server. All handles are handles in the server process. The server
+// only believes a mapping owned by its own user, and only takes over
+// handles which are server ends of its pipe.
+struct ListenerMapping
+{
+    unsigned long long mappingHandle;
+    unsigned long long pipeCount;
+    unsigned long long pipeHandles[PreCreatedPipeInstances];
+};
+
+// Create the first instances of a new server's pipe on its behalf and hand
+// them to the server process, which must not be running yet. Clients can
+// connect to these instances, and send their requests, while the server is
+// still starting. If no instances could be handed over, return false and
+// leave it to the server to create its own.
+bool PreCreateServerPipes(DWORD processId, HANDLE processHandle)
+{
+    unique_ptr<TOKEN_USER> userInfo;
+    unique_ptr<TOKEN_ELEVATION> elevationInfo;
+    GetCurrentUserAndElevation(userInfo, elevationInfo);
+
+    // Like the server, only allow the current user to use the pipe.
+    LPWSTR sidString;
+    if (!ConvertSidToStringSidW(userInfo->User.Sid, &sidString))
+    {
+        LogWin32Error(IDS_PreCreatePipesFailed);
+        return false;
+    }
+    wstring sddl(L"D:P(A;;GA;;;");
+    sddl += sidString;
+    sddl += L")";
+    LocalFree(sidString);
+
+    PSECURITY_DESCRIPTOR tempDescriptor;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(),
+        SDDL_REVISION_1,
+        &tempDescriptor,
+        nullptr))
+    {
+        LogWin32Error(IDS_PreCreatePipesFailed);
+        return false;
+    }
+    auto securityDescriptor = unique_ptr<void, decltype(&::LocalFree)>(tempDescriptor, ::LocalFree);
+
+    SECURITY_ATTRIBUTES securityAttributes = {};
+    securityAttributes.nLength = sizeof(securityAttributes);
+    securityAttributes.lpSecurityDescriptor = securityDescriptor.get();
+    securityAttributes.bInheritHandle = FALSE;
+
+    TCHAR szMappingName[MAX_PATH];
+    StringCchPrintf(szMappingName, MAX_PATH, L"%ws%d%ws", PIPENAME, processId, LISTENERMAPPINGSUFFIX);
+
+    SmartHandle mapping(CreateFileMappingW(INVALID_HANDLE_VALUE,
+        &securityAttributes,
+        PAGE_READWRITE,
+        0, // maximum size high
+        sizeof(ListenerMapping),
+        szMappingName));
+    if (mapping == nullptr || GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        LogWin32Error(IDS_PreCreatePipesFailed);
+        return false;
+    }
+
+    auto view = static_cast<ListenerMapping*>(MapViewOfFile(mapping.get(), FILE_MAP_WRITE, 0, 0, sizeof(ListenerMapping)));
+    if (view == nullptr)
+    {
+        LogWin32Error(IDS_PreCreatePipesFailed);
+        return false;
+    }
+
+    // The server holds the mapping open until it has read it, so it doesn't
+    // matter whether this client is still around by then.
+    HANDLE serverMapping;
+    if (!DuplicateHandle(GetCurrentProcess(), mapping.get(), processHandle, &serverMapping, FILE_MAP_READ, FALSE, 0))
+    {
+        LogWin32Error(IDS_PreCreatePipesFailed);
+        UnmapViewOfFile(view);
+        return false;
+    }
+    view->mappingHandle = reinterpret_cast<ULONG_PTR>(serverMapping);
+
+    TCHAR szPipeName[MAX_PATH];
+    StringCchPrintf(szPipeName, MAX_PATH, L"\\\\.\\pipe\\%ws%d", PIPENAME, processId);
+
+    // Only the server keeps a handle to the server end of the pipe so that
+    // clients see the pipe break if it exits.
+    unsigned pipeCount = 0;
+    while (pipeCount < PreCreatedPipeInstances)
+    {
+        HANDLE pipe = CreateNamedPipeW(szPipeName,
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_WRITE_THROUGH
+                | (pipeCount == 0 ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+            PIPE_UNLIMITED_INSTANCES,
+            PipeBufferSize,
+            PipeBufferSize,
+            0, // default timeout
+            &securityAttributes);
+
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            LogWin32Error(IDS_PreCreatePipesFailed);
+            break;
+        }
+
+        HANDLE serverPipe;
+        auto duplicated = DuplicateHandle(GetCurrentProcess(),
+                                          pipe,
+                                          processHandle,
+                                          &serverPipe,
+                                          0, // ignored
+                                          FALSE, // not inheritable
+                                          DUPLICATE_SAME_ACCESS);
+        CloseHandle(pipe);
+        if (!duplicated)
+        {
+            LogWin32Error(IDS_PreCreatePipesFailed);
+            break;
+        }
+
+        view->pipeHandles[pipeCount] = reinterpret_cast<ULONG_PTR>(serverPipe);
+        pipeCount++;
+    }
+
+    view->pipeCount = pipeCount;
+    UnmapViewOfFile(view);
+
+    LogFormatted(IDS_PreCreatedPipes, pipeCount);
+    return pipeCount > 0;
+}
+
 // Start a new server process with the given executable name,
 // and return the process id of the process. On error, return
-// zero.
-DWORD CreateNewServerProcess(_In_z_ LPCWSTR executablePath)
+// zero. If a warm-up profile is given, the server is told to load
+// what it names before the first request arrives.
+//
+// The process is started suspended so that the event it signals once it
+// is listening, and the pipe instances created for it, exist before the
+// server looks for them. The caller owns the returned process and event
+// handles; the event is null if it couldn't be created.
+DWORD CreateNewServerProcess(
+    _In_z_ LPCWSTR executablePath,
+    _In_ const wstring& warmupProfilePath,
+    _Out_ HANDLE& processHandle,
+    _Out_ HANDLE& readyEvent,
+    _Out_ bool& pipesCreated)
 {
+    processHandle = nullptr;
+    readyEvent = nullptr;
+    pipesCreated = false;
+
     STARTUPINFO startupInfo;
     PROCESS_INFORMATION processInfo;
     BOOL success;
@@ -365,12 +781,19 @@ DWORD CreateNewServerProcess(_In_z_ LPCWSTR executablePath)
         FailFormatted(IDS_MakeNewProcessPathError, err);
     }
 
+    // CreateProcess may modify the command line, so it needs a copy.
+    wstring commandLine = wstring(L"\"") + executablePath + L"\"";
+    if (!warmupProfilePath.empty())
+    {
+        commandLine += wstring(L" \"") + WARMUPPROFILESWITCH + warmupProfilePath + L"\"";
+    }
+
     success = CreateProcess(executablePath,
-        NULL, // command line,
+        &commandLine[0],
         NULL, // process attributes
         NULL, // thread attributes
         FALSE, // don't inherit handles
-        NORMAL_PRIORITY_CLASS | CREATE_NO_WINDOW | CREATE_UNICODE_ENVIRONMENT,
+        NORMAL_PRIORITY_CLASS | CREATE_NO_WINDOW | CREATE_UNICODE_ENVIRONMENT | CREATE_SUSPENDED,
         NULL, // Inherit environment
         createPath.get(), // The process should run in the directory the executable is located
         &startupInfo,
@@ -378,10 +801,28 @@ DWORD CreateNewServerProcess(_In_z_ LPCWSTR executablePath)
 
     if (success)
     {
-        // We don't need the process and thread handles.
         LogFormatted(IDS_CreatedProcess, processInfo.dwProcessId);
-        CloseHandle(processInfo.hProcess);
+        readyEvent = CreateServerReadyEvent(processInfo.dwProcessId);
+        pipesCreated = PreCreateServerPipes(processInfo.dwProcessId, processInfo.hProcess);
+
+        if (ResumeThread(processInfo.hThread) == (DWORD)-1)
+        {
+            LogWin32Error(IDS_ResumeServerFailed);
+            pipesCreated = false;
+            TerminateProcess(processInfo.hProcess, 1);
+            CloseHandle(processInfo.hProcess);
+            CloseHandle(processInfo.hThread);
+            if (readyEvent != nullptr)
+            {
+                CloseHandle(readyEvent);
+                readyEvent = nullptr;
+            }
+            return 0;
+        }
+
+        // We don't need the thread handle.
         CloseHandle(processInfo.hThread);
+        processHandle = processInfo.hProcess;
         return processInfo.dwProcessId;
     }
     else
@@ -391,6 +832,47 @@ DWORD CreateNewServerProcess(_In_z_ LPCWSTR executablePath)
     }
 }
 
+// Connect to a server process this client just started. If the client
+// created the server's first pipe instances, connect right away. Otherwise,
+// rather than polling for its pipe, wait until the server signals that it
+// is listening or the process exits, whichever comes first.
+HANDLE ConnectToNewProcess(
+    DWORD processId,
+    HANDLE processHandle,
+    HANDLE readyEvent,
+    bool pipesCreated,
+    DWORD startTicks)
+{
+    if (pipesCreated)
+    {
+        return ConnectToProcess(processId, TimeOutMsExistingProcess);
+    }
+
+    if (readyEvent == nullptr)
+    {
+        return ConnectToProcess(processId, TimeOutMsNewProcess);
+    }
+
+    HANDLE handles[] = { readyEvent, processHandle };
+    auto waitResult = WaitForMultipleObjects(_countof(handles), handles, FALSE, TimeOutMsNewProcess);
+    switch (waitResult)
+    {
+    case WAIT_OBJECT_0:
+#pragma warning(suppress: 28159)
+        LogFormatted(IDS_ServerReady, processId, GetTickCount() - startTicks);
+        return ConnectToProcess(processId, TimeOutMsExistingProcess);
+    case WAIT_OBJECT_0 + 1:
+        LogFormatted(IDS_ServerExitedBeforeReady, processId);
+        return NULL;
+    case WAIT_TIMEOUT:
+        Log(IDS_ServerReadyTimeout);
+        return NULL;
+    default:
+        LogWin32Error(IDS_WaitingServerReadyFailed);
+        return ConnectToProcess(processId, TimeOutMsNewProcess);
+    }
+}
+
 // Get the full name of a process.
 bool ProcessHasSameName(HANDLE processHandle, _In_z_ LPCWSTR expectedName)
 {
@@ -449,11 +931,12 @@ bool ProcessHasSameUserAndElevation(HANDLE processHandle,
     return false;
 }
 
-HANDLE TryExistingProcesses(_In_z_ LPCWSTR expectedProcessName)
+// Get the user and elevation of the current process. Servers are only
+// used if they run as the same user with the same elevation.
+void GetCurrentUserAndElevation(
+    _Out_ unique_ptr<TOKEN_USER>& userInfo,
+    _Out_ unique_ptr<TOKEN_ELEVATION>& elevationInfo)
 {
-    unique_ptr<TOKEN_USER> userInfo;
-    unique_ptr<TOKEN_ELEVATION> elevationInfo;
-
     HANDLE tempHandle;
     if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &tempHandle))
     {
@@ -465,6 +948,43 @@ HANDLE TryExistingProcesses(_In_z_ LPCWSTR expectedProcessName)
     {
         FailWithGetLastError(IDS_GetUserTokenFailed);
     }
+}
+
+// Connect to the given process if it is a server with the expected name
+// running as the same user and elevation as this client.
+HANDLE TryConnectToServerProcess(
+    DWORD processId,
+    _In_z_ LPCWSTR expectedProcessName,
+    _In_ TOKEN_USER const * userInfo,
+    _In_ TOKEN_ELEVATION const * elevationInfo,
+    int timeoutMs)
+{
+    auto processHandle = SmartHandle(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId));
+
+    if (processHandle.get() != nullptr
+        // Check if the process has the same name
+        && ProcessHasSameName(processHandle.get(), expectedProcessName)
+        // Check if the process is owned by the same user
+        && ProcessHasSameUserAndElevation(processHandle.get(), userInfo, elevationInfo))
+    {
+        LogFormatted(IDS_FoundProcess, processId);
+        return ConnectToProcess(processId, timeoutMs);
+    }
+
+    return NULL;
+}
+
+// Try to connect to any running server other than the excluded process.
+HANDLE TryExistingProcesses(
+    _In_z_ LPCWSTR expectedProcessName,
+    DWORD excludedProcessId,
+    _Out_ DWORD& connectedProcessId)
+{
+    unique_ptr<TOKEN_USER> userInfo;
+    unique_ptr<TOKEN_ELEVATION> elevationInfo;
+    GetCurrentUserAndElevation(userInfo, elevationInfo);
+
+    connectedProcessId = 0;
 
     vector<DWORD> processes;
     if (GetAllProcessIds(processes))
@@ -474,22 +994,18 @@ HANDLE TryExistingProcesses(_In_z_ LPCWSTR expectedProcessName)
         // Check each process to find one with the right name and user
         for (auto processId : processes)
         {
-            if (processId != 0)
+            if (processId != 0 && processId != excludedProcessId)
             {
-                auto processHandle = SmartHandle(OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId));
-
-                if (processHandle.get() != nullptr
-                    // Check if the process has the same name
-                    && ProcessHasSameName(processHandle.get(), expectedProcessName)
-                    // Check if the process is owned by the same user
-                    && ProcessHasSameUserAndElevation(processHandle.get(), userInfo.get(), elevationInfo.get()))
+                HANDLE pipeHandle = TryConnectToServerProcess(
+                    processId,
+                    expectedProcessName,
+                    userInfo.get(),
+                    elevationInfo.get(),
+                    TimeOutMsExistingProcess);
+                if (pipeHandle != NULL)
                 {
-                    LogFormatted(IDS_FoundProcess, processId);
-                    HANDLE pipeHandle = ConnectToProcess(processId, TimeOutMsExistingProcess);
-                    if (pipeHandle != NULL)
-                    {
-                        return pipeHandle;
-                    }
+                    connectedProcessId = processId;
+                    return pipeHandle;
                 }
             }
         }
@@ -497,6 +1013,107 @@ HANDLE TryExistingProcesses(_In_z_ LPCWSTR expectedProcessName)
     return NULL;
 }
 
+// Try to connect to a specific server process which an earlier client used.
+HANDLE TryKnownProcess(
+    _In_z_ LPCWSTR expectedProcessName,
+    DWORD processId,
+    int timeoutMs)
+{
+    unique_ptr<TOKEN_USER> userInfo;
+    unique_ptr<TOKEN_ELEVATION> elevationInfo;
+    GetCurrentUserAndElevation(userInfo, elevationInfo);
+
+    return TryConnectToServerProcess(
+        processId,
+        expectedProcessName,
+        userInfo.get(),
+        elevationInfo.get(),
+        timeoutMs);
+}
+
+// Try to connect to the server which last compiled the project with the
+// given affinity key. The wait is kept short so that a busy server doesn't
+// cost more than we'd gain from its warm caches. The id of the preferred
+// server is returned even if connecting to it failed.
+HANDLE TryPreferredProcess(
+    _In_z_ LPCWSTR expectedProcessName,
+    _In_ const wstring& stateDirectory,
+    _In_ const wstring& affinityKey,
+    _Out_ DWORD& processId)
+{
+    processId = 0;
+    if (stateDirectory.empty()
+        || !LookupServerAffinity(stateDirectory, affinityKey, processId))
+    {
+        return NULL;
+    }
+
+    LogFormatted(IDS_TryingPreferredProcess, processId);
+
+    return TryKnownProcess(
+        expectedProcessName,
+        processId,
+        TimeOutMsPreferredProcess);
+}
+
+// Try to connect to the server which last accepted a connection from any
+// client, unless it is the excluded process which was already tried.
+HANDLE TryLastServer(
+    _In_z_ LPCWSTR expectedProcessName,
+    _In_ const wstring& stateDirectory,
+    DWORD excludedProcessId,
+    _Out_ DWORD& connectedProcessId)
+{
+    connectedProcessId = 0;
+
+    DWORD processId;
+    if (stateDirectory.empty()
+        || !LookupLastServer(stateDirectory, processId)
+        || processId == excludedProcessId)
+    {
+        return NULL;
+    }
+
+    LogFormatted(IDS_TryingLastServer, processId);
+
+    HANDLE pipeHandle = TryKnownProcess(
+        expectedProcessName,
+        processId,
+        TimeOutMsExistingProcess);
+    if (pipeHandle != NULL)
+    {
+        connectedProcessId = processId;
+    }
+    return pipeHandle;
+}
+
+// Check that a priority is one of the priority classes the server knows,
+// and normalize its case.
+bool ValidatePriority(_Inout_ wstring& priority)
+{
+    transform(priority.begin(), priority.end(), priority.begin(), towlower);
+    return priority == L"interactive"
+        || priority == L"normal"
+        || priority == L"background";
+}
+
+// Parse a deadline given in seconds. Returns false unless it's a positive
+// number of seconds the client can count down.
+bool ParseDeadline(_In_ const wstring& value, _Out_ DWORD& deadlineSeconds)
+{
+    deadlineSeconds = 0;
+
+    wchar_t * end;
+    auto seconds = wcstoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != L'\0' || seconds == 0 || seconds > MaxDeadlineSeconds)
+    {
+        return false;
+    }
+
+    deadlineSeconds = seconds;
+    return true;
+}
+
 // N.B. Native client arguments (e.g., /keepalive) are NOT supported in response
 // files.
 // Aside from separation of concerns, this is important because we endeavor to
@@ -507,9 +1124,13 @@ HANDLE TryExistingProcesses(_In_z_ LPCWSTR expectedProcessName)
 bool ParseAndValidateClientArguments(
     _Inout_ list<wstring>& arguments,
     _Out_ wstring& keepAliveValue,
+    _Out_ wstring& priorityValue,
+    _Out_ DWORD& deadlineSeconds,
     _Out_ int& errorId)
 {
     keepAliveValue.clear();
+    priorityValue.clear();
+    deadlineSeconds = 0;
     errorId = 0;
     auto iter = arguments.cbegin();
     while (iter != arguments.cend())
@@ -551,88 +1172,582 @@ bool ParseAndValidateClientArguments(
                 return false;
             }
         }
+        else if (arg.find(L"/priority") == 0)
+        {
+            auto prefixLen = wcslen(L"/priority");
 
-        ++iter;
-    }
-    return true;
-}
+            if (arg.length() < prefixLen + 2 ||
+                (arg.at(prefixLen) != L':' && arg.at(prefixLen) != L'='))
+            {
+                errorId = IDS_MissingPriority;
+                return false;
+            }
 
-bool TryRunServerCompilation(
-    RequestLanguage language,
-    _In_ const list<wstring>& commandLineArgs,
-    _In_ const wstring& keepAlive,
-    _Out_ CompletedResponse& response)
-{
-    InitializeLogging();
+            priorityValue = arg.substr(prefixLen + 1);
+            if (!ValidatePriority(priorityValue))
+            {
+                errorId = IDS_InvalidPriority;
+                return false;
+            }
 
-    LogTime();
+            iter = arguments.erase(iter);
+            continue;
+        }
+        else if (arg.find(L"/deadline") == 0)
+        {
+            auto prefixLen = wcslen(L"/deadline");
 
-    wstring expectedProcessPath;
-    if (!GetExpectedProcessPath(SERVERNAME, expectedProcessPath))
-    {
-        FailWithGetLastError(IDS_GetExpectedProcessPathFailed);
-    }
+            if (arg.length() < prefixLen + 2 ||
+                (arg.at(prefixLen) != L':' && arg.at(prefixLen) != L'='))
+            {
+                errorId = IDS_MissingDeadline;
+                return false;
+            }
 
-    // First attempt to grab the mutex
-    wstring mutexName(expectedProcessPath);
-    replace(mutexName.begin(), mutexName.end(), L'\\', L'/');
+            if (!ParseDeadline(arg.substr(prefixLen + 1), deadlineSeconds))
+            {
+                errorId = IDS_InvalidDeadline;
+                return false;
+            }
+
+            iter = arguments.erase(iter);
+            continue;
+        }
+
+        ++iter;
+    }
+
+    if (priorityValue.empty() && GetEnvVar(PRIORITY_ENV_VAR, priorityValue)
+        && !ValidatePriority(priorityValue))
+    {
+        errorId = IDS_InvalidPriority;
+        return false;
+    }
+
+    wstring deadline;
+    if (deadlineSeconds == 0 && GetEnvVar(DEADLINE_ENV_VAR, deadline)
+        && !ParseDeadline(deadline, deadlineSeconds))
+    {
+        errorId = IDS_InvalidDeadline;
+        return false;
+    }
+    return true;
+}
+
+// Get the name of the event clients signal once a server they started or
+// found accepts connections.
+wstring GetServerReadyEventName(_In_ const wstring& expectedProcessPath)
+{
+    wstring name(expectedProcessPath);
+    replace(name.begin(), name.end(), L'\\', L'/');
+    return name + L"/ready";
+}
+
+// Connect to a running server, or start a new one, while holding the
+// server creation mutex.
+//
+// Clients which find the mutex taken also wait on a manual reset "ready"
+// event. The client holding the mutex signals it as soon as a server
+// accepts its connection, which releases all waiting clients at once to
+// connect to that server directly instead of taking the mutex and
+// enumerating processes one at a time. Clients that still need the mutex
+// take it one at a time in no particular order; Windows doesn't promise
+// to grant a mutex to its waiters first in, first out.
+//
+// With a hedged start the client never waits for a server to start up.
+// If it has to start one it leaves it starting in the background and
+// returns no connection, so the caller compiles with the fallback compiler
+// while the server warms up for later compilations. Running the fallback
+// compiler and the server on the same request would race two compilers
+// writing the same outputs, so the request is never sent to both.
+HANDLE ConnectOrCreateServer(
+    _In_ const wstring& expectedProcessPath,
+    _In_ const wstring& stateDirectory,
+    DWORD excludedProcessId,
+    bool hedgedStart,
+    _Out_ DWORD& processId)
+{
+    processId = 0;
+    DWORD waitTime = hedgedStart ? 0 : TimeOutMsNewProcess;
+
+    wstring mutexName(expectedProcessPath);
+    replace(mutexName.begin(), mutexName.end(), L'\\', L'/');
+
+    SmartHandle readyEvent(CreateEventW(nullptr,
+                                        TRUE, // manual reset
+                                        FALSE, // initially not signaled
+                                        GetServerReadyEventName(expectedProcessPath).c_str()));
+    if (readyEvent == nullptr)
+    {
+        LogWin32Error(IDS_CreateReadyEventFailed);
+    }
 
     Log(IDS_CreatingMutex);
 
+#pragma warning(suppress: 28159)
+    DWORD startTicks = GetTickCount();
     SmartMutex createProcessMutex(mutexName.c_str());
 
     // If the mutex already exists and someone else has it, we should wait
     if (!createProcessMutex.HoldsMutex())
     {
-        createProcessMutex.Wait(TimeOutMsNewProcess);
+        bool serverReady;
+        createProcessMutex.WaitOrEvent(readyEvent.get(), waitTime, serverReady);
+        if (serverReady)
+        {
+            HANDLE pipeHandle = TryLastServer(
+                expectedProcessPath.c_str(),
+                stateDirectory,
+                excludedProcessId,
+                processId);
+            if (pipeHandle != NULL)
+            {
+                return pipeHandle;
+            }
+
+            // The event was left over from a server which has since gone
+            // away. Queue for the mutex for whatever time remains.
+#pragma warning(suppress: 28159)
+            DWORD elapsed = GetTickCount() - startTicks;
+            if (elapsed < waitTime)
+            {
+                createProcessMutex.Wait(waitTime - elapsed);
+            }
+        }
     }
 
-    SmartHandle pipeHandle = nullptr;
-    DWORD processId = 0;
+    if (!createProcessMutex.HoldsMutex())
+    {
+        return NULL;
+    }
 
-    // Proceed with the mutex
-    if (createProcessMutex.HoldsMutex())
+    // Whatever server the event announced before is no longer usable.
+    if (readyEvent != nullptr)
+    {
+        ResetEvent(readyEvent.get());
+    }
+
+    // Check for already running processes in case someone came in before us
+    HANDLE pipeHandle = TryLastServer(
+        expectedProcessPath.c_str(),
+        stateDirectory,
+        excludedProcessId,
+        processId);
+    if (pipeHandle == NULL)
     {
-        // Check for already running processes in case someone came in before us
         Log(IDS_TryingExistingProcesses);
-        pipeHandle.reset(TryExistingProcesses(expectedProcessPath.c_str()));
-        if (pipeHandle != nullptr)
+        pipeHandle = TryExistingProcesses(
+            expectedProcessPath.c_str(),
+            excludedProcessId,
+            processId);
+    }
+
+    // Another client may have failed to start a server while this one
+    // waited for the mutex.
+    DWORD backoffMs;
+    if (pipeHandle == NULL && IsServerSpawnBackedOff(stateDirectory, backoffMs))
+    {
+        LogFormatted(IDS_ServerSpawnBackedOff, backoffMs);
+        return NULL;
+    }
+
+    // A server left starting in the background can only be announced to
+    // other clients if they can connect to it right away.
+    bool startedInBackground = false;
+    if (pipeHandle == NULL)
+    {
+        Log(IDS_CreatingNewProcess);
+#pragma warning(suppress: 28159)
+        DWORD createTicks = GetTickCount();
+        HANDLE tempProcessHandle;
+        HANDLE tempReadyEvent;
+        bool pipesCreated;
+        wstring warmupProfilePath;
+        GetWarmupProfilePath(stateDirectory, warmupProfilePath);
+        processId = CreateNewServerProcess(expectedProcessPath.c_str(), warmupProfilePath, tempProcessHandle, tempReadyEvent, pipesCreated);
+        if (processId != 0)
+        {
+            SmartHandle processHandle(tempProcessHandle);
+            SmartHandle serverReadyEvent(tempReadyEvent);
+            if (hedgedStart)
+            {
+                LogFormatted(IDS_HedgedStart, processId);
+                startedInBackground = pipesCreated;
+            }
+            else
+            {
+                LogFormatted(IDS_ConnectingToNewProcess, processId);
+                pipeHandle = ConnectToNewProcess(processId, processHandle.get(), serverReadyEvent.get(), pipesCreated, createTicks);
+                if (pipeHandle != NULL)
+                {
+                    RecordServerSpawnSuccess(stateDirectory);
+                }
+            }
+        }
+
+        if (processId == 0 || (pipeHandle == NULL && !hedgedStart))
+        {
+            RecordServerSpawnFailure(stateDirectory);
+        }
+    }
+
+    if (pipeHandle != NULL || startedInBackground)
+    {
+        // Let everyone else access our process
+        if (pipeHandle != NULL)
         {
             Log(IDS_Connected);
-            createProcessMutex.release();
-            Log(IDS_Compiling);
+        }
+        if (!stateDirectory.empty())
+        {
+            RecordLastServer(stateDirectory, processId);
+        }
+        if (readyEvent != nullptr)
+        {
+            SetEvent(readyEvent.get());
+        }
+    }
+
+    createProcessMutex.release();
+    return pipeHandle;
+}
+
+// Cancel a request whose compilation the client no longer wants and wait
+// for the server to stop it. The server closes the pipe once it has; a
+// response which was already on its way is read and dropped.
+void AbandonServerRequest(
+    HANDLE pipeHandle,
+    _In_ IPipe& transport)
+{
+    Log(IDS_SendingCancel);
+    RealPipe wrapper(pipeHandle);
+    if (!WriteCancelRequest(wrapper))
+    {
+        return;
+    }
+
+    Log(IDS_WaitingForServerToStop);
+    BYTE discarded[4096];
+    while (transport.Read(discarded, sizeof(discarded)))
+    {
+    }
+}
+
+// Read the server's response to a request already sent. If it hasn't
+// arrived after hedgeAfterMs, also start the hedged compilation and use
+// whichever finishes first. The loser is stopped and nothing it produced
+// is used or printed.
+_Success_(return != false)
+bool ReadResponseOrHedge(
+    HANDLE pipeHandle,
+    IPipe& transport,
+    int protocolVersion,
+    DWORD hedgeAfterMs,
+    DWORD deadlineMs,
+    _Inout_ HedgedCompilation& hedge,
+    _Out_ CompletedResponse& response,
+    _Out_ unique_ptr<BusyResponse>& busyResponse,
+    _Out_ bool& hedgeWon,
+    _Out_ FallbackResult& hedgeResult)
+{
+    hedgeWon = false;
+
+    SmartHandle readDone(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    if (readDone == nullptr)
+    {
+        RequestCancellation cancellation(pipeHandle, deadlineMs);
+        return ReadResponse(transport, protocolVersion, response, busyResponse);
+    }
+
+    // The response is read on another thread so that the wait for it can
+    // time out, and so that the read can be cancelled if the hedge wins.
+    bool readSucceeded = false;
+    exception_ptr readException;
+    thread reader([&]()
+    {
+        try
+        {
+            RequestCancellation cancellation(pipeHandle, deadlineMs);
+            readSucceeded = ReadResponse(transport, protocolVersion, response, busyResponse);
+        }
+        catch (...)
+        {
+            readException = current_exception();
+        }
+        SetEvent(readDone.get());
+    });
+
+    if (WaitForSingleObject(readDone.get(), hedgeAfterMs) == WAIT_TIMEOUT
+        && hedge.Start())
+    {
+        LogFormatted(IDS_StartingHedge, hedgeAfterMs);
 
-            return TryCompile(pipeHandle.get(),
-                              language,
-                              commandLineArgs,
-                              keepAlive,
-                              response);
+        HANDLE handles[] = { readDone.get(), hedge.GetDoneEvent() };
+        if (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1
+            && hedge.Wait())
+        {
+            // Cancelling only affects a read which is already pending, so
+            // keep at it until the reader gives up.
+            while (WaitForSingleObject(readDone.get(), 10) == WAIT_TIMEOUT)
+            {
+                CancelSynchronousIo(reader.native_handle());
+            }
+            reader.join();
+
+            // The server may still be writing the same outputs, so they
+            // are only moved into place once it has stopped.
+            AbandonServerRequest(pipeHandle, transport);
+            hedgeWon = hedge.Finish(hedgeResult);
+            if (hedgeWon)
+            {
+                Log(IDS_HedgeWon);
+            }
+            return hedgeWon;
+        }
+
+        WaitForSingleObject(readDone.get(), INFINITE);
+        reader.join();
+        if (IsCompilationCancelled() || HasRequestTimedOut())
+        {
+            hedge.Cancel();
+            return false;
+        }
+
+        if (readException == nullptr && readSucceeded)
+        {
+            Log(IDS_ServerWonHedge);
+            hedge.Cancel();
+            return true;
+        }
+
+        // The server failed, but the hedge may still succeed.
+        if (hedge.Finish(hedgeResult))
+        {
+            Log(IDS_HedgeWon);
+            hedgeWon = true;
+            return true;
+        }
+    }
+    else
+    {
+        WaitForSingleObject(readDone.get(), INFINITE);
+        reader.join();
+    }
+
+    // Whatever went wrong with a read that was cancelled doesn't matter.
+    if (IsCompilationCancelled() || HasRequestTimedOut())
+    {
+        return false;
+    }
+
+    if (readException != nullptr)
+    {
+        rethrow_exception(readException);
+    }
+    return readSucceeded;
+}
+
+bool TryRunServerCompilation(
+    RequestLanguage language,
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& keepAlive,
+    _In_ const wstring& priority,
+    ULONGLONG deadlineTicks,
+    _In_z_ LPCWSTR fallbackCompilerName,
+    _Out_ CompletedResponse& response,
+    _Out_ bool& hedgeWon,
+    _Out_ FallbackResult& hedgeResult)
+{
+    hedgeWon = false;
+
+    InitializeLogging();
+
+    LogTime();
+
+    wstring expectedProcessPath;
+    if (!GetExpectedProcessPath(SERVERNAME, expectedProcessPath))
+    {
+        FailWithGetLastError(IDS_GetExpectedProcessPathFailed);
+    }
+
+    // Without a state directory we simply don't have a preferred server.
+    wstring stateDirectory;
+    if (!GetClientStateDirectory(expectedProcessPath, stateDirectory))
+    {
+        stateDirectory.clear();
+    }
+    auto affinityKey = ComputeAffinityKey(GetCurrentDirectory(), commandLineArgs);
+    RecordWarmupProfile(stateDirectory, language, commandLineArgs, GetCurrentDirectory());
+
+    vector<wstring> prepareReferences;
+    vector<wstring> prepareSources;
+    GetPreparePaths(commandLineArgs, GetCurrentDirectory(), prepareReferences, prepareSources);
+
+    // Unless told otherwise, ask the server to stay alive through the usual
+    // gap between builds.
+    wstring requestKeepAlive(keepAlive);
+    if (requestKeepAlive.empty())
+    {
+        GetAdaptiveKeepAlive(stateDirectory, requestKeepAlive);
+    }
+
+    SmartHandle pipeHandle = nullptr;
+    DWORD processId = 0;
+
+    // Most of the time a healthy server already exists, so first try the
+    // servers earlier clients used without taking the creation mutex. Only
+    // clients which may have to create a server serialize on it.
+    DWORD preferredProcessId;
+    pipeHandle.reset(TryPreferredProcess(
+        expectedProcessPath.c_str(),
+        stateDirectory,
+        affinityKey,
+        preferredProcessId));
+    processId = preferredProcessId;
+    if (pipeHandle == nullptr)
+    {
+        pipeHandle.reset(TryLastServer(
+            expectedProcessPath.c_str(),
+            stateDirectory,
+            preferredProcessId,
+            processId));
+    }
+
+    auto connectOrCreateServer = [&](DWORD excludedProcessId)
+    {
+        // After a server recently failed to start, don't wait for another.
+        DWORD backoffMs;
+        if (IsServerSpawnBackedOff(stateDirectory, backoffMs))
+        {
+            LogFormatted(IDS_ServerSpawnBackedOff, backoffMs);
+            return;
+        }
+
+        wstring hedgedStart;
+        pipeHandle.reset(ConnectOrCreateServer(
+            expectedProcessPath,
+            stateDirectory,
+            excludedProcessId,
+            GetEnvVar(HEDGEDSTART_ENV_VAR, hedgedStart) && hedgedStart == L"1",
+            processId));
+    };
+
+    if (pipeHandle == nullptr)
+    {
+        connectOrCreateServer(0); // no excluded process
+    }
+
+    // A server with a full queue declines the request. Rather than wait
+    // behind its backlog, send the request to another server, starting one
+    // if need be. If that server is busy too, give up and fall back.
+    DWORD busyProcessId = 0;
+    while (pipeHandle != nullptr)
+    {
+        Log(IDS_Compiling);
+
+        // Requests and the response go through shared memory if possible.
+        // The pipe is still used to cancel the request.
+        RealPipe realPipe(pipeHandle.get());
+        SharedMemoryPipe sharedMemoryPipe(pipeHandle.get());
+        IPipe& transport = ConnectSharedMemoryTransport(sharedMemoryPipe, processId)
+            ? static_cast<IPipe&>(sharedMemoryPipe)
+            : realPipe;
+        auto protocolVersion = GetServerProtocolVersion(processId);
+
+        // The server starts loading what the compilation reads while the
+        // rest of the request is put together.
+        if (ServerAcceptsPrepareRequest(processId)
+            && !WritePrepareRequest(transport, protocolVersion, prepareReferences, prepareSources))
+        {
+            return false;
+        }
+
+        // Only the first request is hedged. Any later one is already late.
+        DWORD hedgeAfterMs;
+        wstring fallbackCompilerPath;
+        HedgedCompilation hedge;
+        if (busyProcessId != 0
+            || !GetHedgeDelay(stateDirectory, hedgeAfterMs)
+            || !GetExpectedProcessPath(fallbackCompilerName, fallbackCompilerPath)
+            || !hedge.Initialize(fallbackCompilerPath, commandLineArgs, GetCurrentDirectory(), stateDirectory))
+        {
+            hedgeAfterMs = INFINITE;
+        }
+
+        // The server is told how long the result is still wanted, so
+        // that it can abandon the request in time.
+        DWORD deadlineMs = INFINITE;
+        if (deadlineTicks != 0)
+        {
+            auto nowTicks = GetTickCount64();
+            if (nowTicks >= deadlineTicks)
+            {
+                Log(IDS_DeadlineExpired);
+                return false;
+            }
+            deadlineMs = static_cast<DWORD>(deadlineTicks - nowTicks);
+        }
+
+        if (!WriteCompileRequest(transport, protocolVersion, language, commandLineArgs, requestKeepAlive, priority, deadlineMs))
+        {
+            return false;
+        }
+
+#pragma warning(suppress: 28159)
+        DWORD startTicks = GetTickCount();
+        unique_ptr<BusyResponse> busyResponse;
+        bool succeeded;
+        if (hedgeAfterMs == INFINITE)
+        {
+            RequestCancellation cancellation(pipeHandle.get(), deadlineMs);
+            succeeded = ReadResponse(transport, protocolVersion, response, busyResponse);
+            if (succeeded)
+            {
+                Log(IDS_SuccessfullyReadResponse);
+            }
         }
         else
         {
-            Log(IDS_CreatingNewProcess);
-            processId = CreateNewServerProcess(expectedProcessPath.c_str());
-            if (processId != 0)
+            succeeded = ReadResponseOrHedge(pipeHandle.get(), transport, protocolVersion, hedgeAfterMs, deadlineMs, hedge, response, busyResponse, hedgeWon, hedgeResult);
+        }
+
+        // Whatever was read is incomplete.
+        if (IsCompilationCancelled())
+        {
+            Log(IDS_CompilationCancelled);
+            return false;
+        }
+
+        if (HasRequestTimedOut())
+        {
+            Log(IDS_DeadlineExpired);
+            return false;
+        }
+
+        if (succeeded)
+        {
+            // When the hedge won, the time taken is only a lower bound on
+            // how long the server would have taken. Recording it would
+            // bring hedges on ever sooner.
+            if (!stateDirectory.empty() && !hedgeWon)
             {
-                LogFormatted(IDS_ConnectingToNewProcess, processId);
-                pipeHandle.reset(ConnectToProcess(processId, TimeOutMsNewProcess));
-                if (pipeHandle != nullptr)
-                {
-                    // Let everyone else access our process
-                    Log(IDS_Connected);
-                    createProcessMutex.release();
-                    Log(IDS_Compiling);
-
-                    return TryCompile(pipeHandle.get(),
-                                      language,
-                                      commandLineArgs,
-                                      keepAlive,
-                                      response);
-                }
+#pragma warning(suppress: 28159)
+                RecordServerLatency(stateDirectory, GetTickCount() - startTicks);
+                RecordServerAffinity(stateDirectory, affinityKey, processId);
+                RecordLastServer(stateDirectory, processId);
             }
+            return true;
         }
 
-        createProcessMutex.release();
+        if (busyResponse == nullptr || busyProcessId != 0)
+        {
+            break;
+        }
+
+        LogFormatted(IDS_ServerBusy, processId, busyResponse->QueueDepth, busyResponse->RetryAfterMs);
+        busyProcessId = processId;
+        pipeHandle.reset(nullptr);
+        connectOrCreateServer(busyProcessId);
     }
 
     return false;
@@ -782,6 +1897,56 @@ void SetPreferredUILangForMessages(LPCWSTR rawCommandLineArgs[], int argsCount,
     }
 }
 
+// Whether the deadline, if there is one, has passed.
+bool HasDeadlinePassed(ULONGLONG deadlineTicks)
+{
+    return deadlineTicks != 0 && GetTickCount64() >= deadlineTicks;
+}
+
+// How long a wait may last before the deadline passes: INFINITE without a
+// deadline, and 0 once it has passed.
+DWORD GetDeadlineWaitMs(ULONGLONG deadlineTicks)
+{
+    if (deadlineTicks == 0)
+    {
+        return INFINITE;
+    }
+
+    auto nowTicks = GetTickCount64();
+    if (nowTicks >= deadlineTicks)
+    {
+        return 0;
+    }
+    return deadlineTicks - nowTicks < INFINITE
+        ? static_cast<DWORD>(deadlineTicks - nowTicks)
+        : INFINITE - 1;
+}
+
+// Create a timer which is signaled once the deadline passes, or return
+// null if there's no deadline.
+HANDLE CreateDeadlineTimer(ULONGLONG deadlineTicks)
+{
+    if (deadlineTicks == 0)
+    {
+        return nullptr;
+    }
+
+    auto nowTicks = GetTickCount64();
+    LARGE_INTEGER dueTime;
+    // Negative due times are relative, in 100 nanosecond units.
+    dueTime.QuadPart = nowTicks >= deadlineTicks
+        ? 0
+        : -static_cast<LONGLONG>(deadlineTicks - nowTicks) * 10000;
+
+    auto timer = CreateWaitableTimerW(nullptr, TRUE, nullptr);
+    if (timer != nullptr && !SetWaitableTimer(timer, &dueTime, 0, nullptr, nullptr, FALSE))
+    {
+        CloseHandle(timer);
+        timer = nullptr;
+    }
+    return timer;
+}
+
 // Shared helper for compilation.
 // If printOutput is true then the output will be directly printed to stdout
 // and stderr. Otherwise, it will be returned through the out parameters.
@@ -825,25 +1990,99 @@ int Run(_In_ RequestLanguage language,
     // Get the args without the native client-specific arguments
     list<wstring> argsList(args, args + argsCount);
     wstring keepAlive;
+    wstring priority;
+    DWORD deadlineSeconds;
     int errorId;
-    if (!ParseAndValidateClientArguments(argsList, keepAlive, errorId))
+    if (!ParseAndValidateClientArguments(argsList, keepAlive, priority, deadlineSeconds, errorId))
     {
         OutputWideString(stdout, GetResourceString(errorId), /*utf8output*/true);
         return 1;
     }
 
-    // Try to use the compiler server
+    ULONGLONG deadlineTicks = deadlineSeconds == 0
+        ? 0 // no deadline
+        : GetTickCount64() + deadlineSeconds * 1000ULL;
+
+    // An identical earlier compilation needs no compiler at all.
+    InitializeLogging();
+    wstring serverPath;
+    wstring stateDirectory;
+    if (!GetExpectedProcessPath(SERVERNAME, serverPath)
+        || !GetClientStateDirectory(serverPath, stateDirectory))
+    {
+        stateDirectory.clear();
+    }
+
     CompletedResponse response;
-    if (TryRunServerCompilation(
-        language,
-        argsList,
-        keepAlive,
-        response))
+    ResultCache resultCache;
+    BuildManifest buildManifest(stateDirectory);
+    CoalescedCompilation coalescedCompilation(stateDirectory);
+    CompilationKey compilationKey;
+    auto hasKey = false;
+    if (resultCache.IsEnabled() || buildManifest.IsEnabled() || coalescedCompilation.IsEnabled())
+    {
+        hasKey = GetCompilationKey(language, argsList, GetCurrentDirectory(), stateDirectory, compilationKey);
+        if (!hasKey)
+        {
+            Log(IDS_CompilationNotCacheable);
+        }
+    }
+
+    if (hasKey && buildManifest.IsUpToDate(compilationKey, response))
     {
-        exitCode = response.ExitCode;
         OutputResponse(response);
+        return response.ExitCode;
     }
-    else
+
+    if (hasKey && resultCache.TryRestore(compilationKey, response))
+    {
+        buildManifest.Record(compilationKey, response);
+        OutputResponse(response);
+        return response.ExitCode;
+    }
+
+    // Neither does one which another client is compiling right now.
+    if (hasKey
+        && coalescedCompilation.IsEnabled()
+        && !coalescedCompilation.Claim(compilationKey, serverPath)
+        && coalescedCompilation.Join(deadlineTicks, response))
+    {
+        OutputResponse(response);
+        return response.ExitCode;
+    }
+
+    // Try to use the compiler server
+    bool hedgeWon;
+    FallbackResult fallbackResult;
+    auto tryServerCompilation = [&]()
+    {
+        return TryRunServerCompilation(
+            language,
+            argsList,
+            keepAlive,
+            priority,
+            deadlineTicks,
+            clientExeName,
+            response,
+            hedgeWon,
+            fallbackResult);
+    };
+
+    bool compiled = tryServerCompilation();
+    if (!compiled && IsCompilationCancelled())
+    {
+        return CancelledExitCode;
+    }
+
+    // The timer which interrupts the read may fire a tick before the
+    // deadline by the clock.
+    if (!compiled && (HasDeadlinePassed(deadlineTicks) || HasRequestTimedOut()))
+    {
+        OutputWideString(stderr, GetResourceString(IDS_DeadlineExpired), true);
+        return 1;
+    }
+
+    if (!compiled)
     {
         // Fallback to csc.exe
         wstring processPath;
@@ -851,18 +2090,92 @@ int Run(_In_ RequestLanguage language,
         {
             FailWithGetLastError(GetResourceString(IDS_ConnectToInProcCompilerFailed));
         }
-        vector<BYTE> rawOutOutput, rawErrOutput;
-        exitCode = RunInProcCompiler(processPath, argsList, rawOutOutput, rawErrOutput);
 
-        if (exitCode != 0 && rawOutOutput.empty() && rawErrOutput.empty())
+        // Only so many fallback compilers may run at once. If another
+        // client gets a server going while this one waits its turn, use
+        // the server instead.
+        SmartHandle serverReadyEvent(!serverPath.empty()
+            ? OpenEventW(SYNCHRONIZE, FALSE, GetServerReadyEventName(serverPath).c_str())
+            : nullptr);
+        auto slotCount = GetFallbackSlotCount();
+        LogFormatted(IDS_FallbackSlots, slotCount);
+        SmartSlot fallbackSlots(GetFallbackSlotsName(processPath).c_str(), slotCount);
+        bool serverReady;
+        auto holdsSlot = fallbackSlots.WaitOrEvent(serverReadyEvent.get(), GetDeadlineWaitMs(deadlineTicks), serverReady);
+        if (!holdsSlot && serverReady)
         {
-            OutputWideString(stderr, GetResourceString(IDS_ExceptionFilterCrash), true);
-            exitCode = -1;
+            compiled = tryServerCompilation();
+            if (!compiled && IsCompilationCancelled())
+            {
+                return CancelledExitCode;
+            }
+
+            if (!compiled)
+            {
+                holdsSlot = fallbackSlots.WaitOrEvent(nullptr, GetDeadlineWaitMs(deadlineTicks), serverReady);
+            }
+        }
+
+        // Only the deadline ends the wait for a slot early.
+        if (!compiled && (!holdsSlot || HasDeadlinePassed(deadlineTicks)))
+        {
+            OutputWideString(stderr, GetResourceString(IDS_DeadlineExpired), true);
+            return 1;
+        }
+
+        if (!compiled)
+        {
+            // The output is printed as it arrives, and kept for clients
+            // waiting on the same request. The compiler is stopped if it's
+            // still running when the deadline passes.
+            auto keepOutput = hasKey && coalescedCompilation.IsEnabled();
+            OutputSink stdOut(stdout, keepOutput), stdErr(stderr, keepOutput);
+            SmartHandle deadlineTimer(CreateDeadlineTimer(deadlineTicks));
+            exitCode = RunInProcCompiler(
+                processPath,
+                argsList,
+                stdOut,
+                stdErr,
+                deadlineTimer.get());
+
+            if (HasDeadlinePassed(deadlineTicks))
+            {
+                OutputWideString(stderr, GetResourceString(IDS_DeadlineExpired), true);
+                exitCode = 1;
+            }
+            else if (exitCode != 0 && stdOut.IsEmpty() && stdErr.IsEmpty())
+            {
+                OutputWideString(stderr, GetResourceString(IDS_ExceptionFilterCrash), true);
+                exitCode = -1;
+            }
+            else if (keepOutput)
+            {
+                FallbackResult ranResult;
+                ranResult.exitCode = exitCode;
+                stdOut.TakeBuffer(ranResult.stdOut);
+                stdErr.TakeBuffer(ranResult.stdErr);
+                PublishFallbackResult(coalescedCompilation, ranResult, argsList);
+            }
+        }
+    }
+
+    if (compiled)
+    {
+        if (hedgeWon)
+        {
+            exitCode = OutputFallbackResult(fallbackResult);
+            PublishFallbackResult(coalescedCompilation, fallbackResult, argsList);
         }
         else
         {
-            fwrite(rawOutOutput.data(), sizeof(BYTE), rawOutOutput.size(), stdout);
-            fwrite(rawErrOutput.data(), sizeof(BYTE), rawErrOutput.size(), stderr);
+            exitCode = response.ExitCode;
+            OutputResponse(response);
+            coalescedCompilation.Publish(response);
+            if (hasKey)
+            {
+                resultCache.Store(compilationKey, response);
+                buildManifest.Record(compilationKey, response);
+            }
         }
     }
     return exitCode;
@@ -8,7 +8,14 @@
 
 int Run(RequestLanguage language);
 
+wstring GetCurrentDirectory();
+wstring GetTempPath();
+
+void OutputWideString(_In_ FILE * outputFile, _In_ const wstring& str, bool utf8Output);
+
 bool ParseAndValidateClientArguments(
     _Inout_ list<wstring>& arguments,
     _Out_ wstring& keepAliveValue,
+    _Out_ wstring& priorityValue,
+    _Out_ DWORD& deadlineSeconds,
     _Out_ int& errorId);
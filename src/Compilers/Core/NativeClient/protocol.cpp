@@ -2,6 +2,8 @@
 #include "pipe_utils.h"
 #include "protocol.h"
 #include "logging.h"
+#include "smart_resources.h"
+#include "transcode.h"
 #include "UIStrings.h"
 
 using namespace std;
@@ -78,6 +80,24 @@ void Request::AddKeepAlive(wstring&& value)
     arguments.emplace_back(ArgumentId::KEEPALIVE, 0, move(value));
 }
 
+void Request::AddPriority(wstring&& value)
+{
+    arguments.emplace_back(ArgumentId::PRIORITY, 0, move(value));
+}
+
+void Request::AddDeadline(wstring&& value)
+{
+    arguments.emplace_back(ArgumentId::DEADLINE, 0, move(value));
+}
+
+void Request::AddPaths(ArgumentId id, _In_ const vector<wstring>& paths)
+{
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        this->arguments.emplace_back(id, static_cast<int>(i), wstring(paths[i]));
+    }
+}
+
 // TODO(angocke): This function is dependent on the machine architecture being little
 // endian. We should evaluate other serialization options.
 void AddData(vector<BYTE> &buffer, LPCVOID pData, size_t cData)
@@ -100,24 +120,81 @@ void AddString(vector<BYTE> &buffer, LPCWSTR str)
     AddData(buffer, str, cch * sizeof(WCHAR));
 }
 
-void AddArgument(vector<BYTE> &buffer, int argumentId, int argumentIndex, LPCWSTR value)
+void AddUtf8String(vector<BYTE> &buffer, const wstring& str)
+{
+    // Room for the length and four bytes per character, trimmed to what
+    // the text takes.
+    auto lengthOffset = buffer.size();
+    AddInt32(buffer, 0);
+    auto start = buffer.size();
+    auto capacity = static_cast<int>(str.size() * 4);
+    buffer.resize(start + capacity);
+
+    auto bytes = TranscodeOutput(
+        CP_UTF8,
+        str.data(),
+        static_cast<int>(str.size()),
+        reinterpret_cast<char*>(buffer.data() + start),
+        capacity);
+    buffer.resize(start + bytes);
+    memcpy(&buffer[lengthOffset], &bytes, sizeof(bytes));
+}
+
+void AddArgument(vector<BYTE> &buffer, int protocolVersion, int argumentId, int argumentIndex, const wstring& value)
 {
     AddInt32(buffer, argumentId);
     AddInt32(buffer, argumentIndex);
-    AddString(buffer, value);
+    if (protocolVersion > UTF16_PROTOCOL_VERSION)
+    {
+        AddUtf8String(buffer, value);
+    }
+    else
+    {
+        AddString(buffer, value.c_str());
+    }
+}
+
+// Is there a surrogate without its other half in the text?
+bool HasUnpairedSurrogate(const wstring& value)
+{
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        if (IS_HIGH_SURROGATE(value[i]) && i + 1 < value.size() && IS_LOW_SURROGATE(value[i + 1]))
+        {
+            i++;
+        }
+        else if (IS_HIGH_SURROGATE(value[i]) || IS_LOW_SURROGATE(value[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
 }
 
 bool Request::WriteToPipe(IPipe& pipe)
 {
     vector<BYTE> buffer;
 
+    if (this->ProtocolVersion > UTF16_PROTOCOL_VERSION)
+    {
+        for (auto& arg : this->arguments)
+        {
+            if (HasUnpairedSurrogate(arg.value))
+            {
+                this->ProtocolVersion = UTF16_PROTOCOL_VERSION;
+                break;
+            }
+        }
+    }
+
     AddInt32(buffer, this->ProtocolVersion);
     AddInt32(buffer, this->Language);
     
     AddInt32(buffer, static_cast<int>(this->arguments.size()));
-    for (auto arg : this->arguments)
+    for (auto& arg : this->arguments)
     {
-        AddArgument(buffer, arg.id, arg.index, arg.value.c_str());
+        AddArgument(buffer, this->ProtocolVersion, arg.id, arg.index, arg.value);
     }
 
     auto currentSize = static_cast<unsigned int>(buffer.size());
@@ -157,28 +234,74 @@ CompletedResponse& CompletedResponse::operator=(CompletedResponse&& other)
     return *this;
 }
 
-wstring ReadStringFromPipe(IPipe& pipe)
+// No compiler prints anywhere near this much, so a longer string in a
+// response means the response is corrupt.
+const int MaxResponseStringBytes = 256 * 1024 * 1024;
+const int MaxResponseStringChars = MaxResponseStringBytes / static_cast<int>(sizeof(wchar_t));
+
+// The string readers return false if the pipe fails partway, as it does
+// when a read is cancelled, so that the caller can tell why.
+bool ReadStringFromPipe(IPipe& pipe, _Out_ wstring& string)
 {
     int stringLength;
     if (!pipe.Read(&stringLength, sizeof(stringLength)))
     {
-        FailFormatted(IDS_PipeReadFailed);
+        LogFormatted(IDS_PipeReadFailed);
+        return false;
     }
 
     LogFormatted(IDS_StringLength, stringLength);
+    if (stringLength < 0 || stringLength > MaxResponseStringChars)
+    {
+        FailFormatted(IDS_PipeReadFailed);
+    }
 
-    wstring string;
     string.resize(stringLength);
 
     if (!pipe.Read(&string[0], stringLength * sizeof(wchar_t)))
+    {
+        LogFormatted(IDS_PipeReadFailed);
+        return false;
+    }
+
+    return true;
+}
+
+bool ReadUtf8StringFromPipe(IPipe& pipe, _Out_ wstring& value)
+{
+    int byteLength;
+    if (!pipe.Read(&byteLength, sizeof(byteLength)))
+    {
+        LogFormatted(IDS_PipeReadFailed);
+        return false;
+    }
+
+    LogFormatted(IDS_StringLength, byteLength);
+    if (byteLength < 0 || byteLength > MaxResponseStringBytes)
     {
         FailFormatted(IDS_PipeReadFailed);
     }
 
-    return string;
+    string bytes;
+    bytes.resize(byteLength);
+
+    if (!pipe.Read(&bytes[0], byteLength))
+    {
+        LogFormatted(IDS_PipeReadFailed);
+        return false;
+    }
+
+    value.clear();
+    if (byteLength > 0)
+    {
+        value.resize(MultiByteToWideChar(CP_UTF8, 0, bytes.data(), byteLength, nullptr, 0));
+        MultiByteToWideChar(CP_UTF8, 0, bytes.data(), byteLength, &value[0], static_cast<int>(value.size()));
+    }
+
+    return true;
 }
 
-bool ReadCompletedResponse(_In_ IPipe& pipe, _Out_ CompletedResponse& response)
+bool ReadCompletedResponse(_In_ IPipe& pipe, int protocolVersion, _Out_ CompletedResponse& response)
 {
     int exitCode; 
     if (!pipe.Read(&exitCode, sizeof(exitCode)))
@@ -192,17 +315,96 @@ bool ReadCompletedResponse(_In_ IPipe& pipe, _Out_ CompletedResponse& response)
         LogFormatted(IDS_PipeReadFailed);
         return false;
     }
-    auto output = ReadStringFromPipe(pipe);
-    auto errorOutput = ReadStringFromPipe(pipe);
+    auto readString = protocolVersion > UTF16_PROTOCOL_VERSION ? ReadUtf8StringFromPipe : ReadStringFromPipe;
+    wstring output;
+    wstring errorOutput;
+    if (!readString(pipe, output) || !readString(pipe, errorOutput))
+    {
+        return false;
+    }
 
     response = CompletedResponse(exitCode, utf8output, move(output), move(errorOutput));
     return true;
 }
 
-// Reads a response from the pipe. If an unexpected response is
-// received, throws a FatalError exception.
-bool ReadResponse(_In_ IPipe& pipe, _Out_ CompletedResponse& response)
+bool ReadSharedMemoryResponse(_In_ IPipe& pipe, _Out_ CompletedResponse& response)
 {
+    int exitCode;
+    bool utf8output;
+    unsigned long long section;
+    int outputLength;
+    int errorLength;
+    if (!pipe.Read(&exitCode, sizeof(exitCode))
+        || !pipe.Read(&utf8output, sizeof(utf8output))
+        || !pipe.Read(&section, sizeof(section))
+        || !pipe.Read(&outputLength, sizeof(outputLength))
+        || !pipe.Read(&errorLength, sizeof(errorLength)))
+    {
+        LogFormatted(IDS_PipeReadFailed);
+        return false;
+    }
+    LogFormatted(IDS_SharedMemoryOutput, outputLength + errorLength);
+
+    // The handle belongs to this process now, whatever becomes of the rest.
+    SmartHandle sectionHandle(reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(section)));
+    if (outputLength < 0 || outputLength > MaxResponseStringChars
+        || errorLength < 0 || errorLength > MaxResponseStringChars)
+    {
+        FailFormatted(IDS_PipeReadFailed);
+    }
+
+    // A view of no size would be a view of the whole section.
+    if (outputLength == 0 && errorLength == 0)
+    {
+        response = CompletedResponse(exitCode, utf8output, wstring(), wstring());
+        return true;
+    }
+
+    auto view = static_cast<const wchar_t*>(MapViewOfFile(
+        sectionHandle.get(),
+        FILE_MAP_READ,
+        0, // offset high
+        0, // offset low
+        (static_cast<size_t>(outputLength) + errorLength) * sizeof(wchar_t)));
+    if (view == nullptr)
+    {
+        LogWin32Error(IDS_MapSharedOutputFailed);
+        return false;
+    }
+
+    wstring output(view, outputLength);
+    wstring errorOutput(view + outputLength, errorLength);
+    UnmapViewOfFile(view);
+
+    response = CompletedResponse(exitCode, utf8output, move(output), move(errorOutput));
+    return true;
+}
+
+bool ReadBusyResponse(_In_ IPipe& pipe, _Out_ unique_ptr<BusyResponse>& busyResponse)
+{
+    int retryAfterMs;
+    int queueDepth;
+    if (!pipe.Read(&retryAfterMs, sizeof(retryAfterMs))
+        || !pipe.Read(&queueDepth, sizeof(queueDepth)))
+    {
+        LogFormatted(IDS_PipeReadFailed);
+        return false;
+    }
+
+    busyResponse = make_unique<BusyResponse>(retryAfterMs, queueDepth);
+    return true;
+}
+
+// Reads a response from the pipe. Returns false if the pipe fails before
+// the whole response is read, which is how a cancelled read ends. If an
+// unexpected response is received, throws a FatalError exception.
+bool ReadResponse(
+    _In_ IPipe& pipe,
+    int protocolVersion,
+    _Out_ CompletedResponse& response,
+    _Out_ unique_ptr<BusyResponse>& busyResponse)
+{
+    busyResponse.reset();
     Log(IDS_ReadingResponse);
 
     int sizeInBytes;
@@ -211,14 +413,14 @@ bool ReadResponse(_In_ IPipe& pipe, _Out_ CompletedResponse& response)
     if (!pipe.Read(&sizeInBytes, sizeof(sizeInBytes)))
     {
         LogFormatted(IDS_PipeReadFailed);
-        return true;
+        return false;
     }
     LogFormatted(IDS_ResponseSize, sizeInBytes);
 
     if (!pipe.Read(&responseType, sizeof(responseType)))
     {
         LogFormatted(IDS_PipeReadFailed);
-        return true;
+        return false;
     }
     LogFormatted(IDS_ResponseType, responseType);
 
@@ -229,9 +431,31 @@ bool ReadResponse(_In_ IPipe& pipe, _Out_ CompletedResponse& response)
         break;
     case Response::COMPLETED:
         break;
+    case Response::COMPLETED_IN_SHARED_MEMORY:
+        return ReadSharedMemoryResponse(pipe, response);
+    case Response::BUSY:
+        ReadBusyResponse(pipe, busyResponse);
+        return false;
     default:
         FailWithGetLastError(IDS_UnknownResponse);
         break;
     }
-    return ReadCompletedResponse(pipe, response);
+    return ReadCompletedResponse(pipe, protocolVersion, response);
+}
+
+bool WriteCancelRequest(IPipe& pipe)
+{
+    vector<BYTE> buffer;
+    AddInt32(buffer, sizeof(CANCEL_REQUEST));
+    AddInt32(buffer, CANCEL_REQUEST);
+    return pipe.Write(buffer.data(), static_cast<unsigned int>(buffer.size()));
+}
+
+bool WriteSharedMemoryTransportRequest(IPipe& pipe, unsigned long long section)
+{
+    vector<BYTE> buffer;
+    AddInt32(buffer, static_cast<int>(sizeof(SHARED_MEMORY_TRANSPORT) + sizeof(section)));
+    AddInt32(buffer, SHARED_MEMORY_TRANSPORT);
+    AddData(buffer, &section, sizeof(section));
+    return pipe.Write(buffer.data(), static_cast<unsigned int>(buffer.size()));
 }
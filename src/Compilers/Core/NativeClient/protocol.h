@@ -12,8 +12,12 @@
 
 using namespace std;
 
-// The version of the protocol
-const int PROTOCOL_VERSION = 2;
+// The version of the protocol. From this version strings are UTF-8.
+const int PROTOCOL_VERSION = 3;
+
+// The last version whose strings are UTF-16, which servers that don't
+// advertise PROTOCOL_VERSION expect.
+const int UTF16_PROTOCOL_VERSION = 2;
 
 // The id numbers below are just random. It's useful to use id numbers
 // that won't occur accidentally for debugging.
@@ -23,6 +27,9 @@ enum RequestLanguage
     CSHARPCOMPILE = 0x44532521,
     // vbc -- compiler VB
     VBCOMPILE = 0x44532522,
+    // Not a compilation, but the files the request which follows will read,
+    // so the server can start loading them early
+    PREPARE = 0x44532523,
 };
 
 // Possible arguments to the server or the compilation
@@ -37,7 +44,15 @@ enum ArgumentId
     // How long to extend compiler server lifetime
     KEEPALIVE,
     // Path of the directory designated for temporary files.
-    TEMPPATH
+    TEMPPATH,
+    // The priority class of the request: interactive, normal or background
+    PRIORITY,
+    // How many milliseconds the client still wants the result for
+    DEADLINE,
+    // In a prepare request, a reference the compilation reads. The argument index indicates which one (0 .. N)
+    REFERENCEPATH,
+    // In a prepare request, a source file the compilation reads. The argument index indicates which one (0 .. N)
+    SOURCEPATH
 };
 
 enum KeepAlive 
@@ -61,7 +76,11 @@ enum KeepAlive
 // ---------------------------------------------
 // Id               int             4
 // Index            int             4
-// Value            wchar_t[]       variable
+// Value            string          variable
+//
+// A string is its length as an int followed by its characters. Up to
+// version 2 the length counts wchar_t and the characters are UTF-16; from
+// version 3 it counts bytes and they are UTF-8.
 class Request
 {
 public:
@@ -100,9 +119,15 @@ public:
     void AddLibEnvVariable(wstring&& value);
     void AddTempPath(wstring&& value);
     void AddKeepAlive(wstring&& keepAlive);
+    void AddPriority(wstring&& priority);
+    void AddDeadline(wstring&& deadlineMs);
+    void AddPaths(ArgumentId id, _In_ const vector<wstring>& paths);
 
     // Write the request buffer to the pipe, prefixed by its length.
     // This procedure either succeeds or logs an error and exits the process.
+    // Text with a surrogate missing its other half has no UTF-8 encoding, so
+    // a request holding any is sent in UTF16_PROTOCOL_VERSION instead, and
+    // ProtocolVersion changed to match.
     bool WriteToPipe(IPipe&);
 
 private:
@@ -125,7 +150,9 @@ public:
     const enum ResponseType
     {
         MISMATCHED_VERSION,
-        COMPLETED
+        COMPLETED,
+        BUSY,
+        COMPLETED_IN_SHARED_MEMORY
     };
 
     virtual ResponseType GetResponseType() = 0;
@@ -148,4 +175,68 @@ public:
     CompletedResponse& operator=(CompletedResponse&& other);
 };
 
-bool ReadResponse(IPipe&, CompletedResponse&);
+// Sent instead of a completed response when the output is too large to
+// send through the pipe efficiently, if the request was in PROTOCOL_VERSION.
+// The server duplicates a handle to a section into the client process, the
+// one at the other end of the pipe, which holds the output and then the
+// error output as UTF-16 text.
+// The client maps the section and closes the handle.
+//
+// Field Name       Field Type          Size (bytes)
+// exitCode         int                 4
+// utf8Output       bool                1
+// section          HANDLE              8
+// outputLength     int                 4
+// errorLength      int                 4
+
+// Sent by a server too busy to take a request. The client should send the
+// request elsewhere rather than wait in line.
+//
+// Field Name       Field Type          Size (bytes)
+// retryAfterMs     int                 4
+// queueDepth       int                 4
+class BusyResponse : public Response
+{
+public:
+    // How long the server expects to stay busy.
+    int RetryAfterMs;
+    // How many requests the server has waiting.
+    int QueueDepth;
+
+    virtual ResponseType GetResponseType() { return BUSY; }
+    BusyResponse(int retryAfterMs, int queueDepth)
+        : RetryAfterMs(retryAfterMs), QueueDepth(queueDepth)
+    {}
+};
+
+// Reads a response from the pipe, encoded as strings are in the protocol
+// version of the request it answers. If the server declined the request,
+// busyResponse is set and false is returned. False is also returned if the
+// pipe fails partway, as it does when the read is cancelled.
+bool ReadResponse(IPipe&, int protocolVersion, CompletedResponse&, _Out_ unique_ptr<BusyResponse>& busyResponse);
+
+// Sent after a request, while waiting for its response, to ask the server
+// to abandon the compilation. Like a request it is prefixed by its length.
+//
+// Field Name       Field Type          Size (bytes)
+// length           int (4)             4
+// token            int                 4
+const int CANCEL_REQUEST = 0x44532530;
+
+// Write a cancel frame to the pipe.
+bool WriteCancelRequest(IPipe&);
+
+// Sent before the first request to hand the server the section through
+// which the requests and the response are exchanged, as described in
+// shared_memory_pipe.h. Like a request it is prefixed by its length.
+//
+// Field Name       Field Type          Size (bytes)
+// length           int (4)             4
+// token            int                 4
+// section          unsigned long long  8
+const int SHARED_MEMORY_TRANSPORT = 0x44532531;
+
+// Write a transport frame with the handle of the section in the client.
+// The server duplicates it out of the client process, which it finds from
+// the pipe, only after checking that the client runs as the same user.
+bool WriteSharedMemoryTransportRequest(IPipe&, unsigned long long section);
@@ -0,0 +1,274 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include "client_state.h"
+#include "logging.h"
+#include "result_cache.h"
+#include "smart_resources.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The size limit of the cache when none is given, in megabytes.
+const ULONGLONG DefaultResultCacheMegabytes = 2048;
+
+// The file in an entry which holds the exit code, whether the output is
+// UTF-8 and the indices of the outputs the entry holds. It is written last.
+const wchar_t * const RESULTFILENAME = L"result";
+const wchar_t * const STDOUTFILENAME = L"stdout";
+const wchar_t * const STDERRFILENAME = L"stderr";
+
+// Directories which are still being put together or taken apart have a
+// '.' in their name. Ones older than this were left by a client which died.
+const ULONGLONG AbandonedEntryMs = 60 * 60 * 1000;
+
+// Set the last write time of a file to now.
+bool TouchFile(_In_ const wstring& path)
+{
+    SmartHandle file(CreateFileW(
+        path.c_str(),
+        FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, // security attributes
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr)); // no template file
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return file.get() != INVALID_HANDLE_VALUE
+        && SetFileTime(file.get(), nullptr, nullptr, &now);
+}
+
+// Remove a directory and the files in it.
+void RemoveEntryDirectory(_In_ const wstring& directory)
+{
+    DeleteDirectoryFiles(directory);
+    RemoveDirectoryW(directory.c_str());
+}
+
+ResultCache::ResultCache()
+{
+    if (!GetEnvVar(RESULTCACHE_ENV_VAR, directory))
+    {
+        directory.clear();
+    }
+    else if (!directory.empty() && directory.back() != L'\\')
+    {
+        directory += L'\\';
+    }
+}
+
+bool ResultCache::IsEnabled()
+{
+    return !directory.empty();
+}
+
+bool ResultCache::TryRestore(
+    _In_ const CompilationKey& compilationKey,
+    _Out_ CompletedResponse& response)
+{
+    if (!IsEnabled())
+    {
+        return false;
+    }
+
+    auto& key = compilationKey.key;
+    auto& outputs = compilationKey.outputs;
+    auto entry = directory + key + L'\\';
+    wstring result;
+    wstring stdOut;
+    wstring stdErr;
+    if (!ReadUnicodeFile(entry + RESULTFILENAME, result)
+        || !ReadUnicodeFile(entry + STDOUTFILENAME, stdOut)
+        || !ReadUnicodeFile(entry + STDERRFILENAME, stdErr))
+    {
+        return false;
+    }
+
+    // The entry may be evicted at any point, in which case the compilation
+    // runs after all and overwrites whatever was restored.
+    LPWSTR next;
+    auto exitCode = static_cast<int>(wcstol(result.c_str(), &next, 10));
+    auto utf8Output = wcstol(next, &next, 10) != 0;
+    while (true)
+    {
+        auto start = next;
+        auto index = wcstol(start, &next, 10);
+        if (next == start)
+        {
+            break;
+        }
+
+        if (index < 0 || static_cast<size_t>(index) >= outputs.size())
+        {
+            return false;
+        }
+
+        // Restored outputs are as new as freshly compiled ones would be,
+        // so that incremental builds see them as up to date.
+        auto& output = outputs[index];
+        if (!CopyFileW((entry + to_wstring(index)).c_str(), output.c_str(), FALSE)
+            || !TouchFile(output))
+        {
+            return false;
+        }
+    }
+
+    // The entry's result file records when it was last used.
+    TouchFile(entry + RESULTFILENAME);
+
+    response = CompletedResponse(exitCode, utf8Output, move(stdOut), move(stdErr));
+    LogFormatted(IDS_ResultCacheHit, key.c_str());
+    return true;
+}
+
+void ResultCache::Store(
+    _In_ const CompilationKey& compilationKey,
+    _In_ const CompletedResponse& response)
+{
+    if (!IsEnabled() || response.ExitCode != 0)
+    {
+        return;
+    }
+
+    auto& key = compilationKey.key;
+    auto& outputs = compilationKey.outputs;
+    auto entry = directory + key;
+    auto temporary = entry + L'.' + to_wstring(GetCurrentProcessId()) + L".tmp";
+    if ((!CreateDirectoryW(directory.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        || !CreateDirectoryW(temporary.c_str(), nullptr))
+    {
+        LogWin32Error(IDS_ResultCacheStoreFailed);
+        return;
+    }
+
+    // Only outputs this compilation wrote belong in the entry. It needs at
+    // least the assembly.
+    auto result = to_wstring(response.ExitCode) + L' ' + (response.Utf8Output ? L'1' : L'0');
+    auto stored = true;
+    for (size_t index = 0; index < outputs.size() && stored; index++)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (GetFileAttributesExW(outputs[index].c_str(), GetFileExInfoStandard, &attributes)
+            && ToFileTime(attributes.ftLastWriteTime) >= compilationKey.startTime)
+        {
+            stored = CopyFileW(outputs[index].c_str(), (temporary + L'\\' + to_wstring(index)).c_str(), FALSE) != FALSE;
+            result += L' ' + to_wstring(index);
+        }
+        else if (index == 0)
+        {
+            stored = false;
+        }
+    }
+
+    stored = stored
+        && WriteUnicodeFile(temporary + L'\\' + STDOUTFILENAME, response.Output)
+        && WriteUnicodeFile(temporary + L'\\' + STDERRFILENAME, response.ErrorOutput)
+        && WriteUnicodeFile(temporary + L'\\' + RESULTFILENAME, result);
+
+    // If another client stored the same compilation first, keep its entry.
+    if (!stored || !MoveFileExW(temporary.c_str(), entry.c_str(), 0))
+    {
+        RemoveEntryDirectory(temporary + L'\\');
+        return;
+    }
+
+    LogFormatted(IDS_ResultCacheStored, key.c_str());
+    Evict();
+}
+
+void ResultCache::Evict()
+{
+    ULONGLONG limit = DefaultResultCacheMegabytes;
+    wstring value;
+    if (GetEnvVar(RESULTCACHESIZE_ENV_VAR, value) && wcstoull(value.c_str(), nullptr, 10) != 0)
+    {
+        limit = wcstoull(value.c_str(), nullptr, 10);
+    }
+    limit *= 1024 * 1024;
+
+    struct Entry
+    {
+        wstring name;
+        ULONGLONG lastUsed;
+        ULONGLONG size;
+    };
+    vector<Entry> entries;
+    ULONGLONG total = 0;
+    auto now = GetCurrentFileTime();
+
+    WIN32_FIND_DATAW findData;
+    auto findHandle = FindFirstFileW((directory + L"*").c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    do
+    {
+        wstring name(findData.cFileName);
+        if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || name == L"." || name == L"..")
+        {
+            continue;
+        }
+
+        if (name.find(L'.') != wstring::npos)
+        {
+            if (now - ToFileTime(findData.ftLastWriteTime) > AbandonedEntryMs * FileTimeUnitsPerMs)
+            {
+                RemoveEntryDirectory(directory + name + L'\\');
+            }
+            continue;
+        }
+
+        Entry entry = { name, 0, 0 };
+        WIN32_FIND_DATAW fileData;
+        auto fileHandle = FindFirstFileW((directory + name + L"\\*").c_str(), &fileData);
+        if (fileHandle != INVALID_HANDLE_VALUE)
+        {
+            do
+            {
+                entry.size += (static_cast<ULONGLONG>(fileData.nFileSizeHigh) << 32) | fileData.nFileSizeLow;
+                if (_wcsicmp(fileData.cFileName, RESULTFILENAME) == 0)
+                {
+                    entry.lastUsed = ToFileTime(fileData.ftLastWriteTime);
+                }
+            } while (FindNextFileW(fileHandle, &fileData));
+            FindClose(fileHandle);
+        }
+
+        total += entry.size;
+        entries.push_back(move(entry));
+    } while (FindNextFileW(findHandle, &findData));
+    FindClose(findHandle);
+
+    if (total <= limit)
+    {
+        return;
+    }
+
+    sort(entries.begin(), entries.end(), [](const Entry& left, const Entry& right)
+    {
+        return left.lastUsed < right.lastUsed;
+    });
+
+    for (auto& entry : entries)
+    {
+        if (total <= limit)
+        {
+            break;
+        }
+
+        // Take the entry out of the cache in one step, so that clients see
+        // it either whole or not at all, before deleting its files.
+        auto evicted = directory + entry.name + L'.' + to_wstring(GetCurrentProcessId()) + L".del";
+        if (MoveFileExW((directory + entry.name).c_str(), evicted.c_str(), 0))
+        {
+            RemoveEntryDirectory(evicted + L'\\');
+            total -= entry.size;
+        }
+    }
+
+    LogFormatted(IDS_ResultCacheEvicted, static_cast<int>(total / (1024 * 1024)));
+}
@@ -0,0 +1,51 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <string>
+#include "compilation_key.h"
+#include "protocol.h"
+
+using namespace std;
+
+// Many CI compilations repeat an earlier one exactly: the same arguments,
+// sources and references. When the result cache is enabled, the client
+// keeps the outputs, output text and exit code of successful compilations
+// in a local directory, keyed by the compilation's key, and replays a
+// cached result instead of contacting a server.
+//
+// Each entry is a directory named by its key. It is put together under a
+// temporary name and renamed into place, so it is either complete or
+// absent. When the cache grows past its size limit the entries used least
+// recently are evicted.
+
+// Set this environment variable to a directory to cache compilation
+// results in.
+const wchar_t * const RESULTCACHE_ENV_VAR = L"RoslynCommandLineResultCache";
+
+// Set this environment variable to the most megabytes the cache may hold.
+const wchar_t * const RESULTCACHESIZE_ENV_VAR = L"RoslynCommandLineResultCacheSize";
+
+class ResultCache
+{
+private:
+    wstring directory;
+
+    void Evict();
+
+public:
+    ResultCache();
+
+    bool IsEnabled();
+
+    // Restore the outputs of an identical earlier compilation and get the
+    // response it produced. Returns false if there is none.
+    bool TryRestore(
+        _In_ const CompilationKey& compilationKey,
+        _Out_ CompletedResponse& response);
+
+    // Add the result of the compilation, which must have succeeded.
+    void Store(
+        _In_ const CompilationKey& compilationKey,
+        _In_ const CompletedResponse& response);
+};
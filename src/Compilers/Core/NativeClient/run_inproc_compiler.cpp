@@ -1,17 +1,121 @@
 #include "stdafx.h"
+#include <algorithm>
+#include <sddl.h>
 #include "logging.h"
 #include "protocol.h"
+#include "run_inproc_compiler.h"
 #include "UIStrings.h"
 #include "smart_resources.h"
 #include <sstream>
+#include <thread>
 
-void ReadOutput(_In_ HANDLE outHandle, _Out_ vector<BYTE>& output);
+void ReadOutput(_In_ HANDLE outHandle, _Inout_ OutputSink& output);
+
+void GetCurrentUserAndElevation(
+    _Out_ unique_ptr<TOKEN_USER>& userInfo,
+    _Out_ unique_ptr<TOKEN_ELEVATION>& elevationInfo);
+
+// Roughly the memory a cold compiler process needs.
+const DWORDLONG FallbackCompilerMemory = 512 * 1024 * 1024;
+
+wstring GetFallbackSlotsName(_In_ const wstring& compilerPath)
+{
+    unique_ptr<TOKEN_USER> userInfo;
+    unique_ptr<TOKEN_ELEVATION> elevationInfo;
+    GetCurrentUserAndElevation(userInfo, elevationInfo);
+
+    // The global namespace makes the limit machine-wide rather than per
+    // session. Only the current user's clients share it.
+    wstring name(L"Global\\");
+    name += compilerPath;
+    replace(name.begin() + 7, name.end(), L'\\', L'/');
+    name += L"/fallback/";
+
+    LPWSTR sidString;
+    if (ConvertSidToStringSidW(userInfo->User.Sid, &sidString))
+    {
+        name += sidString;
+        LocalFree(sidString);
+    }
+    return name;
+}
+
+LONG GetFallbackSlotCount()
+{
+    wstring value;
+    if (GetEnvVar(MAXFALLBACKS_ENV_VAR, value))
+    {
+        auto count = wcstol(value.c_str(), nullptr, 10);
+        if (count > 0)
+        {
+            return count;
+        }
+    }
+
+    // One per processor, as long as the machine has memory for them all.
+    // Every client waits on the slots it counts, so only what is the same
+    // for all of them, rather than the memory free right now, is used.
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    LONG count = systemInfo.dwNumberOfProcessors;
+
+    MEMORYSTATUSEX memoryStatus = {};
+    memoryStatus.dwLength = sizeof(memoryStatus);
+    if (GlobalMemoryStatusEx(&memoryStatus))
+    {
+        auto fit = memoryStatus.ullTotalPhys / FallbackCompilerMemory;
+        if (fit < (DWORDLONG)count)
+        {
+            count = (LONG)fit;
+        }
+    }
+
+    return max<LONG>(count, 1);
+}
+
+OutputSink::OutputSink()
+    : stream(nullptr), keepCopy(true), empty(true)
+{
+}
+
+OutputSink::OutputSink(_In_ FILE * stream, bool keepCopy)
+    : stream(stream), keepCopy(keepCopy), empty(true)
+{
+}
+
+void OutputSink::Write(_In_reads_(size) const BYTE * data, DWORD size)
+{
+    empty = empty && size == 0;
+
+    if (keepCopy)
+    {
+        buffer.insert(buffer.end(), data, data + size);
+    }
+
+    if (stream != nullptr)
+    {
+        fwrite(data, sizeof(BYTE), size, stream);
+        fflush(stream);
+    }
+}
+
+bool OutputSink::IsEmpty() const
+{
+    return empty;
+}
+
+void OutputSink::TakeBuffer(_Out_ vector<BYTE>& output)
+{
+    output = move(buffer);
+    buffer.clear();
+}
 
 int RunInProcCompiler(
     _In_ const wstring& processPath,
     _In_ const list<wstring> args,
-    _Out_ vector<BYTE>& stdOut,
-    _Out_ vector<BYTE>& stdErr)
+    _Inout_ OutputSink& stdOut,
+    _Inout_ OutputSink& stdErr,
+    _In_opt_ HANDLE cancelEvent)
 {
     SECURITY_ATTRIBUTES attr;
     attr.nLength = sizeof(SECURITY_ATTRIBUTES);
@@ -106,14 +210,40 @@ int RunInProcCompiler(
 
     if (success)
     {
-        // Read stdout and stderr from the process
+        // Terminating the process closes its end of the pipes, which
+        // ends the reads below.
+        thread cancelWatcher;
+        if (cancelEvent != nullptr)
+        {
+            cancelWatcher = thread([&]()
+            {
+                HANDLE handles[] = { cancelEvent, procInfo.hProcess };
+                if (WaitForMultipleObjects(_countof(handles), handles, FALSE, INFINITE) == WAIT_OBJECT_0)
+                {
+                    TerminateProcess(procInfo.hProcess, 1);
+                }
+            });
+        }
+
+        // Read stdout and stderr from the process. Both have to be drained
+        // at the same time, or a child which fills the pipe of the one not
+        // being read blocks forever.
+        thread stdErrReader([&]()
+        {
+            ReadOutput(stdErrRead, stdErr);
+        });
         ReadOutput(stdOutRead, stdOut);
-        ReadOutput(stdErrRead, stdErr);
+        stdErrReader.join();
 
         // Wait for the process to exit and return the exit code
         LogFormatted(IDS_CreatedProcess, procInfo.dwProcessId);
         WaitForSingleObject(procInfo.hProcess, INFINITE);
 
+        if (cancelWatcher.joinable())
+        {
+            cancelWatcher.join();
+        }
+
         DWORD exitCode = -1;
         GetExitCodeProcess(procInfo.hProcess, &exitCode);
 
@@ -139,19 +269,18 @@ int RunInProcCompiler(
 
 void ReadOutput(
     _In_ HANDLE handle,
-    _Out_ vector<BYTE>& output)
+    _Inout_ OutputSink& output)
 {
     DWORD read;
     const int bufSize = 4096;
     BYTE buf[bufSize];
     BOOL success = false;
-    output.clear();
 
     for (;;)
     {
         success = ReadFile(handle, buf, bufSize, &read, nullptr);
         if (!success || !read)
             break;
-        output.insert(output.end(), buf, buf + read);
+        output.Write(buf, read);
     }
 }
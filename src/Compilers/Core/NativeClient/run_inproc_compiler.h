@@ -0,0 +1,64 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <cstdio>
+#include <list>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// When no server is available every client compiles with the fallback
+// compiler, and a parallel build can start dozens of them at once. A set
+// of named slots, one per compiler and user, limits how many run at the
+// same time on the machine.
+
+// Set this environment variable to the number of fallback compilers which
+// may run at once. By default this depends on the processors and the
+// physical memory of the machine, so every client arrives at the same
+// count. Clients which disagree share the slots they have in common.
+const wchar_t * const MAXFALLBACKS_ENV_VAR = L"RoslynCommandLineMaxFallbackCompilers";
+
+// Get the name of the slots limiting the fallback compilers the
+// current user runs with the given compiler.
+wstring GetFallbackSlotsName(_In_ const wstring& compilerPath);
+
+// Get the number of fallback compilers which may run at once.
+LONG GetFallbackSlotCount();
+
+// Where one of the fallback compiler's output streams goes. Output is
+// either written straight to a stream as it arrives, or kept in a buffer
+// when it may have to be thrown away. Output written to a stream may be
+// kept in the buffer as well, to be handed on once it is complete.
+class OutputSink
+{
+private:
+    FILE * stream;
+    vector<BYTE> buffer;
+    bool keepCopy;
+    bool empty;
+
+public:
+    // Buffer the output.
+    OutputSink();
+    // Write the output to the given stream as it arrives, and keep a copy
+    // in the buffer if asked to.
+    explicit OutputSink(_In_ FILE * stream, bool keepCopy = false);
+
+    void Write(_In_reads_(size) const BYTE * data, DWORD size);
+    // Whether the compiler wrote anything at all.
+    bool IsEmpty() const;
+    // Take the buffered output, if any.
+    void TakeBuffer(_Out_ vector<BYTE>& output);
+};
+
+// Run the compiler executable, sending its output to the given sinks. If
+// a cancel event is given, the compiler is terminated as soon as the event
+// is signaled.
+int RunInProcCompiler(
+    _In_ const wstring& processPath,
+    _In_ const list<wstring> args,
+    _Inout_ OutputSink& stdOut,
+    _Inout_ OutputSink& stdErr,
+    _In_opt_ HANDLE cancelEvent);
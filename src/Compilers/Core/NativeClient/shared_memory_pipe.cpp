@@ -0,0 +1,163 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include "protocol.h"
+#include "shared_memory_pipe.h"
+
+using namespace std;
+
+// The section starts with the two waiting flags and the head and tail of
+// each ring, on cache lines of their own, followed by the request ring and
+// the response ring. The heads and tails count the bytes ever written and
+// read, and wrap. The server lays the section out the same way.
+const unsigned CounterSize = 64;
+const unsigned ClientWaitingOffset = 0;
+const unsigned ServerWaitingOffset = CounterSize;
+const unsigned RequestHeadOffset = 2 * CounterSize;
+const unsigned RequestTailOffset = 3 * CounterSize;
+const unsigned ResponseHeadOffset = 4 * CounterSize;
+const unsigned ResponseTailOffset = 5 * CounterSize;
+const unsigned HeaderSize = 6 * CounterSize;
+const unsigned RingSize = 256 * 1024;
+const unsigned SectionSize = HeaderSize + 2 * RingSize;
+
+volatile LONG * RingCounter(BYTE * view, unsigned offset)
+{
+    return reinterpret_cast<volatile LONG *>(view + offset);
+}
+
+// The interlocked functions are full barriers, so a counter read this way
+// is never older than any write the other side made before it.
+LONG ReadRingCounter(BYTE * view, unsigned offset)
+{
+    return InterlockedCompareExchange(RingCounter(view, offset), 0, 0);
+}
+
+SharedMemoryPipe::SharedMemoryPipe(HANDLE pipeHandle)
+    : pipeHandle(pipeHandle),
+      section(nullptr),
+      view(nullptr)
+{
+}
+
+SharedMemoryPipe::~SharedMemoryPipe()
+{
+    if (view != nullptr)
+    {
+        UnmapViewOfFile(view);
+    }
+}
+
+bool SharedMemoryPipe::Connect()
+{
+    // A section backed by the paging file starts out zeroed, which is an
+    // empty pair of rings with nobody waiting.
+    section.reset(CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, SectionSize, nullptr));
+    if (section == nullptr)
+    {
+        return false;
+    }
+
+    view = static_cast<BYTE *>(MapViewOfFile(section.get(), FILE_MAP_WRITE, 0, 0, SectionSize));
+    if (view == nullptr)
+    {
+        return false;
+    }
+
+    // The server duplicates the section out of this process once it has
+    // checked who we are, so our handle stays open as long as the pipe.
+    RealPipe wrapper(pipeHandle);
+    return WriteSharedMemoryTransportRequest(wrapper, reinterpret_cast<ULONG_PTR>(section.get()));
+}
+
+bool SharedMemoryPipe::Write(_In_ LPCVOID data, unsigned size)
+{
+    auto bytes = static_cast<const BYTE *>(data);
+    auto ring = view + HeaderSize;
+    while (size > 0)
+    {
+        auto head = static_cast<ULONG>(ReadRingCounter(view, RequestHeadOffset));
+        auto free = RingSize - (head - static_cast<ULONG>(ReadRingCounter(view, RequestTailOffset)));
+        if (free == 0)
+        {
+            // A pipe whose server went away can't be peeked.
+            if (!PeekNamedPipe(pipeHandle, nullptr, 0, nullptr, nullptr, nullptr))
+            {
+                return false;
+            }
+            Sleep(1);
+            continue;
+        }
+
+        auto length = min<ULONG>(size, free);
+        auto index = head & (RingSize - 1);
+        auto first = min<ULONG>(length, RingSize - index);
+        memcpy(ring + index, bytes, first);
+        memcpy(ring, bytes + first, length - first);
+        InterlockedExchange(RingCounter(view, RequestHeadOffset), static_cast<LONG>(head + length));
+
+        if (InterlockedExchange(RingCounter(view, ServerWaitingOffset), 0) == 1)
+        {
+            BYTE doorbell = 1;
+            RealPipe wrapper(pipeHandle);
+            if (!wrapper.Write(&doorbell, sizeof(doorbell)))
+            {
+                return false;
+            }
+        }
+
+        bytes += length;
+        size -= length;
+    }
+
+    return true;
+}
+
+bool SharedMemoryPipe::WaitForResponse()
+{
+    // Either the server sees the flag after it adds data and rings, or the
+    // data is seen here. If the server took the flag down in between it
+    // has rung anyway, and the doorbell must be read.
+    InterlockedExchange(RingCounter(view, ClientWaitingOffset), 1);
+    if (ReadRingCounter(view, ResponseHeadOffset) != ReadRingCounter(view, ResponseTailOffset)
+        && InterlockedExchange(RingCounter(view, ClientWaitingOffset), 0) == 1)
+    {
+        return true;
+    }
+
+    BYTE doorbell;
+    RealPipe wrapper(pipeHandle);
+    return wrapper.Read(&doorbell, sizeof(doorbell));
+}
+
+#pragma warning(suppress: 6101)
+bool SharedMemoryPipe::Read(_Out_ LPVOID data, unsigned size)
+{
+    auto bytes = static_cast<BYTE *>(data);
+    auto ring = view + HeaderSize + RingSize;
+    while (size > 0)
+    {
+        auto tail = static_cast<ULONG>(ReadRingCounter(view, ResponseTailOffset));
+        auto available = static_cast<ULONG>(ReadRingCounter(view, ResponseHeadOffset)) - tail;
+        if (available == 0)
+        {
+            if (!WaitForResponse())
+            {
+                return false;
+            }
+            continue;
+        }
+
+        auto length = min<ULONG>(size, available);
+        auto index = tail & (RingSize - 1);
+        auto first = min<ULONG>(length, RingSize - index);
+        memcpy(bytes, ring + index, first);
+        memcpy(bytes + first, ring, length - first);
+        InterlockedExchange(RingCounter(view, ResponseTailOffset), static_cast<LONG>(tail + length));
+
+        bytes += length;
+        size -= length;
+    }
+
+    return true;
+}
@@ -0,0 +1,47 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include "pipe_utils.h"
+#include "smart_resources.h"
+
+// Every read and write on the pipe is a round trip through the kernel. With
+// the shared memory transport the client instead creates a section holding
+// two single producer, single consumer rings, one for its requests and one
+// for the response, and before its first request sends the server its
+// handle to the section. The server checks that the client runs as the same
+// user before duplicating the section out of the client process.
+//
+// The pipe stays open and carries only doorbells. A side which finds the
+// ring it reads empty sets its waiting flag and reads a byte from the pipe,
+// which the other side writes once it has added data and found the flag
+// set. A side which finds the ring it writes full polls instead, so
+// doorbells only travel towards the reader. The cancel frame and
+// disconnects still go through the pipe, and a read blocked on a doorbell
+// can be cancelled like any other read from the pipe.
+
+// Set this environment variable to 1 to exchange requests and responses
+// through shared memory with servers which support it.
+const wchar_t * const SHAREDMEMORYTRANSPORT_ENV_VAR = L"RoslynCommandLineSharedMemoryTransport";
+
+class SharedMemoryPipe : public IPipe
+{
+private:
+    HANDLE pipeHandle;
+    SmartHandle section;
+    BYTE * view;
+
+    bool WaitForResponse();
+
+public:
+    SharedMemoryPipe(HANDLE pipeHandle);
+    ~SharedMemoryPipe();
+
+    // Create the rings and tell the server through the pipe where to find
+    // them. Returns false if the transport couldn't be set up, in which case
+    // nothing was written to the pipe.
+    bool Connect();
+
+    virtual bool Write(_In_ LPCVOID data, unsigned size);
+    virtual bool Read(_Out_ LPVOID data, unsigned size);
+};
@@ -92,6 +92,47 @@ bool SmartMutex::Wait(const int waitTime)
     return this->holdsMutex;
 }
 
+// Wait until either the mutex is acquired or the event is signaled. If the
+// mutex is acquired the event is not considered signaled, even if it is.
+bool SmartMutex::WaitOrEvent(HANDLE eventHandle, const int waitTime, _Out_ bool& eventSignaled)
+{
+    eventSignaled = false;
+    if (eventHandle == nullptr)
+    {
+        return Wait(waitTime);
+    }
+
+    Log(IDS_WaitingForMutex);
+    HANDLE handles[] = { this->handle, eventHandle };
+    auto waitResult = WaitForMultipleObjects(_countof(handles), handles, FALSE, waitTime);
+    this->holdsMutex = false;
+    switch (waitResult)
+    {
+    case WAIT_ABANDONED_0:
+        Log(IDS_AcquiredAbandonedMutex);
+        this->holdsMutex = true;
+        break;
+    case WAIT_OBJECT_0:
+        Log(IDS_AcquiredMutex);
+        this->holdsMutex = true;
+        break;
+    case WAIT_OBJECT_0 + 1:
+        Log(IDS_ServerReadySignaled);
+        eventSignaled = true;
+        break;
+    case WAIT_TIMEOUT:
+        Log(IDS_WaitingMutexTimeout);
+        break;
+    case WAIT_FAILED:
+        LogWin32Error(IDS_WaitingMutexFailed);
+        break;
+    default:
+        LogFormatted(IDS_WaitingMutexUnknownFailure, waitResult);
+        break;
+    }
+    return this->holdsMutex;
+}
+
 HANDLE SmartMutex::get()
 {
     return handle;
@@ -120,3 +161,96 @@ SmartMutex::~SmartMutex()
         CloseHandle(handle);
     }
 }
+
+SmartSlot::SmartSlot(_In_z_ LPCWSTR slotsName, LONG slotCount)
+    : heldSlot(nullptr)
+{
+    if (slotCount > MAXIMUM_WAIT_OBJECTS - 1)
+    {
+        slotCount = MAXIMUM_WAIT_OBJECTS - 1;
+    }
+
+    for (LONG i = 0; i < slotCount; i++)
+    {
+        auto slotName = std::wstring(slotsName) + L"/" + std::to_wstring(i);
+        auto handle = CreateMutexW(nullptr, FALSE, slotName.c_str());
+
+        // As with the server creation mutex, all we can do without the
+        // slots is log the error and continue without a limit.
+        if (handle == nullptr)
+        {
+            LogWin32Error(IDS_CreateFallbackSlotsFailed);
+            for (auto slot : this->handles)
+            {
+                CloseHandle(slot);
+            }
+            this->handles.clear();
+            return;
+        }
+
+        this->handles.push_back(handle);
+    }
+}
+
+bool SmartSlot::WaitOrEvent(HANDLE eventHandle, const int waitTime, _Out_ bool& eventSignaled)
+{
+    eventSignaled = false;
+    if (this->handles.empty())
+    {
+        return true;
+    }
+
+    Log(IDS_WaitingForFallbackSlot);
+    auto slotCount = static_cast<DWORD>(this->handles.size());
+    auto waitHandles = this->handles;
+    if (eventHandle != nullptr)
+    {
+        waitHandles.push_back(eventHandle);
+    }
+
+    auto waitResult = WaitForMultipleObjects(static_cast<DWORD>(waitHandles.size()), waitHandles.data(), FALSE, waitTime);
+    if (waitResult - WAIT_OBJECT_0 < slotCount)
+    {
+        Log(IDS_AcquiredFallbackSlot);
+        this->heldSlot = this->handles[waitResult - WAIT_OBJECT_0];
+    }
+    else if (waitResult - WAIT_ABANDONED_0 < slotCount)
+    {
+        Log(IDS_AcquiredAbandonedFallbackSlot);
+        this->heldSlot = this->handles[waitResult - WAIT_ABANDONED_0];
+    }
+    else if (waitResult == WAIT_OBJECT_0 + slotCount)
+    {
+        Log(IDS_ServerReadySignaled);
+        eventSignaled = true;
+    }
+    else if (waitResult == WAIT_TIMEOUT)
+    {
+        Log(IDS_WaitingFallbackSlotTimeout);
+    }
+    else
+    {
+        // Don't let broken slots stop the compilation.
+        LogWin32Error(IDS_WaitingFallbackSlotFailed);
+        return true;
+    }
+    return this->heldSlot != nullptr;
+}
+
+void SmartSlot::release()
+{
+    if (heldSlot != nullptr)
+    {
+        ReleaseMutex(heldSlot);
+        heldSlot = nullptr;
+    }
+}
+
+SmartSlot::~SmartSlot()
+{
+    release();
+    for (auto slot : handles)
+    {
+        CloseHandle(slot);
+    }
+}
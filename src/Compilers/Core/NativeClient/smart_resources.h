@@ -28,7 +28,30 @@ public:
     SmartMutex(_In_z_ LPCWSTR mutexName);
     bool HoldsMutex();
     bool Wait(const int waitTime);
+    bool WaitOrEvent(HANDLE eventHandle, const int waitTime, _Out_ bool& eventSignaled);
     HANDLE get();
     void release();
     ~SmartMutex();
 };
+
+// One of a fixed number of slots, released when this goes away. Each slot
+// is a named mutex rather than a count in a semaphore, so a slot held by
+// a process which exits without releasing it is abandoned and free again.
+// The slot must be released on the thread which took it.
+class SmartSlot
+{
+private:
+    std::vector<HANDLE> handles;
+    HANDLE heldSlot;
+
+public:
+    // Open the slots, creating them if they don't exist yet. There are at
+    // most MAXIMUM_WAIT_OBJECTS - 1 so that they can be waited on together
+    // with an event.
+    SmartSlot(_In_z_ LPCWSTR slotsName, LONG slotCount);
+    // Wait until either a slot is free or the event is signaled. Without
+    // the slots there is no limit, and a slot is always free.
+    bool WaitOrEvent(HANDLE eventHandle, const int waitTime, _Out_ bool& eventSignaled);
+    void release();
+    ~SmartSlot();
+};
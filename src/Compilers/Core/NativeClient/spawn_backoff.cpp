@@ -0,0 +1,98 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <vector>
+#include "client_state.h"
+#include "logging.h"
+#include "spawn_backoff.h"
+#include "UIStrings.h"
+
+using namespace std;
+
+// The name of the spawn failure record in the client state directory. It
+// holds the number of consecutive failures and the time, in UTC file time
+// units, before which no client should start a server.
+const wchar_t * const SPAWNFILENAME = L"spawn";
+
+// How long to hold off after the first failure. Each further failure
+// doubles it, up to the maximum.
+const ULONGLONG InitialBackoffMs = 5000;
+const ULONGLONG MaxBackoffMs = 10 * 60 * 1000;
+
+bool IsServerSpawnBackedOff(
+    _In_ const wstring& stateDirectory,
+    _Out_ DWORD& remainingMs)
+{
+    remainingMs = 0;
+    if (stateDirectory.empty())
+    {
+        return false;
+    }
+
+    LockedStateFile file(stateDirectory + SPAWNFILENAME);
+    vector<wstring> lines;
+    if (!file.ReadLines(lines) || lines.size() < 2)
+    {
+        return false;
+    }
+
+    auto retryAfter = _wcstoui64(lines[1].c_str(), nullptr, 10);
+    auto now = GetCurrentFileTime();
+    if (retryAfter <= now)
+    {
+        return false;
+    }
+
+    // Don't trust a window longer than the maximum, in case the clock
+    // was moved back.
+    auto remaining = min((retryAfter - now) / FileTimeUnitsPerMs, MaxBackoffMs);
+    remainingMs = (DWORD)remaining;
+    return remainingMs != 0;
+}
+
+void RecordServerSpawnFailure(_In_ const wstring& stateDirectory)
+{
+    if (stateDirectory.empty())
+    {
+        return;
+    }
+
+    LockedStateFile file(stateDirectory + SPAWNFILENAME);
+    vector<wstring> lines;
+    if (!file.ReadLines(lines))
+    {
+        return;
+    }
+
+    auto failures = lines.empty() ? 0 : wcstoul(lines[0].c_str(), nullptr, 10);
+    failures++;
+
+    auto backoffMs = MaxBackoffMs;
+    if (failures <= 16)
+    {
+        backoffMs = min(InitialBackoffMs << (failures - 1), MaxBackoffMs);
+    }
+    LogFormatted(IDS_ServerSpawnFailed, failures, (DWORD)backoffMs);
+
+    lines.assign(
+    {
+        to_wstring(failures),
+        to_wstring(GetCurrentFileTime() + backoffMs * FileTimeUnitsPerMs),
+    });
+    file.WriteLines(lines);
+}
+
+void RecordServerSpawnSuccess(_In_ const wstring& stateDirectory)
+{
+    if (stateDirectory.empty())
+    {
+        return;
+    }
+
+    LockedStateFile file(stateDirectory + SPAWNFILENAME);
+    vector<wstring> lines;
+    if (file.ReadLines(lines) && !lines.empty())
+    {
+        lines.clear();
+        file.WriteLines(lines);
+    }
+}
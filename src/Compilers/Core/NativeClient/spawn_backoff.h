@@ -0,0 +1,25 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <string>
+
+using namespace std;
+
+// A server which crashes on startup would otherwise cost every client in a
+// build the full wait for a new server before it falls back. Clients share
+// a record of consecutive failures to start a server, and after a failure
+// none of them start another until an exponentially growing window has
+// passed. Clients go straight to the fallback compiler in the meantime.
+
+// Check whether starting a server is currently being held off because of
+// recent failures, and if so for how much longer.
+bool IsServerSpawnBackedOff(
+    _In_ const wstring& stateDirectory,
+    _Out_ DWORD& remainingMs);
+
+// Remember that a new server failed to start, extending the window.
+void RecordServerSpawnFailure(_In_ const wstring& stateDirectory);
+
+// Remember that a new server started, ending any window.
+void RecordServerSpawnSuccess(_In_ const wstring& stateDirectory);
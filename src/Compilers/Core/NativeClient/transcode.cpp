@@ -0,0 +1,185 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include "transcode.h"
+
+// SSE2 is always there on x64, and the compiler targets it on x86 unless
+// told otherwise.
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRANSCODE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Narrow the ASCII characters at the start of the text. Returns how many
+// there were.
+size_t NarrowAscii(
+    _In_reads_(count) const wchar_t * chars,
+    size_t count,
+    _Out_writes_(count) char * buffer)
+{
+    size_t i = 0;
+
+#ifdef TRANSCODE_SSE2
+    // Sixteen characters at a time: if none has a bit above the low seven
+    // set, pack them into bytes.
+    const auto nonAsciiBits = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const auto zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16)
+    {
+        auto low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chars + i));
+        auto high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(chars + i + 8));
+        auto nonAscii = _mm_and_si128(_mm_or_si128(low, high), nonAsciiBits);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(nonAscii, zero)) != 0xFFFF)
+        {
+            break;
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(buffer + i), _mm_packus_epi16(low, high));
+    }
+#endif
+
+    for (; i < count && chars[i] < 0x80; i++)
+    {
+        buffer[i] = static_cast<char>(chars[i]);
+    }
+
+    return i;
+}
+
+// Encode the non-ASCII character at the given position, or the surrogate
+// pair starting there, in UTF-8 and move past it. Like WideCharToMultiByte,
+// a surrogate without its other half becomes U+FFFD. Returns the number of
+// bytes written.
+int EncodeUtf8(
+    _In_reads_(count) const wchar_t * chars,
+    size_t count,
+    _Inout_ size_t& position,
+    _Out_writes_(4) char * buffer)
+{
+    auto bytes = reinterpret_cast<unsigned char *>(buffer);
+    unsigned codePoint = chars[position++];
+    if (codePoint < 0x800)
+    {
+        bytes[0] = static_cast<unsigned char>(0xC0 | (codePoint >> 6));
+        bytes[1] = static_cast<unsigned char>(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+
+    if (IS_HIGH_SURROGATE(codePoint) && position < count && IS_LOW_SURROGATE(chars[position]))
+    {
+        codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (chars[position++] - 0xDC00);
+        bytes[0] = static_cast<unsigned char>(0xF0 | (codePoint >> 18));
+        bytes[1] = static_cast<unsigned char>(0x80 | ((codePoint >> 12) & 0x3F));
+        bytes[2] = static_cast<unsigned char>(0x80 | ((codePoint >> 6) & 0x3F));
+        bytes[3] = static_cast<unsigned char>(0x80 | (codePoint & 0x3F));
+        return 4;
+    }
+
+    if (IS_HIGH_SURROGATE(codePoint) || IS_LOW_SURROGATE(codePoint))
+    {
+        codePoint = 0xFFFD;
+    }
+
+    bytes[0] = static_cast<unsigned char>(0xE0 | (codePoint >> 12));
+    bytes[1] = static_cast<unsigned char>(0x80 | ((codePoint >> 6) & 0x3F));
+    bytes[2] = static_cast<unsigned char>(0x80 | (codePoint & 0x3F));
+    return 3;
+}
+
+// Are ASCII characters the same bytes in the code page whatever surrounds
+// them? That rules out EBCDIC, and stateful encodings like ISO-2022 and
+// UTF-7 in which a byte's meaning depends on what came before. UTF-8 is
+// handled separately.
+bool IsAsciiCompatible(UINT codePage)
+{
+    CPINFO info;
+    if (!GetCPInfo(codePage, &info) || info.MaxCharSize > 2)
+    {
+        return false;
+    }
+
+    wchar_t ascii[0x80];
+    for (int i = 0; i < 0x80; i++)
+    {
+        ascii[i] = static_cast<wchar_t>(i);
+    }
+
+    char narrowed[2 * 0x80];
+    if (WideCharToMultiByte(codePage, 0, ascii, 0x80, narrowed, sizeof(narrowed), nullptr, nullptr) != 0x80)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < 0x80; i++)
+    {
+        if (narrowed[i] != static_cast<char>(i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int TranscodeOutput(
+    UINT codePage,
+    _In_reads_(count) const wchar_t * chars,
+    int count,
+    _Out_writes_(bufferSize) char * buffer,
+    int bufferSize)
+{
+    // Output goes to one console, so the code page hardly ever changes.
+    static UINT checkedCodePage = CP_UTF8;
+    static bool asciiCompatible = true;
+    if (codePage != checkedCodePage)
+    {
+        asciiCompatible = codePage == CP_UTF8 || IsAsciiCompatible(codePage);
+        checkedCodePage = codePage;
+    }
+
+    if (!asciiCompatible)
+    {
+        return WideCharToMultiByte(codePage, 0, chars, count, buffer, bufferSize, nullptr, nullptr);
+    }
+
+    size_t position = 0;
+    size_t written = 0;
+    auto length = static_cast<size_t>(count);
+    while (position < length)
+    {
+        auto ascii = NarrowAscii(chars + position, length - position, buffer + written);
+        position += ascii;
+        written += ascii;
+        if (position == length)
+        {
+            break;
+        }
+
+        if (codePage == CP_UTF8)
+        {
+            written += EncodeUtf8(chars, length, position, buffer + written);
+        }
+        else
+        {
+            // Characters are converted independently of each other, so the
+            // non-ASCII run can be converted on its own.
+            auto end = position;
+            while (end < length && chars[end] >= 0x80)
+            {
+                end++;
+            }
+
+            written += WideCharToMultiByte(
+                codePage,
+                0,
+                chars + position,
+                static_cast<int>(end - position),
+                buffer + written,
+                bufferSize - static_cast<int>(written),
+                nullptr,
+                nullptr);
+            position = end;
+        }
+    }
+
+    return static_cast<int>(written);
+}
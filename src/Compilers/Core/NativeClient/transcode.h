@@ -0,0 +1,22 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+
+// Compiler output is almost all ASCII: paths, switches and the text of
+// messages. In UTF-8 and in the usual ANSI and OEM code pages ASCII
+// characters are the same bytes whatever surrounds them, so runs of them
+// are narrowed here a vector at a time rather than one character at a time
+// by WideCharToMultiByte. The rest of UTF-8 is encoded here too. Other
+// characters in other code pages, and code pages where ASCII isn't what it
+// seems, are still left to WideCharToMultiByte.
+
+// Convert UTF-16 text to the given code page, with the same result as
+// WideCharToMultiByte without flags. The buffer must have room for four
+// bytes per character. Returns the number of bytes written.
+int TranscodeOutput(
+    UINT codePage,
+    _In_reads_(count) const wchar_t * chars,
+    int count,
+    _Out_writes_(bufferSize) char * buffer,
+    int bufferSize);
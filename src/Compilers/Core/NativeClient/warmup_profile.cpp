@@ -0,0 +1,170 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#include "stdafx.h"
+#include <algorithm>
+#include <vector>
+#include "arguments.h"
+#include "client_state.h"
+#include "warmup_profile.h"
+
+using namespace std;
+
+// The name of the profile in the client state directory.
+const wchar_t * const WARMUPFILENAME = L"warmup";
+
+// Number of references handed to a server. The least used are left out first.
+const size_t MaxProfileReferences = 100;
+
+// Number of references kept past those as candidates, so that one which
+// has only lately come into use can build up a count and displace an
+// older one. The least used are forgotten first.
+const size_t MaxProfileCandidates = 100;
+
+// The kind of a candidate reference. Servers ignore it.
+const wchar_t * const CandidateKind = L"candidate";
+
+// Every record takes 1/ProfileAging of each count away and adds
+// ProfileAging for each use, so that what recent compilations use
+// outweighs what older ones did. An entry every compilation uses settles
+// near ProfileAging * ProfileAging, and one no longer used fades out.
+const unsigned long ProfileAging = 64;
+
+struct ProfileEntry
+{
+    wstring kind;
+    unsigned long count;
+    wstring value;
+};
+
+// Parse a profile line. Returns false if it's malformed.
+bool ParseProfileEntry(_In_ const wstring& line, _Out_ ProfileEntry& entry)
+{
+    auto kindEnd = line.find(L' ');
+    auto countEnd = kindEnd == wstring::npos ? wstring::npos : line.find(L' ', kindEnd + 1);
+    if (countEnd == wstring::npos)
+    {
+        return false;
+    }
+
+    entry.kind = line.substr(0, kindEnd);
+    if (entry.kind == CandidateKind)
+    {
+        entry.kind = L"ref";
+    }
+    entry.count = wcstoul(line.c_str() + kindEnd + 1, nullptr, 10);
+    entry.value = line.substr(countEnd + 1);
+    return entry.count != 0 && !entry.value.empty();
+}
+
+void AddUse(_Inout_ vector<ProfileEntry>& entries, _In_z_ LPCWSTR kind, _In_ const wstring& value)
+{
+    for (auto& entry : entries)
+    {
+        if (entry.kind == kind && entry.value == value)
+        {
+            entry.count += ProfileAging;
+            return;
+        }
+    }
+
+    entries.push_back({ kind, ProfileAging, value });
+}
+
+void RecordWarmupProfile(
+    _In_ const wstring& stateDirectory,
+    RequestLanguage language,
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& currentDirectory)
+{
+    if (stateDirectory.empty())
+    {
+        return;
+    }
+
+    list<wstring> expandedArgs;
+    ExpandResponseFiles(commandLineArgs, currentDirectory, expandedArgs);
+
+    vector<wstring> references;
+    GetReferences(expandedArgs, references);
+
+    LockedStateFile profile(stateDirectory + WARMUPFILENAME);
+    vector<wstring> lines;
+    if (!profile.ReadLines(lines))
+    {
+        return;
+    }
+
+    vector<ProfileEntry> entries;
+    for (auto& line : lines)
+    {
+        ProfileEntry entry;
+        if (ParseProfileEntry(line, entry))
+        {
+            entries.push_back(move(entry));
+        }
+    }
+
+    // Age every entry, and forget those which have faded out.
+    for (auto& entry : entries)
+    {
+        entry.count -= (entry.count + ProfileAging - 1) / ProfileAging;
+    }
+    entries.erase(
+        remove_if(entries.begin(), entries.end(), [](const ProfileEntry& entry) { return entry.count == 0; }),
+        entries.end());
+
+    AddUse(entries, L"lang", language == RequestLanguage::CSHARPCOMPILE ? L"csharp" : L"vb");
+    for (auto& reference : references)
+    {
+        // A bare file name is found by the compiler in the framework or
+        // /lib directories, which the client doesn't know.
+        if (reference.find_first_of(L"\\/") != wstring::npos)
+        {
+            AddUse(entries, L"ref", MakeAbsolutePath(reference, currentDirectory));
+        }
+    }
+
+    stable_sort(entries.begin(), entries.end(), [](const ProfileEntry& left, const ProfileEntry& right)
+    {
+        return left.count > right.count;
+    });
+
+    lines.clear();
+    size_t referenceCount = 0;
+    for (auto& entry : entries)
+    {
+        auto kind = entry.kind;
+        if (kind == L"ref" && ++referenceCount > MaxProfileReferences)
+        {
+            if (referenceCount > MaxProfileReferences + MaxProfileCandidates)
+            {
+                continue;
+            }
+            kind = CandidateKind;
+        }
+        lines.push_back(kind + L" " + to_wstring(entry.count) + L" " + entry.value);
+    }
+
+    profile.WriteLines(lines);
+}
+
+bool GetWarmupProfilePath(
+    _In_ const wstring& stateDirectory,
+    _Out_ wstring& profilePath)
+{
+    profilePath.clear();
+    if (stateDirectory.empty())
+    {
+        return false;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    auto path = stateDirectory + WARMUPFILENAME;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes)
+        || (attributes.nFileSizeLow == 0 && attributes.nFileSizeHigh == 0))
+    {
+        return false;
+    }
+
+    profilePath = move(path);
+    return true;
+}
@@ -0,0 +1,36 @@
+// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+#pragma once
+
+#include <Windows.h>
+#include <list>
+#include <string>
+#include "protocol.h"
+
+using namespace std;
+
+// A new server starts with an empty metadata cache and nothing JIT
+// compiled, so its first compilations are several times slower than later
+// ones. Clients keep a profile of the languages and references the user's
+// compilations use most, and hand it to any server they start so that it
+// can load them before the first request arrives.
+//
+// The profile has a line per entry: its kind ("lang" or "ref"), a count of
+// its uses weighted toward recent compilations and its value, separated by
+// spaces. Entries are ordered most used first. References past those a
+// server should load are kept as "candidate" entries, which it ignores.
+
+// The switch which names the profile on a new server's command line.
+const wchar_t * const WARMUPPROFILESWITCH = L"/warmupprofile:";
+
+// Add a compilation's language and references to the profile.
+void RecordWarmupProfile(
+    _In_ const wstring& stateDirectory,
+    RequestLanguage language,
+    _In_ const list<wstring>& commandLineArgs,
+    _In_ const wstring& currentDirectory);
+
+// Get the path of the profile to hand a new server. Returns false if
+// there is no profile yet.
+bool GetWarmupProfilePath(
+    _In_ const wstring& stateDirectory,
+    _Out_ wstring& profilePath);
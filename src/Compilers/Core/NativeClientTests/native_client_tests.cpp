@@ -7,9 +7,26 @@
 #pragma warning (pop)
 
 #include "pipe_extensions.h"
+#include <algorithm>
 #include <memory>
+#include <random>
 #include <sstream>
+#include <thread>
+#include "adaptive_keepalive.h"
+#include "affinity.h"
+#include "arguments.h"
+#include "build_manifest.h"
+#include "client_state.h"
+#include "coalescing.h"
+#include "compilation_key.h"
+#include "fingerprint.h"
+#include "result_cache.h"
+#include "shared_memory_pipe.h"
+#include "smart_resources.h"
+#include "spawn_backoff.h"
+#include "transcode.h"
 #include "UIStrings.h"
+#include "warmup_profile.h"
 
 namespace Microsoft 
 {
@@ -35,6 +52,12 @@ namespace Microsoft
             {
                 return L"";
             }
+
+            template<>
+            wstring ToString <vector<wstring>>(const vector<wstring>& vec)
+            {
+                return L"";
+            }
         }
     }
 }
@@ -55,8 +78,10 @@ namespace NativeClientTests
                 L"test.cs"
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
 
             Assert::IsTrue(success);
             Assert::IsTrue(keepAlive.empty());
@@ -66,6 +91,7 @@ namespace NativeClientTests
 
             Assert::AreEqual(PROTOCOL_VERSION, request.ProtocolVersion);
             Assert::AreEqual(language, request.Language);
+            request.ProtocolVersion = UTF16_PROTOCOL_VERSION;
 
             vector<Request::Argument> expectedArgs = {
                 Request::Argument(ArgumentId::CURRENTDIRECTORY, 0, L""),
@@ -105,8 +131,10 @@ namespace NativeClientTests
                 L"test.cs"
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
 
             Assert::IsTrue(success);
             Assert::IsTrue(keepAlive.empty());
@@ -116,6 +144,7 @@ namespace NativeClientTests
 
             Assert::AreEqual(PROTOCOL_VERSION, request.ProtocolVersion);
             Assert::AreEqual(language, request.Language);
+            request.ProtocolVersion = UTF16_PROTOCOL_VERSION;
 
             vector<Request::Argument> expectedArgs = {
                 Request::Argument(ArgumentId::CURRENTDIRECTORY, 0, L""),
@@ -156,12 +185,52 @@ namespace NativeClientTests
             Assert::AreEqual(expectedBytes, pipe.Bytes());
         }
 
+        TEST_METHOD(SimpleRequestInUtf8)
+        {
+            auto request = Request(RequestLanguage::CSHARPCOMPILE, L"");
+            request.AddCommandLineArguments({ L"t\u00e9st.cs" });
+
+            vector<byte> expectedBytes = {
+                0x2c, 0x0, 0x0, 0x0, // Size of request
+                0x3, 0x0, 0x0, 0x0,  // Protocol version
+                0x21, 0x25, 0x53, 0x44, // C# compile token
+                0x2, 0x0, 0x0, 0x0, // Number of arguments
+                0x21, 0x72, 0x14, 0x51, // Current directory token
+                0x0, 0x0, 0x0, 0x0, // Index
+                0x0, 0x0, 0x0, 0x0, // Length of value string
+                0x22, 0x72, 0x14, 0x51, // Command line arg token
+                0x0, 0x0, 0x0, 0x0, // Index
+                0x8, 0x0, 0x0, 0x0, // Length of value string in bytes
+                0x74, 0xc3, 0xa9, 0x73, // 't', 'e' with acute, 's'
+                0x74, 0x2e, 0x63, 0x73, // 't', '.', 'c', 's'
+            };
+
+            WriteOnlyMemoryPipe pipe;
+            Assert::IsTrue(request.WriteToPipe(pipe));
+
+            Assert::AreEqual(expectedBytes, pipe.Bytes());
+        }
+
+        TEST_METHOD(UnpairedSurrogateSentInUtf16)
+        {
+            auto request = Request(RequestLanguage::CSHARPCOMPILE, L"");
+            request.AddCommandLineArguments({ L"\xd83d\xde00.cs", L"\xd800.cs" });
+
+            WriteOnlyMemoryPipe pipe;
+            Assert::IsTrue(request.WriteToPipe(pipe));
+
+            Assert::AreEqual(UTF16_PROTOCOL_VERSION, request.ProtocolVersion);
+            Assert::AreEqual((byte)UTF16_PROTOCOL_VERSION, pipe.Bytes()[4]);
+        }
+
         TEST_METHOD(RequestsWithKeepAlive)
         {
             list<wstring> args = { L"/keepalive:10" };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
 
             Assert::IsTrue(success);
             Assert::IsTrue(args.empty());
@@ -179,7 +248,7 @@ namespace NativeClientTests
             Assert::AreEqual(expected, request.Arguments());
 
             args = { L"/keepalive=10" };
-            success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
 
             Assert::IsTrue(success);
             Assert::IsTrue(args.empty());
@@ -195,8 +264,10 @@ namespace NativeClientTests
         {
             list<wstring> args = { L"/keepalive:-1" };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
 
             Assert::IsTrue(success);
             Assert::IsTrue(args.empty());
@@ -209,9 +280,11 @@ namespace NativeClientTests
                 L"/keepalive",
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
 
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
             Assert::IsFalse(success);
             Assert::AreEqual(
                 IDS_MissingKeepAlive,
@@ -224,9 +297,11 @@ namespace NativeClientTests
                 L"/keepalive:",
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
 
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
             Assert::IsFalse(success);
             Assert::AreEqual(
                 IDS_MissingKeepAlive,
@@ -239,9 +314,11 @@ namespace NativeClientTests
                 L"/keepalive",
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
 
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
             Assert::IsFalse(success);
             Assert::AreEqual(
                 IDS_MissingKeepAlive,
@@ -254,9 +331,11 @@ namespace NativeClientTests
                 L"/keepalive:-2",
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
 
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
             Assert::IsFalse(success);
             Assert::AreEqual(
                 IDS_KeepAliveIsTooSmall,
@@ -269,9 +348,11 @@ namespace NativeClientTests
                 L"/keepalive:9999999999",
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
 
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
             Assert::IsFalse(success);
             Assert::AreEqual(
                 IDS_KeepAliveIsOutOfRange,
@@ -284,13 +365,831 @@ namespace NativeClientTests
                 L"/keepalive:string",
             };
             wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
             int errorId;
 
-            auto success = ParseAndValidateClientArguments(args, keepAlive, errorId);
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
             Assert::IsFalse(success);
             Assert::AreEqual(
                 IDS_KeepAliveIsNotAnInteger,
                 errorId);
         }
+
+        TEST_METHOD(ParsePriority)
+        {
+            list<wstring> args = {
+                L"test.cs",
+                L"/priority:Background",
+            };
+            wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
+            int errorId;
+
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
+            Assert::IsTrue(success);
+            Assert::AreEqual(wstring(L"background"), priority);
+
+            Assert::AreEqual((size_t)1, args.size());
+            Assert::AreEqual(wstring(L"test.cs"), args.front());
+        }
+
+        TEST_METHOD(ParseInvalidPriority)
+        {
+            list<wstring> args = {
+                L"/priority=urgent",
+            };
+            wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
+            int errorId;
+
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
+            Assert::IsFalse(success);
+            Assert::AreEqual(
+                IDS_InvalidPriority,
+                errorId);
+        }
+
+        TEST_METHOD(ParseDeadline)
+        {
+            list<wstring> args = {
+                L"/deadline=600",
+                L"test.cs",
+            };
+            wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
+            int errorId;
+
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
+            Assert::IsTrue(success);
+            Assert::AreEqual((DWORD)600, deadline);
+            Assert::AreEqual((size_t)1, args.size());
+            Assert::AreEqual(wstring(L"test.cs"), args.front());
+        }
+
+        TEST_METHOD(ParseInvalidDeadline)
+        {
+            list<wstring> args = {
+                L"/deadline:0",
+            };
+            wstring keepAlive;
+            wstring priority;
+            DWORD deadline;
+            int errorId;
+
+            auto success = ParseAndValidateClientArguments(args, keepAlive, priority, deadline, errorId);
+            Assert::IsFalse(success);
+            Assert::AreEqual(
+                IDS_InvalidDeadline,
+                errorId);
+        }
+
+        TEST_METHOD(CancelRequest)
+        {
+            vector<byte> expectedBytes = {
+                0x4, 0x0, 0x0, 0x0, // Size of frame
+                0x30, 0x25, 0x53, 0x44, // Cancel token
+            };
+
+            WriteOnlyMemoryPipe pipe;
+            Assert::IsTrue(WriteCancelRequest(pipe));
+
+            Assert::AreEqual(expectedBytes, pipe.Bytes());
+        }
+    };
+
+    TEST_CLASS(ResponseTests)
+    {
+    public:
+        TEST_METHOD(ReadBusyResponse)
+        {
+            ReadOnlyMemoryPipe pipe({
+                0xC, 0x0, 0x0, 0x0, // Size of response
+                0x2, 0x0, 0x0, 0x0, // Busy response type
+                0xE8, 0x3, 0x0, 0x0, // Retry after 1000 ms
+                0x5, 0x0, 0x0, 0x0, // Queue depth
+            });
+
+            CompletedResponse response;
+            unique_ptr<BusyResponse> busyResponse;
+            Assert::IsFalse(ReadResponse(pipe, PROTOCOL_VERSION, response, busyResponse));
+            Assert::IsTrue(busyResponse != nullptr);
+            Assert::AreEqual(1000, busyResponse->RetryAfterMs);
+            Assert::AreEqual(5, busyResponse->QueueDepth);
+        }
+
+        TEST_METHOD(ReadUtf8CompletedResponse)
+        {
+            ReadOnlyMemoryPipe pipe({
+                0x14, 0x0, 0x0, 0x0, // Size of response
+                0x1, 0x0, 0x0, 0x0, // Completed response type
+                0x0, 0x0, 0x0, 0x0, // Exit code
+                0x0, // UTF-8 output
+                0x3, 0x0, 0x0, 0x0, // Length of output in bytes
+                0xc3, 0xa9, 0x21, // 'e' with acute, '!'
+                0x0, 0x0, 0x0, 0x0, // Length of error output in bytes
+            });
+
+            CompletedResponse response;
+            unique_ptr<BusyResponse> busyResponse;
+            Assert::IsTrue(ReadResponse(pipe, PROTOCOL_VERSION, response, busyResponse));
+            Assert::AreEqual(0, response.ExitCode);
+            Assert::AreEqual(L"\u00e9!", response.Output.c_str());
+            Assert::IsTrue(response.ErrorOutput.empty());
+        }
+
+        TEST_METHOD(ReadCancelledMidString)
+        {
+            // A cancelled read fails like a pipe which runs out of data.
+            ReadOnlyMemoryPipe pipe({
+                0x14, 0x0, 0x0, 0x0, // Size of response
+                0x1, 0x0, 0x0, 0x0, // Completed response type
+                0x0, 0x0, 0x0, 0x0, // Exit code
+                0x0, // UTF-8 output
+                0x3, 0x0, 0x0, 0x0, // Length of output in bytes
+                0xc3, 0xa9, // The read is cancelled here
+            });
+
+            CompletedResponse response;
+            unique_ptr<BusyResponse> busyResponse;
+            Assert::IsFalse(ReadResponse(pipe, PROTOCOL_VERSION, response, busyResponse));
+            Assert::IsTrue(busyResponse == nullptr);
+        }
+
+        TEST_METHOD(ReadHostileStringLength)
+        {
+            // A length no server would send is not worth allocating for.
+            ReadOnlyMemoryPipe pipe({
+                0xd, 0x0, 0x0, 0x0, // Size of response
+                0x1, 0x0, 0x0, 0x0, // Completed response type
+                0x0, 0x0, 0x0, 0x0, // Exit code
+                0x1, // UTF-8 output
+                0xff, 0xff, 0xff, 0xff, // Length of output in bytes
+            });
+
+            CompletedResponse response;
+            unique_ptr<BusyResponse> busyResponse;
+            Assert::ExpectException<FatalError>([&]()
+            {
+                ReadResponse(pipe, PROTOCOL_VERSION, response, busyResponse);
+            });
+        }
+
+        TEST_METHOD(ReadEmptySharedMemoryResponse)
+        {
+            auto section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, 0x1000, nullptr);
+            Assert::IsTrue(section != nullptr);
+
+            vector<BYTE> bytes = {
+                0x19, 0x0, 0x0, 0x0, // Size of response
+                0x3, 0x0, 0x0, 0x0, // Completed in shared memory response type
+                0x0, 0x0, 0x0, 0x0, // Exit code
+                0x1, // UTF-8 output
+            };
+            auto handle = static_cast<unsigned long long>(reinterpret_cast<ULONG_PTR>(section));
+            auto handleBytes = reinterpret_cast<const BYTE*>(&handle);
+            bytes.insert(bytes.end(), handleBytes, handleBytes + sizeof(handle));
+            bytes.insert(bytes.end(), {
+                0x0, 0x0, 0x0, 0x0, // Output length
+                0x0, 0x0, 0x0, 0x0, // Error output length
+            });
+
+            // Nothing of the section is read, however large it is.
+            ReadOnlyMemoryPipe pipe(move(bytes));
+            CompletedResponse response;
+            unique_ptr<BusyResponse> busyResponse;
+            Assert::IsTrue(ReadResponse(pipe, PROTOCOL_VERSION, response, busyResponse));
+            Assert::AreEqual(0, response.ExitCode);
+            Assert::AreEqual(L"", response.Output.c_str());
+            Assert::AreEqual(L"", response.ErrorOutput.c_str());
+        }
+
+        TEST_METHOD(ReadSharedMemoryResponse)
+        {
+            const wchar_t text[] = L"outputerrors";
+            auto section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(text), nullptr);
+            Assert::IsTrue(section != nullptr);
+            auto view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, sizeof(text));
+            Assert::IsTrue(view != nullptr);
+            memcpy(view, text, sizeof(text));
+            UnmapViewOfFile(view);
+
+            vector<BYTE> bytes = {
+                0x19, 0x0, 0x0, 0x0, // Size of response
+                0x3, 0x0, 0x0, 0x0, // Completed in shared memory response type
+                0x1, 0x0, 0x0, 0x0, // Exit code
+                0x1, // UTF-8 output
+            };
+            auto handle = static_cast<unsigned long long>(reinterpret_cast<ULONG_PTR>(section));
+            auto handleBytes = reinterpret_cast<const BYTE*>(&handle);
+            bytes.insert(bytes.end(), handleBytes, handleBytes + sizeof(handle));
+            bytes.insert(bytes.end(), {
+                0x6, 0x0, 0x0, 0x0, // Output length
+                0x6, 0x0, 0x0, 0x0, // Error output length
+            });
+
+            // The response owns the handle.
+            ReadOnlyMemoryPipe pipe(move(bytes));
+            CompletedResponse response;
+            unique_ptr<BusyResponse> busyResponse;
+            Assert::IsTrue(ReadResponse(pipe, PROTOCOL_VERSION, response, busyResponse));
+            Assert::AreEqual(1, response.ExitCode);
+            Assert::IsTrue(response.Utf8Output);
+            Assert::AreEqual(L"output", response.Output.c_str());
+            Assert::AreEqual(L"errors", response.ErrorOutput.c_str());
+        }
+
+        TEST_METHOD(SharedMemoryTransport)
+        {
+            auto pipeName = L"\\\\.\\pipe\\NativeClientTests" + to_wstring(GetCurrentProcessId());
+            SmartHandle serverPipe(CreateNamedPipeW(pipeName.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT, 1, 0x10000, 0x10000, 0, nullptr));
+            Assert::IsTrue(serverPipe.get() != INVALID_HANDLE_VALUE);
+            SmartHandle clientPipe(CreateFileW(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr));
+            Assert::IsTrue(clientPipe.get() != INVALID_HANDLE_VALUE);
+
+            // This process plays the server too, so the handle the client
+            // sends is one it can use as it is.
+            SharedMemoryPipe transport(clientPipe.get());
+            Assert::IsTrue(transport.Connect());
+            RealPipe server(serverPipe.get());
+            int length;
+            int token;
+            unsigned long long section;
+            Assert::IsTrue(server.Read(&length, sizeof(length))
+                && server.Read(&token, sizeof(token))
+                && server.Read(&section, sizeof(section)));
+            Assert::AreEqual(12, length);
+            Assert::AreEqual(SHARED_MEMORY_TRANSPORT, token);
+            auto view = static_cast<BYTE*>(MapViewOfFile(reinterpret_cast<HANDLE>(static_cast<ULONG_PTR>(section)), FILE_MAP_WRITE, 0, 0, 0));
+            Assert::IsTrue(view != nullptr);
+
+            // The request ring follows the six counters, each on a cache
+            // line of its own. The request head is the third.
+            const unsigned headerSize = 6 * 64;
+            const unsigned ringSize = 256 * 1024;
+            Assert::IsTrue(transport.Write("abc", 3));
+            Assert::AreEqual(3L, *reinterpret_cast<volatile LONG*>(view + 2 * 64));
+            Assert::AreEqual(0, memcmp(view + headerSize, "abc", 3));
+
+            // The client finds the response ring empty and waits for the
+            // server to ring once it has written the response.
+            thread responder([&]()
+            {
+                auto clientWaiting = reinterpret_cast<volatile LONG*>(view);
+                while (*clientWaiting == 0)
+                {
+                    Sleep(1);
+                }
+                memcpy(view + headerSize + ringSize, "xyz", 3);
+                InterlockedExchange(reinterpret_cast<volatile LONG*>(view + 4 * 64), 3);
+                if (InterlockedExchange(clientWaiting, 0) == 1)
+                {
+                    BYTE doorbell = 1;
+                    server.Write(&doorbell, sizeof(doorbell));
+                }
+            });
+            char response[3];
+            auto read = transport.Read(response, sizeof(response));
+            responder.join();
+            Assert::IsTrue(read);
+            Assert::AreEqual(0, memcmp(response, "xyz", 3));
+
+            UnmapViewOfFile(view);
+        }
+    };
+
+    TEST_CLASS(OutputTests)
+    {
+    public:
+        TEST_METHOD(OutputKeepsSurrogatePairsWhole)
+        {
+            // A surrogate pair straddles the end of the first chunk.
+            wstring text(16 * 1024 - 1, L'a');
+            text += L"\xD83D\xDE00";
+            text += wstring(40000, L'\x00E9');
+
+            WCHAR tempPath[MAX_PATH];
+            Assert::AreNotEqual(0UL, GetTempPathW(MAX_PATH, tempPath));
+            wstring path(tempPath);
+            path += L"OutputTests" + to_wstring(GetCurrentProcessId()) + L".txt";
+            FILE * file;
+            Assert::AreEqual(0, _wfopen_s(&file, path.c_str(), L"wb"));
+            OutputWideString(file, text, true);
+            fclose(file);
+
+            auto expectedLength = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), static_cast<int>(text.length()), nullptr, 0, nullptr, nullptr);
+            string expected(expectedLength, '\0');
+            WideCharToMultiByte(CP_UTF8, 0, text.c_str(), static_cast<int>(text.length()), &expected[0], expectedLength, nullptr, nullptr);
+
+            string written(expected.length() + 1, '\0');
+            Assert::AreEqual(0, _wfopen_s(&file, path.c_str(), L"rb"));
+            written.resize(fread(&written[0], 1, written.length(), file));
+            fclose(file);
+            DeleteFileW(path.c_str());
+            Assert::IsTrue(expected == written);
+        }
+    };
+
+    TEST_CLASS(TranscodeTests)
+    {
+    public:
+        TEST_METHOD(MatchesWideCharToMultiByte)
+        {
+            // Mostly ASCII, so that some runs are long enough to narrow a
+            // vector at a time, with all kinds of other characters mixed
+            // in, including surrogates without their other half.
+            mt19937 generator(42);
+            const wchar_t samples[] = {
+                L'\x00E9', L'\x07FF', L'\x0800', L'\x20AC', L'\x4E2D', L'\xFFFD', L'\xFFFF',
+                L'\xD83D', L'\xDE00', L'\xDBFF', L'\xDFFF',
+            };
+            const UINT codePages[] = { CP_UTF8, 437, 1252, 932 };
+            for (int iteration = 0; iteration < 1000; iteration++)
+            {
+                wstring text(generator() % 200, L'\0');
+                for (auto& c : text)
+                {
+                    auto kind = generator() % 16;
+                    c = kind < 13 ? static_cast<wchar_t>(generator() % 0x80)
+                        : kind < 15 ? samples[generator() % _countof(samples)]
+                        : static_cast<wchar_t>(generator() % 0x10000);
+                }
+
+                auto count = static_cast<int>(text.length());
+                for (auto codePage : codePages)
+                {
+                    vector<char> expected(count * 4 + 1);
+                    vector<char> actual(count * 4 + 1);
+                    auto expectedLength = WideCharToMultiByte(codePage, 0, text.data(), count, expected.data(), static_cast<int>(expected.size()), nullptr, nullptr);
+                    auto actualLength = TranscodeOutput(codePage, text.data(), count, actual.data(), static_cast<int>(actual.size()));
+                    Assert::AreEqual(expectedLength, actualLength);
+                    Assert::AreEqual(0, memcmp(expected.data(), actual.data(), expectedLength));
+                }
+            }
+        }
+    };
+
+    TEST_CLASS(ArgumentTests)
+    {
+    public:
+        TEST_METHOD(GetReferencesSplitsAndSorts)
+        {
+            list<wstring> args = {
+                L"/r:B.dll;a.dll",
+                L"test.cs",
+                L"-reference:C.dll,a.dll",
+                L"/Reference:\"d.dll\"",
+                L"/resource:e.resources",
+            };
+
+            vector<wstring> references;
+            GetReferences(args, references);
+
+            vector<wstring> expected = {
+                L"a.dll",
+                L"b.dll",
+                L"c.dll",
+                L"d.dll",
+            };
+
+            Assert::AreEqual(expected, references);
+        }
+
+        TEST_METHOD(SwitchValues)
+        {
+            wstring value;
+            Assert::IsTrue(TryGetSwitchValue(L"/OUT:a.exe", L"out", value));
+            Assert::AreEqual(L"a.exe", value.c_str());
+            Assert::IsTrue(TryGetSwitchValue(L"-out:", L"out", value));
+            Assert::IsTrue(value.empty());
+            Assert::IsFalse(TryGetSwitchValue(L"/outfile:a.exe", L"out", value));
+            Assert::IsFalse(TryGetSwitchValue(L"/out", L"out", value));
+            Assert::IsFalse(TryGetSwitchValue(L"out:a.exe", L"out", value));
+        }
+
+        TEST_METHOD(OutputPathsLastSwitchWins)
+        {
+            list<wstring> args = {
+                L"/out:first.dll",
+                L"test.cs",
+                L"-OUT:\"bin\\second.dll\"",
+                L"/doc:second.xml",
+            };
+
+            OutputPaths paths;
+            Assert::IsTrue(GetOutputPaths(args, paths));
+            Assert::AreEqual(L"bin\\second.dll", paths.out.c_str());
+            Assert::IsTrue(paths.pdb.empty());
+            Assert::AreEqual(L"second.xml", paths.doc.c_str());
+            Assert::IsFalse(paths.debug);
+
+            Assert::IsTrue(GetOutputPaths({ L"/out:a.dll", L"/debug+" }, paths));
+            Assert::IsTrue(paths.debug);
+            Assert::IsTrue(GetOutputPaths({ L"/out:a.dll", L"-debug:full", L"/debug-" }, paths));
+            Assert::IsFalse(paths.debug);
+
+            Assert::IsFalse(GetOutputPaths({ L"test.cs" }, paths));
+            Assert::IsFalse(GetOutputPaths({ L"/out:a.dll", L"/touchedfiles:t" }, paths));
+        }
+
+        TEST_METHOD(SourceFilesMadeAbsolute)
+        {
+            list<wstring> args = {
+                L"/out:a.dll",
+                L"test.cs",
+                L"\"sub dir\\b.cs\"",
+                L"-r:c.dll",
+                L"d:\\other\\d.cs",
+                L"*.cs",
+            };
+
+            vector<wstring> sources;
+            GetSourceFiles(args, L"c:\\src", sources);
+
+            vector<wstring> expected = {
+                L"c:\\src\\test.cs",
+                L"c:\\src\\sub dir\\b.cs",
+                L"d:\\other\\d.cs",
+            };
+
+            Assert::AreEqual(expected, sources);
+        }
+
+        TEST_METHOD(AffinityKeyIgnoresReferenceOrder)
+        {
+            list<wstring> first = { L"/r:a.dll", L"/r:b.dll", L"one.cs" };
+            list<wstring> second = { L"/r:B.dll;A.dll", L"two.cs" };
+            list<wstring> third = { L"/r:a.dll", L"/r:c.dll", L"one.cs" };
+
+            Assert::AreEqual(
+                ComputeAffinityKey(L"c:\\project", first),
+                ComputeAffinityKey(L"c:\\project", second));
+            Assert::AreNotEqual(
+                ComputeAffinityKey(L"c:\\project", first),
+                ComputeAffinityKey(L"c:\\project", third));
+            Assert::AreNotEqual(
+                ComputeAffinityKey(L"c:\\project", first),
+                ComputeAffinityKey(L"c:\\other", first));
+        }
+    };
+
+    TEST_CLASS(SpawnBackoffTests)
+    {
+    public:
+        TEST_METHOD(FailureBacksOffUntilSuccess)
+        {
+            WCHAR tempPath[MAX_PATH];
+            Assert::AreNotEqual(0UL, GetTempPathW(MAX_PATH, tempPath));
+            wstring stateDirectory(tempPath);
+            stateDirectory += L"SpawnBackoffTests" + to_wstring(GetCurrentProcessId()) + L"\\";
+            CreateDirectoryW(stateDirectory.c_str(), nullptr);
+
+            DWORD remainingMs;
+            Assert::IsFalse(IsServerSpawnBackedOff(stateDirectory, remainingMs));
+
+            RecordServerSpawnFailure(stateDirectory);
+            Assert::IsTrue(IsServerSpawnBackedOff(stateDirectory, remainingMs));
+            auto firstBackoffMs = remainingMs;
+
+            RecordServerSpawnFailure(stateDirectory);
+            Assert::IsTrue(IsServerSpawnBackedOff(stateDirectory, remainingMs));
+            Assert::IsTrue(remainingMs > firstBackoffMs);
+
+            RecordServerSpawnSuccess(stateDirectory);
+            Assert::IsFalse(IsServerSpawnBackedOff(stateDirectory, remainingMs));
+
+            DeleteFileW((stateDirectory + L"spawn").c_str());
+            RemoveDirectoryW(stateDirectory.c_str());
+        }
+    };
+
+    TEST_CLASS(AdaptiveKeepAliveTests)
+    {
+    public:
+        TEST_METHOD(CoversBuildCadence)
+        {
+            // Builds about every 12 minutes, and once overnight.
+            vector<DWORD> gaps = { 700, 720, 690, 730, 710, 50000 };
+            DWORD keepAliveSeconds;
+            Assert::IsTrue(ComputeAdaptiveKeepAlive(gaps, 3600, keepAliveSeconds));
+            Assert::IsTrue(keepAliveSeconds >= 730);
+            Assert::IsTrue(keepAliveSeconds <= 3600);
+
+            // Capped by the maximum.
+            Assert::IsTrue(ComputeAdaptiveKeepAlive(gaps, 800, keepAliveSeconds));
+            Assert::AreEqual((DWORD)800, keepAliveSeconds);
+        }
+
+        TEST_METHOD(DefaultCoversFrequentBuilds)
+        {
+            vector<DWORD> gaps = { 70, 90, 120, 100, 80 };
+            DWORD keepAliveSeconds;
+            Assert::IsFalse(ComputeAdaptiveKeepAlive(gaps, 3600, keepAliveSeconds));
+
+            // Too little history.
+            vector<DWORD> fewGaps = { 700, 720 };
+            Assert::IsFalse(ComputeAdaptiveKeepAlive(fewGaps, 3600, keepAliveSeconds));
+        }
+    };
+
+    TEST_CLASS(FallbackSlotTests)
+    {
+    public:
+        TEST_METHOD(AbandonedSlotIsFree)
+        {
+            auto slotsName = L"FallbackSlotTests" + to_wstring(GetCurrentProcessId());
+
+            // Take the only slot on a thread which exits without releasing it,
+            // as a killed client would.
+            SmartHandle slot(nullptr);
+            thread([&]()
+            {
+                slot.reset(CreateMutexW(nullptr, TRUE, (slotsName + L"/0").c_str()));
+            }).join();
+            Assert::IsTrue(slot != nullptr);
+
+            SmartSlot slots(slotsName.c_str(), 1);
+            bool eventSignaled;
+            Assert::IsTrue(slots.WaitOrEvent(nullptr, 0, eventSignaled));
+            Assert::IsFalse(eventSignaled);
+        }
+    };
+
+    // A new directory under the temporary directory, which is removed with
+    // everything in it when this goes away.
+    class TempDirectory
+    {
+    private:
+        wstring path;
+
+        static void DeleteTree(_In_ const wstring& directory)
+        {
+            WIN32_FIND_DATAW findData;
+            auto findHandle = FindFirstFileW((directory + L"*").c_str(), &findData);
+            if (findHandle != INVALID_HANDLE_VALUE)
+            {
+                do
+                {
+                    wstring name(findData.cFileName);
+                    if (name == L"." || name == L"..")
+                    {
+                        continue;
+                    }
+
+                    if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                    {
+                        DeleteTree(directory + name + L"\\");
+                    }
+                    else
+                    {
+                        DeleteFileW((directory + name).c_str());
+                    }
+                } while (FindNextFileW(findHandle, &findData));
+
+                FindClose(findHandle);
+            }
+
+            RemoveDirectoryW(directory.c_str());
+        }
+
+    public:
+        TempDirectory(_In_z_ LPCWSTR name)
+        {
+            WCHAR tempPath[MAX_PATH];
+            Assert::AreNotEqual(0UL, GetTempPathW(MAX_PATH, tempPath));
+            path = tempPath;
+            path += name + to_wstring(GetCurrentProcessId()) + L"\\";
+
+            // Left over from an earlier run with the same process id.
+            DeleteTree(path);
+            Assert::IsTrue(CreateDirectoryW(path.c_str(), nullptr) != FALSE);
+        }
+
+        ~TempDirectory()
+        {
+            DeleteTree(path);
+        }
+
+        // The directory's path, ending in a separator.
+        const wstring& GetPath() const
+        {
+            return path;
+        }
+    };
+
+    TEST_CLASS(ResultCacheTests)
+    {
+    public:
+        static void WriteTestFile(_In_ const wstring& path, _In_z_ const char * contents)
+        {
+            auto file = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            Assert::IsTrue(file != INVALID_HANDLE_VALUE);
+            DWORD written;
+            Assert::IsTrue(WriteFile(file, contents, static_cast<DWORD>(strlen(contents)), &written, nullptr) != FALSE);
+            CloseHandle(file);
+        }
+
+        TEST_METHOD(FingerprintsFollowContents)
+        {
+            Assert::AreEqual(0xEF46DB3751D8E999ULL, HashBuffer("", 0));
+            Assert::AreEqual(0x44BC2CF5AD770999ULL, HashBuffer("abc", 3));
+
+            TempDirectory temp(L"FingerprintTests");
+            auto& directory = temp.GetPath();
+
+            WriteTestFile(directory + L"a.cs", "class A { }");
+            WriteTestFile(directory + L"b.cs", "");
+            vector<wstring> paths = { directory + L"a.cs", directory + L"b.cs" };
+            vector<Fingerprint> fingerprints;
+            Assert::IsTrue(GetFileFingerprints(directory, directory, paths, fingerprints));
+            Assert::AreEqual((size_t)2, fingerprints.size());
+            Assert::AreEqual(HashBuffer("class A { }", 11), fingerprints[0]);
+            Assert::AreEqual(HashBuffer("", 0), fingerprints[1]);
+
+            WriteTestFile(directory + L"a.cs", "class B { }");
+            Assert::IsTrue(GetFileFingerprints(directory, directory, paths, fingerprints));
+            Assert::AreEqual(HashBuffer("class B { }", 11), fingerprints[0]);
+
+            paths.push_back(directory + L"missing.cs");
+            Assert::IsFalse(GetFileFingerprints(directory, directory, paths, fingerprints));
+        }
+
+        TEST_METHOD(RestoresStoredResult)
+        {
+            TempDirectory temp(L"ResultCacheTests");
+            auto& directory = temp.GetPath();
+            SetEnvironmentVariableW(RESULTCACHE_ENV_VAR, (directory + L"cache").c_str());
+
+            WriteTestFile(directory + L"a.cs", "class A { }");
+            list<wstring> args = { L"/noconfig", L"/nostdlib+", L"/out:a.dll", L"a.cs" };
+
+            ResultCache cache;
+            CompilationKey key;
+            CompletedResponse response;
+            Assert::IsTrue(cache.IsEnabled());
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, key));
+            Assert::IsFalse(cache.TryRestore(key, response));
+
+            WriteTestFile(directory + L"a.dll", "assembly");
+            cache.Store(key, CompletedResponse(0, false, L"warning", L""));
+            DeleteFileW((directory + L"a.dll").c_str());
+
+            CompilationKey repeat;
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, repeat));
+            Assert::AreEqual(key.key.c_str(), repeat.key.c_str());
+            Assert::IsTrue(cache.TryRestore(repeat, response));
+            Assert::AreEqual(0, response.ExitCode);
+            Assert::AreEqual(L"warning", response.Output.c_str());
+            Assert::AreNotEqual(INVALID_FILE_ATTRIBUTES, GetFileAttributesW((directory + L"a.dll").c_str()));
+
+            // A changed source is a different compilation.
+            WriteTestFile(directory + L"a.cs", "class B { }");
+            CompilationKey changed;
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, changed));
+            Assert::IsFalse(cache.TryRestore(changed, response));
+
+            // Not every compilation can be cached.
+            CompilationKey uncacheable;
+            Assert::IsFalse(GetCompilationKey(CSHARPCOMPILE, { L"/out:a.dll", L"a.cs" }, directory, directory, uncacheable));
+
+            SetEnvironmentVariableW(RESULTCACHE_ENV_VAR, nullptr);
+        }
+
+        TEST_METHOD(SkipsUpToDateCompilation)
+        {
+            TempDirectory temp(L"BuildManifestTests");
+            auto& directory = temp.GetPath();
+            SetEnvironmentVariableW(UPTODATECHECK_ENV_VAR, L"1");
+
+            WriteTestFile(directory + L"a.cs", "class A { }");
+            list<wstring> args = { L"/noconfig", L"/nostdlib+", L"/out:a.dll", L"a.cs" };
+
+            BuildManifest manifest(directory);
+            CompilationKey key;
+            CompletedResponse response;
+            Assert::IsTrue(manifest.IsEnabled());
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, key));
+            Assert::IsFalse(manifest.IsUpToDate(key, response));
+
+            WriteTestFile(directory + L"a.dll", "assembly");
+            manifest.Record(key, CompletedResponse(0, false, L"warning\r\n", L""));
+            Assert::IsTrue(manifest.IsUpToDate(key, response));
+            Assert::AreEqual(0, response.ExitCode);
+            Assert::AreEqual(L"warning\r\n", response.Output.c_str());
+
+            // Another build step wrote the output.
+            WriteTestFile(directory + L"a.dll", "other assembly");
+            Assert::IsFalse(manifest.IsUpToDate(key, response));
+
+            // A changed source has a different key.
+            manifest.Record(key, CompletedResponse(0, false, L"", L""));
+            WriteTestFile(directory + L"a.cs", "class B { }");
+            CompilationKey changed;
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, changed));
+            Assert::IsFalse(manifest.IsUpToDate(changed, response));
+
+            SetEnvironmentVariableW(UPTODATECHECK_ENV_VAR, nullptr);
+        }
+
+        TEST_METHOD(CoalescesIdenticalRequests)
+        {
+            TempDirectory temp(L"CoalescingTests");
+            auto& directory = temp.GetPath();
+            SetEnvironmentVariableW(COALESCING_ENV_VAR, L"1");
+
+            WriteTestFile(directory + L"a.cs", "class A { }");
+            list<wstring> args = { L"/noconfig", L"/nostdlib+", L"/out:a.dll", L"a.cs" };
+            CompilationKey key;
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, key));
+
+            CompletedResponse response;
+            auto replayed = false;
+            thread waiter;
+            {
+                CoalescedCompilation first(directory);
+                Assert::IsTrue(first.IsEnabled());
+                Assert::IsTrue(first.Claim(key, L"server.exe"));
+
+                // Only a response published after the second client found
+                // the request claimed answers it.
+                SmartHandle claimed(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+                waiter = thread([&]()
+                {
+                    CoalescedCompilation second(directory);
+                    auto claimedFirst = second.Claim(key, L"server.exe");
+                    SetEvent(claimed.get());
+                    replayed = !claimedFirst && second.Join(0, response);
+                });
+                WaitForSingleObject(claimed.get(), INFINITE);
+                first.Publish(CompletedResponse(0, false, L"warning", L""));
+            }
+
+            waiter.join();
+            Assert::IsTrue(replayed);
+            Assert::AreEqual(0, response.ExitCode);
+            Assert::AreEqual(L"warning", response.Output.c_str());
+
+            // Once a source changes the request is no longer identical.
+            CoalescedCompilation holder(directory);
+            Assert::IsTrue(holder.Claim(key, L"server.exe"));
+            WriteTestFile(directory + L"a.cs", "class B { }");
+            CompilationKey changed;
+            Assert::IsTrue(GetCompilationKey(CSHARPCOMPILE, args, directory, directory, changed));
+            CoalescedCompilation other(directory);
+            Assert::IsTrue(other.Claim(changed, L"server.exe"));
+
+            SetEnvironmentVariableW(COALESCING_ENV_VAR, nullptr);
+        }
+    };
+
+    TEST_CLASS(WarmupProfileTests)
+    {
+    public:
+        TEST_METHOD(NewHotReferenceDisplacesOld)
+        {
+            TempDirectory temp(L"WarmupProfileTests");
+            auto& directory = temp.GetPath();
+
+            // Fill the profile with references which every compilation uses.
+            list<wstring> args = { L"/out:a.dll", L"a.cs" };
+            for (int i = 0; i < 100; i++)
+            {
+                args.push_back(L"/r:c:\\old\\" + to_wstring(i) + L".dll");
+            }
+            for (int i = 0; i < 50; i++)
+            {
+                RecordWarmupProfile(directory, CSHARPCOMPILE, args, directory);
+            }
+
+            // Compilations stop using one of them and start using another.
+            args.pop_back();
+            args.push_back(L"/r:c:\\new\\hot.dll");
+            for (int i = 0; i < 100; i++)
+            {
+                RecordWarmupProfile(directory, CSHARPCOMPILE, args, directory);
+            }
+
+            vector<wstring> lines;
+            {
+                LockedStateFile profile(directory + L"warmup");
+                Assert::IsTrue(profile.ReadLines(lines));
+            }
+
+            auto isLoaded = [&](const wstring& reference)
+            {
+                return any_of(lines.begin(), lines.end(), [&](const wstring& line)
+                {
+                    return line.compare(0, 4, L"ref ") == 0
+                        && line.size() > reference.size()
+                        && line.compare(line.size() - reference.size(), reference.size(), reference) == 0;
+                });
+            };
+            Assert::IsTrue(isLoaded(L"c:\\new\\hot.dll"));
+            Assert::IsFalse(isLoaded(L"c:\\old\\99.dll"));
+            Assert::IsTrue(isLoaded(L"c:\\old\\98.dll"));
+        }
     };
 }
@@ -24,3 +24,31 @@ public:
         return buffer;
     }
 };
+
+// Reads from a buffer in memory for testing
+class ReadOnlyMemoryPipe : public IPipe
+{
+private:
+    std::vector<BYTE> buffer;
+    size_t position;
+
+public:
+    ReadOnlyMemoryPipe(std::vector<BYTE>&& bytes)
+        : buffer(bytes), position(0)
+    {}
+
+    virtual bool Write(LPCVOID data, unsigned toWrite)
+    {
+        return false;
+    }
+    virtual bool Read(_Out_ LPVOID data, unsigned size)
+    {
+        if (buffer.size() - position < size)
+        {
+            return false;
+        }
+        memcpy(data, buffer.data() + position, size);
+        position += size;
+        return true;
+    }
+};
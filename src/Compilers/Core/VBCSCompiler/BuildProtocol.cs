@@ -4,6 +4,8 @@
 using System.Collections.Immutable;
 using System.Diagnostics;
 using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Runtime.InteropServices;
 using System.Text;
 using System.Threading;
 using System.Threading.Tasks;
@@ -15,7 +17,8 @@
 // appended to that pipe name.
 //
 // Client enumerates all processes on the machine, search for one with the correct fully qualified
-// executable name. If none are found, that executable is started. The client then connects
+// executable name. If none are found, that executable is started and the client waits for it to
+// signal the event named by ProtocolConstants.ServerReadyEventSuffix. The client then connects
 // to the named pipe, and writes a single request, as represented by the Request structure.
 // If a pipe is disconnected, and it didn't create that process, the clients continues trying to 
 // connect.
@@ -74,6 +77,16 @@ internal class BuildRequest
         /// </summary>
         /// <returns>null if the Request was too large, the Request otherwise.</returns>
         public static async Task<BuildRequest> ReadAsync(Stream inStream, CancellationToken cancellationToken)
+        {
+            var frame = await ReadFrameAsync(inStream, cancellationToken).ConfigureAwait(false);
+            return frame == null ? null : Parse(frame, cancellationToken);
+        }
+
+        /// <summary>
+        /// Read the body of a length prefixed frame, usually a Request, from the given stream.
+        /// </summary>
+        /// <returns>null if the frame was over 1MB in length, its body otherwise.</returns>
+        public static async Task<byte[]> ReadFrameAsync(Stream inStream, CancellationToken cancellationToken)
         {
             // Read the length of the request
             var lengthBuffer = new byte[4];
@@ -101,10 +114,17 @@ public static async Task<BuildRequest> ReadAsync(Stream inStream, CancellationTo
                                                       cancellationToken).ConfigureAwait(false);
 
             cancellationToken.ThrowIfCancellationRequested();
+            return responseBuffer;
+        }
 
+        /// <summary>
+        /// Parse the body of a request frame read by <see cref="ReadFrameAsync"/>.
+        /// </summary>
+        public static BuildRequest Parse(byte[] frame, CancellationToken cancellationToken)
+        {
             CompilerServerLogger.Log("Parsing request");
             // Parse the request into the Request data structure.
-            using (var reader = new BinaryReader(new MemoryStream(responseBuffer), Encoding.Unicode))
+            using (var reader = new BinaryReader(new MemoryStream(frame), Encoding.Unicode))
             {
                 var protocolVersion = reader.ReadUInt32();
                 var language = (BuildProtocolConstants.RequestLanguage)reader.ReadUInt32();
@@ -115,7 +135,7 @@ public static async Task<BuildRequest> ReadAsync(Stream inStream, CancellationTo
                 for (int i = 0; i < argumentCount; i++)
                 {
                     cancellationToken.ThrowIfCancellationRequested();
-                    argumentsBuilder.Add(BuildRequest.Argument.ReadFromBinaryReader(reader));
+                    argumentsBuilder.Add(BuildRequest.Argument.ReadFromBinaryReader(reader, protocolVersion));
                 }
 
                 return new BuildRequest(protocolVersion,
@@ -139,7 +159,7 @@ public async Task WriteAsync(Stream outStream, CancellationToken cancellationTok
                 foreach (Argument arg in this.Arguments)
                 {
                     cancellationToken.ThrowIfCancellationRequested();
-                    arg.WriteToBinaryWriter(writer);
+                    arg.WriteToBinaryWriter(writer, this.ProtocolVersion);
                 }
                 writer.Flush();
 
@@ -183,6 +203,8 @@ public async Task WriteAsync(Stream outStream, CancellationToken cancellationTok
         /// 
         /// Strings are encoded via a length prefix as a signed
         /// 32-bit integer, followed by an array of characters.
+        /// From protocol version 3 the length counts bytes and
+        /// the characters are UTF-8.
         /// </summary>
         public struct Argument
         {
@@ -199,19 +221,19 @@ public struct Argument
                 this.Value = value;
             }
 
-            public static Argument ReadFromBinaryReader(BinaryReader reader)
+            public static Argument ReadFromBinaryReader(BinaryReader reader, uint protocolVersion)
             {
                 var argId = (BuildProtocolConstants.ArgumentId)reader.ReadUInt32();
                 var argIndex = reader.ReadUInt32();
-                string value = BuildProtocolConstants.ReadLengthPrefixedString(reader);
+                string value = BuildProtocolConstants.ReadLengthPrefixedString(reader, protocolVersion);
                 return new Argument(argId, argIndex, value);
             }
 
-            public void WriteToBinaryWriter(BinaryWriter writer)
+            public void WriteToBinaryWriter(BinaryWriter writer, uint protocolVersion)
             {
                 writer.Write((uint)this.ArgumentId);
                 writer.Write(this.ArgumentIndex);
-                BuildProtocolConstants.WriteLengthPrefixedString(writer, this.Value);
+                BuildProtocolConstants.WriteLengthPrefixedString(writer, this.Value, protocolVersion);
             }
         }
     }
@@ -234,12 +256,28 @@ internal abstract class BuildResponse
         public enum ResponseType
         {
             MismatchedVersion,
-            Completed
+            Completed,
+            Busy,
+            CompletedInSharedMemory
         }
 
         public abstract ResponseType Type { get; }
 
+        /// <summary>
+        /// Write the response in the encoding of protocol version 2, which every client reads.
+        /// </summary>
+        public Task WriteAsync(Stream outStream,
+                               CancellationToken cancellationToken)
+        {
+            return WriteAsync(outStream, BuildProtocolConstants.Utf16ProtocolVersion, cancellationToken);
+        }
+
+        /// <summary>
+        /// Write the response in the encoding of the given protocol version, which should be the
+        /// version of the request it answers.
+        /// </summary>
         public async Task WriteAsync(Stream outStream,
+                               uint protocolVersion,
                                CancellationToken cancellationToken)
         {
             using (var writer = new BinaryWriter(new MemoryStream(), Encoding.Unicode))
@@ -248,7 +286,7 @@ public enum ResponseType
                 CompilerServerLogger.Log("Formatting Response");
                 writer.Write((int)this.Type);
 
-                this.AddResponseBody(writer);
+                this.AddResponseBody(writer, protocolVersion);
                 writer.Flush();
 
                 cancellationToken.ThrowIfCancellationRequested();
@@ -279,15 +317,24 @@ public enum ResponseType
             }
         }
 
-        protected abstract void AddResponseBody(BinaryWriter writer);
+        protected abstract void AddResponseBody(BinaryWriter writer, uint protocolVersion);
+
+        /// <summary>
+        /// Read a response written in the encoding of protocol version 2.
+        /// </summary>
+        public static Task<BuildResponse> ReadAsync(Stream stream, CancellationToken cancellationToken)
+        {
+            return ReadAsync(stream, BuildProtocolConstants.Utf16ProtocolVersion, cancellationToken);
+        }
 
         /// <summary>
         /// May throw exceptions if there are pipe problems.
         /// </summary>
         /// <param name="stream"></param>
+        /// <param name="protocolVersion">The version of the request the response answers</param>
         /// <param name="cancellationToken"></param>
         /// <returns></returns>
-        public static async Task<BuildResponse> ReadAsync(Stream stream, CancellationToken cancellationToken)
+        public static async Task<BuildResponse> ReadAsync(Stream stream, uint protocolVersion, CancellationToken cancellationToken)
         {
             CompilerServerLogger.Log("Reading response length");
             // Read the response length
@@ -310,9 +357,13 @@ public static async Task<BuildResponse> ReadAsync(Stream stream, CancellationTok
                 switch (responseType)
                 {
                     case ResponseType.Completed:
-                        return CompletedBuildResponse.Create(reader);
+                        return CompletedBuildResponse.Create(reader, protocolVersion);
                     case ResponseType.MismatchedVersion:
                         return MismatchedVersionBuildResponse.Create(reader);
+                    case ResponseType.Busy:
+                        return BusyBuildResponse.Create(reader);
+                    case ResponseType.CompletedInSharedMemory:
+                        return SharedMemoryCompletedBuildResponse.Create(reader);
                     default:
                         throw new InvalidOperationException("Received invalid response type from server.");
                 }
@@ -332,6 +383,8 @@ public static async Task<BuildResponse> ReadAsync(Stream stream, CancellationTok
     /// 
     /// Strings are encoded via a character count prefix as a 
     /// 32-bit integer, followed by an array of characters.
+    /// In answer to a protocol version 3 request they are
+    /// encoded as a byte count followed by UTF-8 instead.
     /// 
     /// </summary>
     internal class CompletedBuildResponse : BuildResponse
@@ -354,22 +407,22 @@ internal class CompletedBuildResponse : BuildResponse
 
         public override ResponseType Type { get { return ResponseType.Completed; } }
 
-        public static CompletedBuildResponse Create(BinaryReader reader)
+        public static CompletedBuildResponse Create(BinaryReader reader, uint protocolVersion)
         {
             var returnCode = reader.ReadInt32();
             var utf8Output = reader.ReadBoolean();
-            var output = BuildProtocolConstants.ReadLengthPrefixedString(reader);
-            var errorOutput = BuildProtocolConstants.ReadLengthPrefixedString(reader);
+            var output = BuildProtocolConstants.ReadLengthPrefixedString(reader, protocolVersion);
+            var errorOutput = BuildProtocolConstants.ReadLengthPrefixedString(reader, protocolVersion);
 
             return new CompletedBuildResponse(returnCode, utf8Output, output, errorOutput);
         }
 
-        protected override void AddResponseBody(BinaryWriter writer)
+        protected override void AddResponseBody(BinaryWriter writer, uint protocolVersion)
         {
             writer.Write(this.ReturnCode);
             writer.Write(this.Utf8Output);
-            BuildProtocolConstants.WriteLengthPrefixedString(writer, this.Output);
-            BuildProtocolConstants.WriteLengthPrefixedString(writer, this.ErrorOutput);
+            BuildProtocolConstants.WriteLengthPrefixedString(writer, this.Output, protocolVersion);
+            BuildProtocolConstants.WriteLengthPrefixedString(writer, this.ErrorOutput, protocolVersion);
         }
     }
 
@@ -385,7 +438,185 @@ public static MismatchedVersionBuildResponse Create(BinaryReader reader)
         /// <summary>
         /// MismatchedVersion has no body.
         /// </summary>
-        protected override void AddResponseBody(BinaryWriter writer) { }
+        protected override void AddResponseBody(BinaryWriter writer, uint protocolVersion) { }
+    }
+
+    /// <summary>
+    /// Sent by a server which is too busy to take a request.  The client should send the request
+    /// to another server, or compile it itself, rather than wait in line.
+    ///
+    ///  Field Name         Type            Size (bytes)
+    /// --------------------------------------------------
+    ///  RetryAfter         Integer         4
+    ///  QueueDepth         Integer         4
+    /// </summary>
+    internal class BusyBuildResponse : BuildResponse
+    {
+        /// <summary>
+        /// How long, in milliseconds, the server expects to stay busy.
+        /// </summary>
+        public readonly int RetryAfterMilliseconds;
+
+        /// <summary>
+        /// How many requests the server has waiting.
+        /// </summary>
+        public readonly int QueueDepth;
+
+        public BusyBuildResponse(int retryAfterMilliseconds, int queueDepth)
+        {
+            this.RetryAfterMilliseconds = retryAfterMilliseconds;
+            this.QueueDepth = queueDepth;
+        }
+
+        public override ResponseType Type { get { return ResponseType.Busy; } }
+
+        public static BusyBuildResponse Create(BinaryReader reader)
+        {
+            var retryAfterMilliseconds = reader.ReadInt32();
+            var queueDepth = reader.ReadInt32();
+            return new BusyBuildResponse(retryAfterMilliseconds, queueDepth);
+        }
+
+        protected override void AddResponseBody(BinaryWriter writer, uint protocolVersion)
+        {
+            writer.Write(this.RetryAfterMilliseconds);
+            writer.Write(this.QueueDepth);
+        }
+    }
+
+    /// <summary>
+    /// Sent instead of a <see cref="CompletedBuildResponse"/> when the output is too large to send
+    /// through the pipe efficiently, if the request was in
+    /// <see cref="BuildProtocolConstants.ProtocolVersion"/>.  The output and then the error output
+    /// are UTF-16 text in a section whose handle the server duplicated into the client process, the
+    /// one at the other end of the pipe.  The client maps the section and closes the handle.
+    ///
+    ///  Field Name         Type            Size (bytes)
+    /// --------------------------------------------------
+    ///  ReturnCode         Integer         4
+    ///  Utf8Output         Boolean         1
+    ///  Section            Long            8
+    ///  OutputLength       Integer         4
+    ///  ErrorOutputLength  Integer         4
+    /// </summary>
+    internal class SharedMemoryCompletedBuildResponse : BuildResponse
+    {
+        private const uint ProcessDupHandle = 0x0040;
+        private const uint FileMapRead = 0x0004;
+
+        public readonly int ReturnCode;
+        public readonly bool Utf8Output;
+
+        /// <summary>
+        /// The handle of the section in the client process.
+        /// </summary>
+        public readonly long Section;
+
+        public readonly int OutputLength;
+        public readonly int ErrorOutputLength;
+
+        public SharedMemoryCompletedBuildResponse(int returnCode,
+                                                  bool utf8output,
+                                                  long section,
+                                                  int outputLength,
+                                                  int errorOutputLength)
+        {
+            this.ReturnCode = returnCode;
+            this.Utf8Output = utf8output;
+            this.Section = section;
+            this.OutputLength = outputLength;
+            this.ErrorOutputLength = errorOutputLength;
+        }
+
+        public override ResponseType Type { get { return ResponseType.CompletedInSharedMemory; } }
+
+        public static SharedMemoryCompletedBuildResponse Create(BinaryReader reader)
+        {
+            var returnCode = reader.ReadInt32();
+            var utf8Output = reader.ReadBoolean();
+            var section = reader.ReadInt64();
+            var outputLength = reader.ReadInt32();
+            var errorOutputLength = reader.ReadInt32();
+            return new SharedMemoryCompletedBuildResponse(returnCode, utf8Output, section, outputLength, errorOutputLength);
+        }
+
+        /// <summary>
+        /// Put the output of a completed response in a new section and hand it to the client
+        /// process.  Returns null if the section can't be created or handed over.
+        /// </summary>
+        public static SharedMemoryCompletedBuildResponse TryCreate(CompletedBuildResponse response, int clientProcessId)
+        {
+            var process = OpenProcess(ProcessDupHandle, false, clientProcessId);
+            if (process == IntPtr.Zero)
+            {
+                return null;
+            }
+
+            try
+            {
+                var size = ((long)response.Output.Length + response.ErrorOutput.Length) * sizeof(char);
+                using (var mapping = MemoryMappedFile.CreateNew(null, size))
+                {
+                    // The text is written through a small buffer rather than copied to a char array.
+                    using (var stream = mapping.CreateViewStream(0, size, MemoryMappedFileAccess.Write))
+                    using (var writer = new StreamWriter(stream, new UnicodeEncoding(bigEndian: false, byteOrderMark: false)))
+                    {
+                        writer.Write(response.Output);
+                        writer.Write(response.ErrorOutput);
+                    }
+
+                    // The client's handle keeps the section alive once the server's is closed.
+                    IntPtr section;
+                    if (!DuplicateHandle(GetCurrentProcess(), mapping.SafeMemoryMappedFileHandle, process, out section, FileMapRead, false, 0))
+                    {
+                        return null;
+                    }
+
+                    return new SharedMemoryCompletedBuildResponse(
+                        response.ReturnCode,
+                        response.Utf8Output,
+                        section.ToInt64(),
+                        response.Output.Length,
+                        response.ErrorOutput.Length);
+                }
+            }
+            catch (IOException)
+            {
+                return null;
+            }
+            finally
+            {
+                CloseHandle(process);
+            }
+        }
+
+        protected override void AddResponseBody(BinaryWriter writer, uint protocolVersion)
+        {
+            writer.Write(this.ReturnCode);
+            writer.Write(this.Utf8Output);
+            writer.Write(this.Section);
+            writer.Write(this.OutputLength);
+            writer.Write(this.ErrorOutputLength);
+        }
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern IntPtr OpenProcess(uint desiredAccess, bool inheritHandle, int processId);
+
+        [DllImport("kernel32.dll")]
+        private static extern IntPtr GetCurrentProcess();
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool DuplicateHandle(
+            IntPtr sourceProcess,
+            SafeHandle sourceHandle,
+            IntPtr targetProcess,
+            out IntPtr targetHandle,
+            uint desiredAccess,
+            bool inheritHandle,
+            uint options);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool CloseHandle(IntPtr handle);
     }
 
     /// <summary>
@@ -394,21 +625,92 @@ public static MismatchedVersionBuildResponse Create(BinaryReader reader)
     internal static class BuildProtocolConstants
     {
         /// <summary>
-        /// The version number for this protocol.
+        /// The version number for this protocol.  From this version strings are UTF-8.
+        /// </summary>
+        public const uint ProtocolVersion = 3;
+
+        /// <summary>
+        /// The last version whose strings are UTF-16.  Requests in it are still understood, and
+        /// answered in it.
         /// </summary>
-        public const uint ProtocolVersion = 2;
+        public const uint Utf16ProtocolVersion = 2;
+
+        /// <summary>
+        /// Completed responses with at least this many characters of output are handed to clients
+        /// in shared memory rather than sent through the pipe.
+        /// </summary>
+        public const int SharedMemoryOutputThreshold = 1024 * 1024;
 
         /// <summary>
         /// The name of the named pipe. A process id is appended to the end.
         /// </summary>
         public const string PipeName = "VBCSCompiler";
 
+        /// <summary>
+        /// Appended to the pipe name of a server to name the event it signals once
+        /// it is listening for connections. The client that started the server
+        /// creates the event and waits on it instead of polling for the pipe.
+        /// </summary>
+        public const string ServerReadyEventSuffix = ".ready";
+
+        /// <summary>
+        /// Appended to the pipe name of a server to name the file mapping through which the
+        /// client that started the server hands it pipe instances the client created. The
+        /// mapping holds 64-bit values: the handle of the mapping in the server, the number of
+        /// pipe instances, at most four, and then the handle of each instance in the server.
+        /// </summary>
+        public const string ListenerMappingSuffix = ".listener";
+
+        /// <summary>
+        /// Appended to the pipe name of a server to name the event through which it tells clients
+        /// that it understands <see cref="ProtocolVersion"/>.  Clients which don't find it send
+        /// requests in <see cref="Utf16ProtocolVersion"/>, which servers before it expect.
+        /// </summary>
+        public const string ProtocolVersionSuffix = ".v3";
+
+        /// <summary>
+        /// Appended to the pipe name of a server to name the event through which it tells clients
+        /// that it accepts a <see cref="RequestLanguage.Prepare"/> request ahead of the request
+        /// itself.  Servers before it fail the compilation instead.
+        /// </summary>
+        public const string PrepareRequestSuffix = ".prepare";
+
+        /// <summary>
+        /// Sent by a client after its request, while it waits for the response, to ask the
+        /// server to abandon the compilation.  The frame is the length of its body (4) followed
+        /// by this value.
+        /// </summary>
+        public const int CancelRequest = 0x44532530;
+
+        /// <summary>
+        /// The size in bytes of a cancel frame.
+        /// </summary>
+        public const int CancelFrameSize = 8;
+
+        /// <summary>
+        /// Appended to the pipe name of a server to name the event through which it tells clients
+        /// that it can exchange requests and responses with them through shared memory, as
+        /// described by <see cref="SharedMemoryTransportStream"/>.
+        /// </summary>
+        public const string SharedMemoryTransportSuffix = ".ring";
+
+        /// <summary>
+        /// Sent by a client before its first request to tell the server about the section through
+        /// which the requests and the response are exchanged.  The frame is the length of its body
+        /// (12) followed by this value and the 64-bit handle of the section in the client, which the
+        /// server duplicates from the client process at the other end of the pipe.
+        /// </summary>
+        public const int SharedMemoryTransportRequest = 0x44532531;
+
         // The id numbers below are just random. It's useful to use id numbers
         // that won't occur accidentally for debugging.
         public enum RequestLanguage
         {
             CSharpCompile = 0x44532521,
             VisualBasicCompile = 0x44532522,
+            // Not a compilation, but the files the request which follows will read, so the
+            // server can start loading them early
+            Prepare = 0x44532523,
         }
 
         // Arugments for CSharp and VB Compiler
@@ -423,7 +725,29 @@ public enum ArgumentId
             // Request a longer keep alive time for the server
             KeepAlive,
             // Path of the directory designated for temporary files.
-            TempPath
+            TempPath,
+            // The priority class of the request, one of the Priority names
+            Priority,
+            // How many milliseconds the client still wanted the result when it sent the request
+            Deadline,
+            // In a prepare request, a reference the compilation reads. The argument index indicates which one (0 .. N)
+            ReferencePath,
+            // In a prepare request, a source file the compilation reads. The argument index indicates which one (0 .. N)
+            SourcePath
+        }
+
+        /// <summary>
+        /// How urgently a client needs its request compiled.  A waiting request gets a turn
+        /// before any waiting request of a later priority class.
+        /// </summary>
+        public enum Priority
+        {
+            // Someone is waiting for the result, as in a build started from the IDE
+            Interactive,
+            // The priority of requests which don't give one
+            Normal,
+            // Bulk work such as a CI build
+            Background
         }
 
         /// <summary>
@@ -448,6 +772,54 @@ public static void WriteLengthPrefixedString(BinaryWriter writer, string value)
             writer.Write(value.ToCharArray());
         }
 
+        /// <summary>
+        /// Read a string from the Reader where the string is encoded
+        /// as a length prefix (signed 32-bit integer) followed by
+        /// that many bytes of UTF-8.
+        /// </summary>
+        public static string ReadLengthPrefixedUtf8String(BinaryReader reader)
+        {
+            var length = reader.ReadInt32();
+            return Encoding.UTF8.GetString(reader.ReadBytes(length));
+        }
+
+        /// <summary>
+        /// Write a string to the Writer where the string is encoded
+        /// as a length prefix (signed 32-bit integer) followed by
+        /// that many bytes of UTF-8.
+        /// </summary>
+        public static void WriteLengthPrefixedUtf8String(BinaryWriter writer, string value)
+        {
+            var bytes = Encoding.UTF8.GetBytes(value);
+            writer.Write(bytes.Length);
+            writer.Write(bytes);
+        }
+
+        /// <summary>
+        /// Read a string encoded as strings are in the given protocol version.
+        /// </summary>
+        public static string ReadLengthPrefixedString(BinaryReader reader, uint protocolVersion)
+        {
+            return protocolVersion > Utf16ProtocolVersion
+                ? ReadLengthPrefixedUtf8String(reader)
+                : ReadLengthPrefixedString(reader);
+        }
+
+        /// <summary>
+        /// Write a string encoded as strings are in the given protocol version.
+        /// </summary>
+        public static void WriteLengthPrefixedString(BinaryWriter writer, string value, uint protocolVersion)
+        {
+            if (protocolVersion > Utf16ProtocolVersion)
+            {
+                WriteLengthPrefixedUtf8String(writer, value);
+            }
+            else
+            {
+                WriteLengthPrefixedString(writer, value);
+            }
+        }
+
         /// <summary>
         /// This task does not complete until we are completely done reading.
         /// </summary>
@@ -24,6 +24,14 @@ string LoggingIdentifier
             get;
         }
 
+        /// <summary>
+        /// The id of the client process, as the connection reports it, or 0 if it isn't known.
+        /// </summary>
+        int ClientProcessId
+        {
+            get;
+        }
+
         /// <summary>
         /// Read the <see cref="BuildRequest"/> object from the client connection.
         /// </summary>
@@ -36,9 +44,10 @@ string LoggingIdentifier
 
         /// <summary>
         /// Create a <see cref="Task"/> object which will complete if the client connection is broken
-        /// by the client.
+        /// by the client, or the client asks for its request to be cancelled.  The result is true
+        /// in the latter case.
         /// </summary>
-        Task CreateMonitorDisconnectTask(CancellationToken cancellationToken);
+        Task<bool> CreateMonitorDisconnectTask(CancellationToken cancellationToken);
 
         /// <summary>
         /// Close the underlying client connection.
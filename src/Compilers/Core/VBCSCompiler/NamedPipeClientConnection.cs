@@ -6,6 +6,7 @@
 using System.IO;
 using System.IO.Pipes;
 using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
 using System.Security.Principal;
 using System.Threading;
 using System.Threading.Tasks;
@@ -16,6 +17,13 @@ internal sealed class NamedPipeClientConnection : IClientConnection
     {
         private readonly NamedPipeServerStream _pipeStream;
 
+        // Set once the client hands over a shared memory transport, through which the rest of
+        // its requests and the response then go.
+        private SharedMemoryTransportStream _transportStream;
+
+        // The version of the last request read, in which the response is written.
+        private uint _protocolVersion = BuildProtocolConstants.Utf16ProtocolVersion;
+
         // This is a value used for logging only, do not depend on this value
         private readonly string _loggingIdentifier;
 
@@ -41,12 +49,23 @@ public string LoggingIdentifier
             get { return _loggingIdentifier; }
         }
 
+        public int ClientProcessId
+        {
+            get
+            {
+                uint processId;
+                return GetNamedPipeClientProcessId(_pipeStream.SafePipeHandle, out processId) ? (int)processId : 0;
+            }
+        }
+
         /// <summary>
         /// The IsConnected property on named pipes does not detect when the client has disconnected
         /// if we don't attempt any new I/O after the client disconnects. We start an async I/O here
-        /// which serves to check the pipe for disconnection. 
+        /// which serves to check the pipe for disconnection. While the client waits for the response
+        /// it writes nothing but a cancel frame, and with the shared memory transport the odd late
+        /// doorbell, so that is all the pipe is checked for.
         ///
-        /// This will return true if the pipe was disconnected.
+        /// This will return true if the client asked to cancel its request.
         /// </summary>
         private async Task<bool> CreateMonitorDisconnectTaskCore(CancellationToken cancellationToken)
         {
@@ -54,6 +73,12 @@ private async Task<bool> CreateMonitorDisconnectTaskCore(CancellationToken cance
 
             while (!cancellationToken.IsCancellationRequested && _pipeStream.IsConnected)
             {
+                if (await IsCancelRequested(cancellationToken).ConfigureAwait(false))
+                {
+                    CompilerServerLogger.Log("Pipe {0}: Client asked to cancel.", _loggingIdentifier);
+                    return true;
+                }
+
                 // Wait a tenth of a second before trying again
                 await Task.Delay(100, cancellationToken).ConfigureAwait(false);
 
@@ -73,9 +98,84 @@ private async Task<bool> CreateMonitorDisconnectTaskCore(CancellationToken cance
                 }
             }
 
-            return !_pipeStream.IsConnected;
+            return false;
+        }
+
+        /// <summary>
+        /// Read a cancel frame from the pipe, if the client has written one.  Bytes in front of it,
+        /// such as a doorbell the client rang just as the server found the request, are skipped.
+        /// </summary>
+        private async Task<bool> IsCancelRequested(CancellationToken cancellationToken)
+        {
+            var cancelFrame = new byte[BuildProtocolConstants.CancelFrameSize];
+            BitConverter.GetBytes(sizeof(int)).CopyTo(cancelFrame, 0);
+            BitConverter.GetBytes(BuildProtocolConstants.CancelRequest).CopyTo(cancelFrame, sizeof(int));
+
+            var peeked = new byte[4 * BuildProtocolConstants.CancelFrameSize];
+            uint bytesRead;
+            uint bytesAvailable;
+            if (!PeekNamedPipe(_pipeStream.SafePipeHandle, peeked, (uint)peeked.Length, out bytesRead, out bytesAvailable, IntPtr.Zero)
+                || bytesRead == 0)
+            {
+                return false;
+            }
+
+            // A frame which is only partly written yet is left for the next look.
+            var skipped = 0;
+            while (skipped < bytesRead && !StartsWithPartOf(peeked, skipped, (int)bytesRead, cancelFrame))
+            {
+                skipped++;
+            }
+
+            var isCancel = bytesRead - skipped >= cancelFrame.Length;
+            var read = new byte[skipped + (isCancel ? cancelFrame.Length : 0)];
+            if (read.Length == 0)
+            {
+                return false;
+            }
+
+            try
+            {
+                await BuildProtocolConstants.ReadAllAsync(_pipeStream, read, read.Length, cancellationToken).ConfigureAwait(false);
+            }
+            catch (Exception e)
+            {
+                var msg = string.Format("Pipe {0}: Error reading cancel frame.", _loggingIdentifier);
+                CompilerServerLogger.LogException(e, msg);
+                return false;
+            }
+
+            return isCancel;
+        }
+
+        /// <summary>
+        /// Do the bytes from the offset up to the count match the start of the frame?
+        /// </summary>
+        private static bool StartsWithPartOf(byte[] bytes, int offset, int count, byte[] frame)
+        {
+            for (int i = 0; offset + i < count && i < frame.Length; i++)
+            {
+                if (bytes[offset + i] != frame[i])
+                {
+                    return false;
+                }
+            }
+
+            return true;
         }
 
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool PeekNamedPipe(
+            SafeHandle pipe,
+            byte[] buffer,
+            uint bufferSize,
+            out uint bytesRead,
+            out uint totalBytesAvailable,
+            IntPtr bytesLeftThisMessage);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool GetNamedPipeClientProcessId(SafeHandle pipe, out uint clientProcessId);
+
         /// <summary>
         /// Does the client of "pipeStream" have the same identity and elevation as we do?
         /// </summary>
@@ -118,6 +218,10 @@ public void Close()
             CompilerServerLogger.Log("Pipe {0}: Closing.", _loggingIdentifier);
             try
             {
+                if (_transportStream != null)
+                {
+                    _transportStream.Dispose();
+                }
                 _pipeStream.Close();
             }
             catch (Exception e)
@@ -130,25 +234,50 @@ public void Close()
             }
         }
 
-        public Task CreateMonitorDisconnectTask(CancellationToken cancellationToken)
+        public Task<bool> CreateMonitorDisconnectTask(CancellationToken cancellationToken)
         {
             return CreateMonitorDisconnectTaskCore(cancellationToken);
         }
 
         public async Task<BuildRequest> ReadBuildRequest(CancellationToken cancellationToken)
         {
-            var buildRequest = await BuildRequest.ReadAsync(_pipeStream, cancellationToken).ConfigureAwait(false);
+            var frame = await BuildRequest.ReadFrameAsync(MessageStream, cancellationToken).ConfigureAwait(false);
+
+            // The client can only be impersonated once something has been read from the pipe, and
+            // nothing it sent may be acted on before then.
             if (!ClientAndOurIdentitiesMatch())
             {
                 throw new Exception("Client identity does not match server identity.");
             }
 
+            if (_transportStream == null && SharedMemoryTransportStream.IsTransportFrame(frame))
+            {
+                CompilerServerLogger.Log("Pipe {0}: Client offered a shared memory transport.", _loggingIdentifier);
+                _transportStream = SharedMemoryTransportStream.Adopt(frame, _pipeStream, ClientProcessId);
+                frame = await BuildRequest.ReadFrameAsync(_transportStream, cancellationToken).ConfigureAwait(false);
+            }
+
+            var buildRequest = frame == null ? null : BuildRequest.Parse(frame, cancellationToken);
+
+            if (buildRequest != null)
+            {
+                _protocolVersion = buildRequest.ProtocolVersion;
+            }
+
             return buildRequest;
         }
 
         public Task WriteBuildResponse(BuildResponse response, CancellationToken cancellationToken)
         {
-            return response.WriteAsync(_pipeStream, cancellationToken);
+            return response.WriteAsync(MessageStream, _protocolVersion, cancellationToken);
+        }
+
+        /// <summary>
+        /// The stream requests are read from and the response written to.
+        /// </summary>
+        private Stream MessageStream
+        {
+            get { return _transportStream != null ? (Stream)_transportStream : _pipeStream; }
         }
     }
 }
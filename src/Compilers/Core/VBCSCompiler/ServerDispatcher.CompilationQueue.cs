@@ -0,0 +1,199 @@
+﻿// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+
+using System;
+using System.Collections.Generic;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace Microsoft.CodeAnalysis.CompilerServer
+{
+    internal partial class ServerDispatcher
+    {
+        /// <summary>
+        /// Limits how many compilations the server runs at once.  Requests beyond the limit wait
+        /// in line for a turn, and once the line is full further requests are declined with a
+        /// <see cref="BusyBuildResponse"/> so that the client can go elsewhere instead of waiting
+        /// behind the backlog.
+        /// 
+        /// Waiting requests get their turn in order of <see cref="BuildProtocolConstants.Priority"/>
+        /// and then of arrival.  Interactive requests may fill the line to twice its usual length
+        /// before they are declined.
+        /// </summary>
+        internal sealed class CompilationQueue
+        {
+            /// <summary>
+            /// A request waiting for its turn.  Whichever of the turn or a cancellation claims it
+            /// first, under the guard, completes it.
+            /// </summary>
+            private sealed class Waiter
+            {
+                public readonly TaskCompletionSource<bool> Turn = new TaskCompletionSource<bool>();
+                public bool Claimed;
+                public CancellationTokenRegistration Cancellation;
+            }
+
+            private readonly int _maxConcurrent;
+            private readonly int _maxQueued;
+            private readonly object _guard = new object();
+
+            /// <summary>
+            /// The waiting requests, one line per priority.  Guarded by <see cref="_guard"/>.
+            /// </summary>
+            private readonly Queue<Waiter>[] _lines;
+
+            /// <summary>
+            /// The number of requests compiling.  Guarded by <see cref="_guard"/>.
+            /// </summary>
+            private int _running;
+
+            private int _queued;
+
+            /// <summary>
+            /// Moving average of how long a compilation takes, in ticks.
+            /// </summary>
+            private long _averageCompilationTicks = TimeSpan.FromSeconds(1).Ticks;
+
+            public CompilationQueue(int maxConcurrent, int maxQueued)
+            {
+                _maxConcurrent = maxConcurrent;
+                _maxQueued = maxQueued;
+                _lines = new Queue<Waiter>[(int)BuildProtocolConstants.Priority.Background + 1];
+                for (int i = 0; i < _lines.Length; i++)
+                {
+                    _lines[i] = new Queue<Waiter>();
+                }
+            }
+
+            /// <summary>
+            /// The default allows a compilation per processor with as many again waiting.
+            /// </summary>
+            public static CompilationQueue CreateDefault()
+            {
+                return new CompilationQueue(Environment.ProcessorCount, Environment.ProcessorCount);
+            }
+
+            /// <summary>
+            /// The number of requests waiting for a turn.
+            /// </summary>
+            public int QueueDepth
+            {
+                get { return Volatile.Read(ref _queued); }
+            }
+
+            /// <summary>
+            /// Get in line for a turn.  Returns false, without getting in line, if the line is
+            /// full.  Every successful call must be followed by <see cref="WaitForTurnAsync"/>.
+            /// </summary>
+            public bool TryEnqueue(BuildProtocolConstants.Priority priority = BuildProtocolConstants.Priority.Normal)
+            {
+                var maxQueued = priority == BuildProtocolConstants.Priority.Interactive ? 2 * _maxQueued : _maxQueued;
+                lock (_guard)
+                {
+                    if (_queued >= maxQueued && _running >= _maxConcurrent)
+                    {
+                        return false;
+                    }
+
+                    _queued++;
+                    return true;
+                }
+            }
+
+            /// <summary>
+            /// Wait until a compilation may start.  Every successful wait must be followed by
+            /// <see cref="Leave"/>.
+            /// </summary>
+            public Task WaitForTurnAsync(BuildProtocolConstants.Priority priority, CancellationToken cancellationToken)
+            {
+                var waiter = new Waiter();
+                lock (_guard)
+                {
+                    if (_running < _maxConcurrent)
+                    {
+                        _running++;
+                        _queued--;
+                        return Task.FromResult(true);
+                    }
+
+                    _lines[(int)priority].Enqueue(waiter);
+
+                    // A request abandoned while waiting is skipped when its turn comes.  The
+                    // registration is made under the guard, which the callback can take again if
+                    // it runs right away, so that the turn always finds it to dispose of.
+                    waiter.Cancellation = cancellationToken.Register(() =>
+                    {
+                        lock (_guard)
+                        {
+                            if (waiter.Claimed)
+                            {
+                                return;
+                            }
+
+                            waiter.Claimed = true;
+                            _queued--;
+                        }
+
+                        waiter.Turn.SetCanceled();
+                    });
+                }
+
+                return waiter.Turn.Task;
+            }
+
+            /// <summary>
+            /// End a turn which lasted the given time, and hand it to the next waiting request.
+            /// </summary>
+            public void Leave(TimeSpan duration)
+            {
+                // Weigh the newest compilation at one eighth.  Races between threads at worst
+                // lose a sample.
+                var average = Volatile.Read(ref _averageCompilationTicks);
+                Volatile.Write(ref _averageCompilationTicks, average + ((duration.Ticks - average) / 8));
+
+                Waiter next = null;
+                lock (_guard)
+                {
+                    foreach (var line in _lines)
+                    {
+                        while (next == null && line.Count > 0)
+                        {
+                            var waiter = line.Dequeue();
+                            if (!waiter.Claimed)
+                            {
+                                next = waiter;
+                            }
+                        }
+                    }
+
+                    if (next == null)
+                    {
+                        _running--;
+                        return;
+                    }
+
+                    next.Claimed = true;
+                    _queued--;
+                }
+
+                // The token may outlive the request by far.  Disposing waits for a callback which
+                // is running, so it must be done outside of the lock.
+                next.Cancellation.Dispose();
+
+                // Completing the turn runs the waiting compilation's continuation, so do it outside
+                // of the lock and off this thread.
+                Task.Run(() => next.Turn.SetResult(true));
+            }
+
+            /// <summary>
+            /// Decline a request, estimating how long it would have waited.
+            /// </summary>
+            public BusyBuildResponse CreateBusyResponse()
+            {
+                var queueDepth = QueueDepth;
+                var average = TimeSpan.FromTicks(Volatile.Read(ref _averageCompilationTicks));
+                var retryAfter = TimeSpan.FromTicks(average.Ticks * (1 + (queueDepth / _maxConcurrent)));
+                return new BusyBuildResponse((int)Math.Min(retryAfter.TotalMilliseconds, int.MaxValue), queueDepth);
+            }
+        }
+    }
+}
@@ -2,6 +2,7 @@
 
 using Roslyn.Utilities;
 using System;
+using System.Collections.Generic;
 using System.Diagnostics;
 using System.IO;
 using System.IO.Pipes;
@@ -17,8 +18,8 @@ internal partial class ServerDispatcher
         internal enum CompletionReason
         {
             /// <summary>
-            /// There was an error creating the <see cref="BuildRequest"/> object and a compilation was never 
-            /// created.
+            /// There was an error creating the <see cref="BuildRequest"/> object, or the server was too busy
+            /// to take the request, and a compilation was never created.
             /// </summary>
             CompilationNotStarted,
 
@@ -32,6 +33,18 @@ internal enum CompletionReason
             /// the results could be provided to them.  
             /// </summary>
             ClientDisconnect,
+
+            /// <summary>
+            /// The compilation process was initiated and the client asked for it to be cancelled,
+            /// as when the user presses Ctrl+C, before the results could be provided to them.
+            /// </summary>
+            ClientCancel,
+
+            /// <summary>
+            /// The deadline the client gave the request passed before the results could be
+            /// provided to them, and the compilation was abandoned.
+            /// </summary>
+            DeadlineExpired,
         }
 
         /// <summary>
@@ -43,13 +56,15 @@ internal class Connection
         {
             private readonly IClientConnection _clientConnection;
             private readonly IRequestHandler _handler;
+            private readonly CompilationQueue _compilationQueue;
             private readonly string _loggingIdentifier;
 
-            public Connection(IClientConnection clientConnection, IRequestHandler handler)
+            public Connection(IClientConnection clientConnection, IRequestHandler handler, CompilationQueue compilationQueue = null)
             {
                 _clientConnection = clientConnection;
                 _loggingIdentifier = clientConnection.LoggingIdentifier;
                 _handler = handler;
+                _compilationQueue = compilationQueue;
             }
 
             public async Task<CompletionReason> ServeConnection(TaskCompletionSource<TimeSpan?> timeoutCompletionSource = null, CancellationToken cancellationToken = default(CancellationToken))
@@ -62,6 +77,14 @@ public async Task<CompletionReason> ServeConnection(TaskCompletionSource<TimeSpa
                     {
                         Log("Begin reading request.");
                         request = await _clientConnection.ReadBuildRequest(cancellationToken).ConfigureAwait(false);
+
+                        // The client may first say which files the compilation reads, so that they load
+                        // while the client finishes the request and the request waits its turn.
+                        if (request.Language == BuildProtocolConstants.RequestLanguage.Prepare)
+                        {
+                            StartPrefetch(request, cancellationToken);
+                            request = await _clientConnection.ReadBuildRequest(cancellationToken).ConfigureAwait(false);
+                        }
                         Log("End reading request.");
                     }
                     catch (Exception e)
@@ -72,18 +95,46 @@ public async Task<CompletionReason> ServeConnection(TaskCompletionSource<TimeSpa
 
                     CheckForNewKeepAlive(request, timeoutCompletionSource);
 
-                    // Kick off both the compilation and a task to monitor the pipe for closing.  
+                    // When the line of waiting compilations is full, decline the request rather than
+                    // make the client wait behind the backlog.
+                    var priority = GetPriority(request);
+                    if (_compilationQueue != null && !_compilationQueue.TryEnqueue(priority))
+                    {
+                        var busyResponse = _compilationQueue.CreateBusyResponse();
+                        Log(string.Format("Declining request with {0} requests queued.", busyResponse.QueueDepth));
+                        try
+                        {
+                            await _clientConnection.WriteBuildResponse(busyResponse, cancellationToken).ConfigureAwait(false);
+                        }
+                        catch (Exception e)
+                        {
+                            LogException(e, "Error writing busy response.");
+                        }
+
+                        return CompletionReason.CompilationNotStarted;
+                    }
+
+                    // Kick off both the compilation and a task to monitor the pipe for closing.  A
+                    // request past its deadline is abandoned, waiting or compiling.
                     var buildCts = CancellationTokenSource.CreateLinkedTokenSource(cancellationToken);
-                    var compilationTask = ServeBuildRequest(request, buildCts.Token);
+                    var deadline = GetDeadline(request);
+                    if (deadline.HasValue)
+                    {
+                        buildCts.CancelAfter(deadline.Value);
+                    }
+
+                    var compilationTask = ServeBuildRequest(request, priority, buildCts.Token);
                     var monitorTask = _clientConnection.CreateMonitorDisconnectTask(buildCts.Token);
                     await Task.WhenAny(compilationTask, monitorTask).ConfigureAwait(false);
 
                     // Do an 'await' on the completed task, preference being compilation, to force
-                    // any exceptions to be realized in this method for logging.  
+                    // any exceptions to be realized in this method for logging.  Only the deadline
+                    // cancels the build before this method does, unless the server is shutting down.
+                    var deadlinePassed = buildCts.IsCancellationRequested && !cancellationToken.IsCancellationRequested;
                     CompletionReason reason;
-                    if (compilationTask.IsCompleted)
+                    if (compilationTask.Status == TaskStatus.RanToCompletion || (compilationTask.IsCompleted && !deadlinePassed))
                     {
-                        var response = await compilationTask.ConfigureAwait(false);
+                        var response = MoveOutputToSharedMemory(await compilationTask.ConfigureAwait(false), request);
 
                         try
                         {
@@ -97,14 +148,38 @@ public async Task<CompletionReason> ServeConnection(TaskCompletionSource<TimeSpa
                             reason = CompletionReason.ClientDisconnect;
                         }
                     }
+                    else if (deadlinePassed)
+                    {
+                        Log("Abandoning the request, its deadline passed.");
+                        reason = CompletionReason.DeadlineExpired;
+                    }
+                    else if (await monitorTask.ConfigureAwait(false))
+                    {
+                        Log("Client cancelled the request.");
+                        reason = CompletionReason.ClientCancel;
+                    }
                     else
                     {
-                        await monitorTask.ConfigureAwait(false);
                         reason = CompletionReason.ClientDisconnect;
                     }
 
                     // Begin the tear down of the Task which didn't complete. 
                     buildCts.Cancel();
+
+                    // A client which cancels may go on to write the outputs itself, so the pipe
+                    // stays open until the compiler has stopped writing them.  Closing it is how
+                    // the client learns that it has.
+                    if (reason == CompletionReason.ClientCancel)
+                    {
+                        try
+                        {
+                            await compilationTask.ConfigureAwait(false);
+                        }
+                        catch (OperationCanceledException)
+                        {
+                        }
+                    }
+
                     return reason;
                 }
                 finally
@@ -117,6 +192,48 @@ public async Task<CompletionReason> ServeConnection(TaskCompletionSource<TimeSpa
                 }
             }
 
+            /// <summary>
+            /// Load the references named in a prepare request into the metadata cache and read its
+            /// source files, which leaves them in the file system cache for the compilation.
+            /// </summary>
+            private void StartPrefetch(BuildRequest prepareRequest, CancellationToken cancellationToken)
+            {
+                var references = new List<string>();
+                var sources = new List<string>();
+                foreach (var arg in prepareRequest.Arguments)
+                {
+                    if (arg.ArgumentId == BuildProtocolConstants.ArgumentId.ReferencePath)
+                    {
+                        references.Add(arg.Value);
+                    }
+                    else if (arg.ArgumentId == BuildProtocolConstants.ArgumentId.SourcePath)
+                    {
+                        sources.Add(arg.Value);
+                    }
+                }
+
+                Log(string.Format("Prefetching {0} references and {1} source files.", references.Count, sources.Count));
+                Task.Run(() =>
+                {
+                    WarmupProfile.PreloadReferences(references, cancellationToken);
+                    foreach (var source in sources)
+                    {
+                        cancellationToken.ThrowIfCancellationRequested();
+                        try
+                        {
+                            if (PathUtilities.IsAbsolute(source))
+                            {
+                                File.ReadAllBytes(source);
+                            }
+                        }
+                        catch (Exception e) when (e is IOException || e is UnauthorizedAccessException)
+                        {
+                            // The compilation reports the file it can't read.
+                        }
+                    }
+                }, cancellationToken);
+            }
+
             /// <summary>
             /// Check the request arguments for a new keep alive time. If one is present,
             /// set the server timer to the new time.
@@ -143,7 +260,102 @@ private void CheckForNewKeepAlive(BuildRequest request, TaskCompletionSource<Tim
                 timeoutCompletionSource.SetResult(timeout);
             }
 
-            private Task<BuildResponse> ServeBuildRequest(BuildRequest request, CancellationToken cancellationToken)
+            /// <summary>
+            /// Get the priority class the client gave the request.  Requests without one, or with
+            /// one this server doesn't know, have normal priority.
+            /// </summary>
+            private static BuildProtocolConstants.Priority GetPriority(BuildRequest request)
+            {
+                var priority = BuildProtocolConstants.Priority.Normal;
+                foreach (var arg in request.Arguments)
+                {
+                    BuildProtocolConstants.Priority value;
+                    if (arg.ArgumentId == BuildProtocolConstants.ArgumentId.Priority
+                        && Enum.TryParse(arg.Value, ignoreCase: true, result: out value)
+                        && Enum.IsDefined(typeof(BuildProtocolConstants.Priority), value))
+                    {
+                        priority = value;
+                    }
+                }
+
+                return priority;
+            }
+
+            /// <summary>
+            /// Get how long the client still wants the result of the request, if it said.
+            /// </summary>
+            private static TimeSpan? GetDeadline(BuildRequest request)
+            {
+                TimeSpan? deadline = null;
+                foreach (var arg in request.Arguments)
+                {
+                    int result;
+                    if (arg.ArgumentId == BuildProtocolConstants.ArgumentId.Deadline
+                        && int.TryParse(arg.Value, out result)
+                        && result > 0)
+                    {
+                        deadline = TimeSpan.FromMilliseconds(result);
+                    }
+                }
+
+                return deadline;
+            }
+
+            /// <summary>
+            /// Hand large output to the client in shared memory rather than send it through the pipe,
+            /// if the client's request was in a protocol version which allows it.  The client process
+            /// is the one at the other end of the pipe, as the pipe reports it.  Small responses, and
+            /// responses whose output can't be handed over, are sent as they are.
+            /// </summary>
+            private BuildResponse MoveOutputToSharedMemory(BuildResponse response, BuildRequest request)
+            {
+                var completedResponse = response as CompletedBuildResponse;
+                if (completedResponse == null
+                    || request.ProtocolVersion < BuildProtocolConstants.ProtocolVersion
+                    || (long)completedResponse.Output.Length + completedResponse.ErrorOutput.Length < BuildProtocolConstants.SharedMemoryOutputThreshold)
+                {
+                    return response;
+                }
+
+                var processId = _clientConnection.ClientProcessId;
+                if (processId == 0)
+                {
+                    return response;
+                }
+
+                var sharedResponse = SharedMemoryCompletedBuildResponse.TryCreate(completedResponse, processId);
+                if (sharedResponse == null)
+                {
+                    Log("Could not hand the output to the client in shared memory.");
+                    return response;
+                }
+
+                Log(string.Format("Handing {0} characters of output to the client in shared memory.",
+                    sharedResponse.OutputLength + sharedResponse.ErrorOutputLength));
+                return sharedResponse;
+            }
+
+            private async Task<BuildResponse> ServeBuildRequest(BuildRequest request, BuildProtocolConstants.Priority priority, CancellationToken cancellationToken)
+            {
+                if (_compilationQueue == null)
+                {
+                    return await RunBuildRequest(request, cancellationToken).ConfigureAwait(false);
+                }
+
+                Log(string.Format("Waiting for a turn to compile at {0} priority", priority));
+                await _compilationQueue.WaitForTurnAsync(priority, cancellationToken).ConfigureAwait(false);
+                var stopwatch = Stopwatch.StartNew();
+                try
+                {
+                    return await RunBuildRequest(request, cancellationToken).ConfigureAwait(false);
+                }
+                finally
+                {
+                    _compilationQueue.Leave(stopwatch.Elapsed);
+                }
+            }
+
+            private Task<BuildResponse> RunBuildRequest(BuildRequest request, CancellationToken cancellationToken)
             {
                 return Task.Run(() =>
                 {
@@ -155,7 +367,7 @@ private Task<BuildResponse> ServeBuildRequest(BuildRequest request, Cancellation
                         Log("End compilation");
                         return response;
                     }
-                    catch (Exception e) when (FatalError.Report(e))
+                    catch (Exception e) when (FatalError.ReportUnlessCanceled(e))
                     {
                         throw ExceptionUtilities.Unreachable;
                     }
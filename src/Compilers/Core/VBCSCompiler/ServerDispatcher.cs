@@ -5,15 +5,19 @@
 using System.Configuration;
 using System.Diagnostics;
 using System.IO;
+using System.IO.MemoryMappedFiles;
 using System.IO.Pipes;
 using System.Linq;
 using System.Security.AccessControl;
 using System.Security.Principal;
 using System.Threading;
 using System.Threading.Tasks;
+using Microsoft.Win32.SafeHandles;
 using Roslyn.Utilities;
 using System.Globalization;
 using System.Reflection;
+using System.Runtime.InteropServices;
+using System.Text;
 
 namespace Microsoft.CodeAnalysis.CompilerServer
 {
@@ -104,7 +108,15 @@ public static int Main(string[] args)
             // VBCSCompiler is installed in the same directory as csc.exe and vbc.exe which is also the 
             // location of the response files.
             var responseFileDirectory = CommonCompiler.GetResponseFileDirectory();
-            var dispatcher = new ServerDispatcher(new CompilerRequestHandler(responseFileDirectory), new EmptyDiagnosticListener());
+            var dispatcher = new ServerDispatcher(new CompilerRequestHandler(responseFileDirectory), new EmptyDiagnosticListener(), CompilationQueue.CreateDefault());
+
+            // The client which started the server may have handed it a profile of what to load
+            // before the first request arrives.
+            var warmupProfilePath = WarmupProfile.GetProfilePath(args);
+            if (warmupProfilePath != null)
+            {
+                WarmupProfile.Start(warmupProfilePath);
+            }
 
             // Add the process ID onto the pipe name so each process gets a semi-unique and predictable pipe 
             // name.  The client must use this algorithm too to connect.
@@ -117,18 +129,37 @@ public static int Main(string[] args)
         // Size of the buffers to use
         private const int PipeBufferSize = 0x10000;  // 64K
 
+        // The most pipe instances a client creates for a server it starts, and the size of the
+        // mapping through which it hands them over.  These must match the client.
+        private const int MaxPreCreatedPipes = 4;
+        private const int ListenerMappingSize = (2 + MaxPreCreatedPipes) * sizeof(long);
+
+        private const uint FILE_TYPE_PIPE = 0x0003;
+        private const uint PIPE_SERVER_END = 0x0001;
+        private const uint FILE_MAP_READ = 0x0004;
+        private const int FileNameInfo = 2;
+
         private readonly IRequestHandler _handler;
         private readonly IDiagnosticListener _diagnosticListener;
+        private readonly CompilationQueue _compilationQueue;
+
+        /// <summary>
+        /// Pipe instances created on behalf of this server by the client which started it.  They
+        /// are listened on before any new instance is constructed.
+        /// </summary>
+        private readonly Queue<NamedPipeServerStream> _adoptedPipes = new Queue<NamedPipeServerStream>();
 
         /// <summary>
         /// Create a new server that listens on the given base pipe name.
         /// When a request comes in, it is dispatched on a separate thread
-        /// via the IRequestHandler interface passed in.
+        /// via the IRequestHandler interface passed in.  Without a compilation
+        /// queue every request is compiled at once.
         /// </summary>
-        public ServerDispatcher(IRequestHandler handler, IDiagnosticListener diagnosticListener)
+        public ServerDispatcher(IRequestHandler handler, IDiagnosticListener diagnosticListener, CompilationQueue compilationQueue = null)
         {
             _handler = handler;
             _diagnosticListener = diagnosticListener;
+            _compilationQueue = compilationQueue;
         }
 
         /// <summary>
@@ -154,11 +185,17 @@ public void ListenAndDispatchConnections(string pipeName, TimeSpan? keepAlive, b
             Task timeoutTask = null;
             Task<NamedPipeServerStream> listenTask = null;
             CancellationTokenSource listenCancellationTokenSource = null;
+            var signaledReady = false;
 
             // If we aren't being asked to watch analyzer files then simple create a Task which never 
             // completes.  This is the behavior of AnalyzerWatcher when files don't change on disk.
             Task analyzerTask = watchAnalyzerFiles ? AnalyzerWatcher.CreateWatchFilesTask() : new TaskCompletionSource<bool>().Task;
 
+            AdoptListeningPipes(pipeName);
+            var transportEvent = Advertise(pipeName + BuildProtocolConstants.SharedMemoryTransportSuffix);
+            var protocolVersionEvent = Advertise(pipeName + BuildProtocolConstants.ProtocolVersionSuffix);
+            var prepareRequestEvent = Advertise(pipeName + BuildProtocolConstants.PrepareRequestSuffix);
+
             do
             {
                 // While this loop is running there should be an active named pipe listening for a 
@@ -169,6 +206,14 @@ public void ListenAndDispatchConnections(string pipeName, TimeSpan? keepAlive, b
                     Debug.Assert(timeoutTask == null);
                     listenCancellationTokenSource = new CancellationTokenSource();
                     listenTask = CreateListenTask(pipeName, listenCancellationTokenSource.Token);
+
+                    // The pipe instance is constructed before CreateListenTask first yields, so a
+                    // client waiting for this server to start can connect as soon as it's told.
+                    if (!signaledReady && !listenTask.IsFaulted)
+                    {
+                        signaledReady = true;
+                        SignalServerReady(pipeName);
+                    }
                 }
 
                 // If there are no active clients running then the server needs to be in a timeout mode.
@@ -223,6 +268,21 @@ public void ListenAndDispatchConnections(string pipeName, TimeSpan? keepAlive, b
                 }
             } while (true);
 
+            if (transportEvent != null)
+            {
+                transportEvent.Dispose();
+            }
+
+            if (protocolVersionEvent != null)
+            {
+                protocolVersionEvent.Dispose();
+            }
+
+            if (prepareRequestEvent != null)
+            {
+                prepareRequestEvent.Dispose();
+            }
+
             try
             {
                 Task.WaitAll(connectionList.Select(x => x.ConnectionTask).ToArray());
@@ -277,6 +337,8 @@ private bool CheckConnectionTask(List<ConnectionData> connectionList, ref TimeSp
                 {
                     Debug.Assert(current.ChangeKeepAliveTask == null);
 
+                    // A client which cancelled said why it went away, so unlike a disconnection
+                    // it is no reason to shut down.
                     if (current.ConnectionTask.Result == CompletionReason.ClientDisconnect)
                     {
                         allFine = false;
@@ -314,6 +376,147 @@ private void ChangeKeepAlive(Task<TimeSpan?> task, ref TimeSpan? keepAlive, ref
             }
         }
 
+        /// <summary>
+        /// The client which started this server may have created the first instances of its pipe
+        /// so that clients can connect and send requests while the server is still starting.  Take
+        /// ownership of those instances.
+        ///
+        /// The mapping names them by their handles in this process, so it is only believed if this
+        /// user created it, and a handle is only taken over if it is the server end of this pipe.
+        /// </summary>
+        private void AdoptListeningPipes(string pipeName)
+        {
+            MemoryMappedFile mapping;
+            try
+            {
+                mapping = MemoryMappedFile.OpenExisting(
+                    pipeName + BuildProtocolConstants.ListenerMappingSuffix,
+                    MemoryMappedFileRights.Read | MemoryMappedFileRights.ReadPermissions);
+            }
+            catch (FileNotFoundException)
+            {
+                return;
+            }
+
+            try
+            {
+                using (mapping)
+                using (var view = mapping.CreateViewAccessor(0, ListenerMappingSize, MemoryMappedFileAccess.Read))
+                {
+                    var owner = mapping.GetAccessControl().GetOwner(typeof(SecurityIdentifier));
+                    if (!WindowsIdentity.GetCurrent().Owner.Equals(owner))
+                    {
+                        CompilerServerLogger.Log("Ignoring pipe instances in a mapping owned by {0}.", owner);
+                        return;
+                    }
+
+                    // The client duplicated its handle to the mapping into this process to keep the
+                    // mapping alive until now.  It isn't needed any more.
+                    var mappingHandle = new IntPtr(view.ReadInt64(0));
+                    if (IsListenerMapping(mappingHandle))
+                    {
+                        CloseHandle(mappingHandle);
+                    }
+
+                    var count = Math.Min(view.ReadInt64(8), MaxPreCreatedPipes);
+                    for (long i = 0; i < count; i++)
+                    {
+                        var pipeHandle = new IntPtr(view.ReadInt64(16 + (i * 8)));
+                        if (!IsListeningPipe(pipeHandle, pipeName))
+                        {
+                            CompilerServerLogger.Log("Ignoring a handle which isn't an instance of pipe '{0}'.", pipeName);
+                            continue;
+                        }
+
+                        var handle = new SafePipeHandle(pipeHandle, ownsHandle: true);
+                        _adoptedPipes.Enqueue(new NamedPipeServerStream(PipeDirection.InOut, isAsync: true, isConnected: false, safePipeHandle: handle));
+                    }
+                }
+
+                CompilerServerLogger.Log("Adopted {0} pipe instances created by the client.", _adoptedPipes.Count);
+            }
+            catch (Exception e)
+            {
+                CompilerServerLogger.LogException(e, "Could not adopt pipe instances created by the client");
+            }
+        }
+
+        /// <summary>
+        /// Is the handle a section which starts with its own value, as the listener mapping does?
+        /// </summary>
+        private static bool IsListenerMapping(IntPtr handle)
+        {
+            var view = MapViewOfFile(handle, FILE_MAP_READ, 0, 0, new UIntPtr(sizeof(long)));
+            if (view == IntPtr.Zero)
+            {
+                return false;
+            }
+
+            var matches = Marshal.ReadInt64(view) == handle.ToInt64();
+            UnmapViewOfFile(view);
+            return matches;
+        }
+
+        /// <summary>
+        /// Is the handle the server end of an instance of the named pipe?
+        /// </summary>
+        private static bool IsListeningPipe(IntPtr handle, string pipeName)
+        {
+            uint flags;
+            if (GetFileType(handle) != FILE_TYPE_PIPE
+                || !GetNamedPipeInfo(handle, out flags, IntPtr.Zero, IntPtr.Zero, IntPtr.Zero)
+                || (flags & PIPE_SERVER_END) == 0)
+            {
+                return false;
+            }
+
+            // The name comes back as a length in bytes followed by the path within the pipe file
+            // system, without a terminating null.
+            var buffer = new byte[sizeof(int) + 2 * (pipeName.Length + 2)];
+            if (!GetFileInformationByHandleEx(handle, FileNameInfo, buffer, (uint)buffer.Length))
+            {
+                return false;
+            }
+
+            var name = Encoding.Unicode.GetString(buffer, sizeof(int), Math.Min(BitConverter.ToInt32(buffer, 0), buffer.Length - sizeof(int)));
+            return StringComparer.OrdinalIgnoreCase.Equals(name, "\\" + pipeName);
+        }
+
+        /// <summary>
+        /// Tell clients that this server supports something older servers don't, such as the
+        /// shared memory transport or the latest protocol version.  Clients only make use of it
+        /// once they find the event, which lives as long as the server accepts connections.
+        /// </summary>
+        private static EventWaitHandle Advertise(string eventName)
+        {
+            try
+            {
+                return new EventWaitHandle(false, EventResetMode.ManualReset, eventName);
+            }
+            catch (Exception e)
+            {
+                CompilerServerLogger.LogException(e, "Could not create the event " + eventName);
+                return null;
+            }
+        }
+
+        /// <summary>
+        /// Signal the client which started this server, if any, that the server is listening for
+        /// connections.  The client creates the event before the server process starts running.
+        /// </summary>
+        private static void SignalServerReady(string pipeName)
+        {
+            EventWaitHandle readyEvent;
+            if (EventWaitHandle.TryOpenExisting(pipeName + BuildProtocolConstants.ServerReadyEventSuffix, EventWaitHandleRights.Modify, out readyEvent))
+            {
+                using (readyEvent)
+                {
+                    CompilerServerLogger.Log("Signaling server ready event");
+                    readyEvent.Set();
+                }
+            }
+        }
+
         /// <summary>
         /// Creates a Task that waits for a client connection to occur and returns the connected 
         /// <see cref="NamedPipeServerStream"/> object.  Throws on any connection error.
@@ -327,7 +530,7 @@ private async Task<NamedPipeServerStream> CreateListenTask(string pipeName, Canc
             // as Windows refusing to create the pipe for some reason 
             // (out of handles?), or the pipe was disconnected before we 
             // starting listening.
-            NamedPipeServerStream pipeStream = ConstructPipe(pipeName);
+            NamedPipeServerStream pipeStream = _adoptedPipes.Count > 0 ? _adoptedPipes.Dequeue() : ConstructPipe(pipeName);
 
             // Unfortunately the version of .Net we are using doesn't support the WaitForConnectionAsync
             // method.  When it is available it should absolutely be used here.  In the meantime we
@@ -404,7 +607,7 @@ private async Task<CompletionReason> CreateHandleConnectionTask(Task<NamedPipeSe
         {
             var pipeStream = await pipeStreamTask.ConfigureAwait(false);
             var clientConnection = new NamedPipeClientConnection(pipeStream);
-            var connection = new Connection(clientConnection, _handler);
+            var connection = new Connection(clientConnection, _handler, _compilationQueue);
             return await connection.ServeConnection(changeKeepAliveSource, cancellationToken).ConfigureAwait(false);
         }
 
@@ -440,5 +643,37 @@ private NamedPipeServerStream ConstructPipe(string pipeName)
 
             return pipeStream;
         }
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern uint GetFileType(IntPtr file);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool GetNamedPipeInfo(
+            IntPtr pipe,
+            out uint flags,
+            IntPtr outBufferSize,
+            IntPtr inBufferSize,
+            IntPtr maxInstances);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool GetFileInformationByHandleEx(
+            IntPtr file,
+            int fileInformationClass,
+            byte[] fileInformation,
+            uint bufferSize);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern IntPtr MapViewOfFile(
+            IntPtr section,
+            uint desiredAccess,
+            uint fileOffsetHigh,
+            uint fileOffsetLow,
+            UIntPtr numberOfBytesToMap);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool UnmapViewOfFile(IntPtr baseAddress);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool CloseHandle(IntPtr handle);
     }
 }
@@ -0,0 +1,322 @@
+﻿// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+
+using System;
+using System.IO;
+using System.IO.Pipes;
+using System.Runtime.InteropServices;
+using System.Threading;
+using System.Threading.Tasks;
+using Microsoft.Win32.SafeHandles;
+
+namespace Microsoft.CodeAnalysis.CompilerServer
+{
+    /// <summary>
+    /// The server end of the shared memory transport.  A client which finds the server's
+    /// <see cref="BuildProtocolConstants.SharedMemoryTransportSuffix"/> event may create a section
+    /// holding two single producer, single consumer rings, one for its requests and one for the
+    /// response, and send its handle to the section in a transport frame before its first request.
+    /// Once the server has checked the client's identity it duplicates the section out of the
+    /// client process, so a client can never make the server take over a handle of its own.
+    ///
+    /// The pipe stays open and carries only doorbells.  A side which finds the ring it reads
+    /// empty sets its waiting flag and reads a byte from the pipe, which the other side writes
+    /// once it has added data and found the flag set.  A side which finds the ring it writes full
+    /// polls instead, so doorbells only travel towards the reader, and the cancel frame and
+    /// disconnects reach the server through the pipe as before.
+    /// </summary>
+    internal sealed class SharedMemoryTransportStream : Stream
+    {
+        // The section starts with the two waiting flags and the head and tail of each ring, on
+        // cache lines of their own, followed by the request ring and the response ring.  The heads
+        // and tails count the bytes ever written and read, and wrap.  The client lays the section
+        // out the same way.
+        internal const int CounterSize = 64;
+        internal const int ClientWaitingOffset = 0;
+        internal const int ServerWaitingOffset = CounterSize;
+        internal const int RequestHeadOffset = 2 * CounterSize;
+        internal const int RequestTailOffset = 3 * CounterSize;
+        internal const int ResponseHeadOffset = 4 * CounterSize;
+        internal const int ResponseTailOffset = 5 * CounterSize;
+        internal const int HeaderSize = 6 * CounterSize;
+        internal const int RingSize = 256 * 1024;
+        internal const int SectionSize = HeaderSize + (2 * RingSize);
+
+        private const uint FILE_MAP_WRITE = 0x0002;
+        private const uint FILE_MAP_READ = 0x0004;
+        private const uint PROCESS_DUP_HANDLE = 0x0040;
+
+        private readonly NamedPipeServerStream _pipeStream;
+        private readonly byte[] _doorbell = new byte[1];
+        private IntPtr _view;
+
+        private SharedMemoryTransportStream(NamedPipeServerStream pipeStream, IntPtr view)
+        {
+            _pipeStream = pipeStream;
+            _view = view;
+        }
+
+        /// <summary>
+        /// Is the body of a frame read from the pipe a transport frame?
+        /// </summary>
+        public static bool IsTransportFrame(byte[] frame)
+        {
+            return frame != null
+                && frame.Length == sizeof(int) + sizeof(long)
+                && BitConverter.ToInt32(frame, 0) == BuildProtocolConstants.SharedMemoryTransportRequest;
+        }
+
+        /// <summary>
+        /// Map the section named in a transport frame.  The frame holds the handle of the section in
+        /// the client process, which must already have been checked to run as the same user.  The
+        /// handle is duplicated from there, and the copy closed whether or not it can be mapped.
+        /// </summary>
+        public static SharedMemoryTransportStream Adopt(byte[] frame, NamedPipeServerStream pipeStream, int clientProcessId)
+        {
+            using (var section = DuplicateSection(new IntPtr(BitConverter.ToInt64(frame, sizeof(int))), clientProcessId))
+            {
+                var view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, new UIntPtr(SectionSize));
+                if (view == IntPtr.Zero)
+                {
+                    throw new IOException(string.Format("Could not map the shared memory transport: error {0}.", Marshal.GetLastWin32Error()));
+                }
+
+                return new SharedMemoryTransportStream(pipeStream, view);
+            }
+        }
+
+        private static SafeFileHandle DuplicateSection(IntPtr clientSection, int clientProcessId)
+        {
+            var clientProcess = OpenProcess(PROCESS_DUP_HANDLE, false, clientProcessId);
+            if (clientProcess == IntPtr.Zero)
+            {
+                throw new IOException(string.Format("Could not open the client process: error {0}.", Marshal.GetLastWin32Error()));
+            }
+
+            try
+            {
+                SafeFileHandle section;
+                if (!DuplicateHandle(clientProcess, clientSection, GetCurrentProcess(), out section, FILE_MAP_READ | FILE_MAP_WRITE, false, 0))
+                {
+                    throw new IOException(string.Format("Could not open the shared memory transport: error {0}.", Marshal.GetLastWin32Error()));
+                }
+
+                return section;
+            }
+            finally
+            {
+                CloseHandle(clientProcess);
+            }
+        }
+
+        // Await isn't allowed in unsafe code, so the counters are only touched here.
+        private unsafe int ReadCounter(int offset)
+        {
+            return Volatile.Read(ref *(int*)(GetView() + offset).ToPointer());
+        }
+
+        private unsafe int ExchangeCounter(int offset, int value)
+        {
+            return Interlocked.Exchange(ref *(int*)(GetView() + offset).ToPointer(), value);
+        }
+
+        private IntPtr GetView()
+        {
+            if (_view == IntPtr.Zero)
+            {
+                throw new ObjectDisposedException("SharedMemoryTransportStream");
+            }
+
+            return _view;
+        }
+
+        public override async Task<int> ReadAsync(byte[] buffer, int offset, int count, CancellationToken cancellationToken)
+        {
+            if (count == 0)
+            {
+                return 0;
+            }
+
+            while (Available() == 0)
+            {
+                // Either the client sees the flag after it adds data and rings, or the data is
+                // seen here.  If the client took the flag down in between it has rung anyway.
+                ExchangeCounter(ServerWaitingOffset, 1);
+                if (Available() != 0 && ExchangeCounter(ServerWaitingOffset, 0) == 1)
+                {
+                    break;
+                }
+
+                if (await _pipeStream.ReadAsync(_doorbell, 0, 1, cancellationToken).ConfigureAwait(false) == 0)
+                {
+                    throw new EndOfStreamException("Client disconnected while sending its request.");
+                }
+            }
+
+            var tail = ReadCounter(RequestTailOffset);
+            var length = Math.Min(count, Available());
+            CopyFromRing(HeaderSize, tail, buffer, offset, length);
+            ExchangeCounter(RequestTailOffset, unchecked(tail + length));
+            return length;
+        }
+
+        public override async Task WriteAsync(byte[] buffer, int offset, int count, CancellationToken cancellationToken)
+        {
+            while (count > 0)
+            {
+                var head = ReadCounter(ResponseHeadOffset);
+                var free = RingSize - unchecked(head - ReadCounter(ResponseTailOffset));
+                if (free == 0)
+                {
+                    if (!IsClientConnected())
+                    {
+                        throw new IOException("Client disconnected while reading the response.");
+                    }
+
+                    await Task.Delay(1, cancellationToken).ConfigureAwait(false);
+                    continue;
+                }
+
+                var length = Math.Min(count, free);
+                CopyToRing(HeaderSize + RingSize, head, buffer, offset, length);
+                ExchangeCounter(ResponseHeadOffset, unchecked(head + length));
+                if (ExchangeCounter(ClientWaitingOffset, 0) == 1)
+                {
+                    await _pipeStream.WriteAsync(_doorbell, 0, 1, cancellationToken).ConfigureAwait(false);
+                }
+
+                offset += length;
+                count -= length;
+            }
+        }
+
+        private int Available()
+        {
+            return unchecked(ReadCounter(RequestHeadOffset) - ReadCounter(RequestTailOffset));
+        }
+
+        private void CopyFromRing(int ringOffset, int position, byte[] buffer, int offset, int length)
+        {
+            var index = position & (RingSize - 1);
+            var first = Math.Min(length, RingSize - index);
+            Marshal.Copy(GetView() + ringOffset + index, buffer, offset, first);
+            Marshal.Copy(GetView() + ringOffset, buffer, offset + first, length - first);
+        }
+
+        private void CopyToRing(int ringOffset, int position, byte[] buffer, int offset, int length)
+        {
+            var index = position & (RingSize - 1);
+            var first = Math.Min(length, RingSize - index);
+            Marshal.Copy(buffer, offset, GetView() + ringOffset + index, first);
+            Marshal.Copy(buffer, offset + first, GetView() + ringOffset, length - first);
+        }
+
+        /// <summary>
+        /// A pipe whose client went away can't be peeked.
+        /// </summary>
+        private bool IsClientConnected()
+        {
+            uint bytesAvailable;
+            return PeekNamedPipe(_pipeStream.SafePipeHandle, IntPtr.Zero, 0, IntPtr.Zero, out bytesAvailable, IntPtr.Zero);
+        }
+
+        public override int Read(byte[] buffer, int offset, int count)
+        {
+            return ReadAsync(buffer, offset, count, CancellationToken.None).GetAwaiter().GetResult();
+        }
+
+        public override void Write(byte[] buffer, int offset, int count)
+        {
+            WriteAsync(buffer, offset, count, CancellationToken.None).GetAwaiter().GetResult();
+        }
+
+        public override void Flush()
+        {
+        }
+
+        public override bool CanRead
+        {
+            get { return true; }
+        }
+
+        public override bool CanSeek
+        {
+            get { return false; }
+        }
+
+        public override bool CanWrite
+        {
+            get { return true; }
+        }
+
+        public override long Length
+        {
+            get { throw new NotSupportedException(); }
+        }
+
+        public override long Position
+        {
+            get { throw new NotSupportedException(); }
+            set { throw new NotSupportedException(); }
+        }
+
+        public override long Seek(long offset, SeekOrigin origin)
+        {
+            throw new NotSupportedException();
+        }
+
+        public override void SetLength(long value)
+        {
+            throw new NotSupportedException();
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            if (_view != IntPtr.Zero)
+            {
+                UnmapViewOfFile(_view);
+                _view = IntPtr.Zero;
+            }
+
+            base.Dispose(disposing);
+        }
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern IntPtr MapViewOfFile(
+            SafeHandle section,
+            uint desiredAccess,
+            uint fileOffsetHigh,
+            uint fileOffsetLow,
+            UIntPtr numberOfBytesToMap);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool UnmapViewOfFile(IntPtr baseAddress);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern IntPtr OpenProcess(uint desiredAccess, bool inheritHandle, int processId);
+
+        [DllImport("kernel32.dll")]
+        private static extern IntPtr GetCurrentProcess();
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool DuplicateHandle(
+            IntPtr sourceProcess,
+            IntPtr sourceHandle,
+            IntPtr targetProcess,
+            out SafeFileHandle targetHandle,
+            uint desiredAccess,
+            bool inheritHandle,
+            uint options);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool CloseHandle(IntPtr handle);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        private static extern bool PeekNamedPipe(
+            SafeHandle pipe,
+            IntPtr buffer,
+            uint bufferSize,
+            IntPtr bytesRead,
+            out uint totalBytesAvailable,
+            IntPtr bytesLeftThisMessage);
+    }
+}
@@ -0,0 +1,186 @@
+﻿// Copyright (c) Microsoft.  All Rights Reserved.  Licensed under the Apache License, Version 2.0.  See License.txt in the project root for license information.
+
+using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Threading;
+using Microsoft.CodeAnalysis.CSharp;
+using Microsoft.CodeAnalysis.VisualBasic;
+using Roslyn.Utilities;
+
+namespace Microsoft.CodeAnalysis.CompilerServer
+{
+    /// <summary>
+    /// A new server starts with an empty metadata cache and nothing JIT compiled, so its first
+    /// compilations are several times slower than later ones.  The client which starts a server
+    /// hands it a profile of the languages and references that user's compilations use most.  On
+    /// an idle thread the server loads the references into its cache and runs a small compilation
+    /// of each language before the first request arrives.
+    /// 
+    /// The profile has a line per entry: its kind ("lang" or "ref"), a count of its uses weighted
+    /// toward recent compilations and its value, separated by spaces.  Entries are ordered most
+    /// used first.  Entries of other kinds are for the client and are ignored.
+    /// </summary>
+    internal static class WarmupProfile
+    {
+        /// <summary>
+        /// The switch which names the profile on the server command line.
+        /// </summary>
+        public const string ProfileSwitch = "/warmupprofile:";
+
+        private const string LanguageKind = "lang";
+        private const string ReferenceKind = "ref";
+        private const string CSharpLanguage = "csharp";
+        private const string VisualBasicLanguage = "vb";
+
+        /// <summary>
+        /// Get the path of the profile named on the command line, if any.
+        /// </summary>
+        public static string GetProfilePath(string[] args)
+        {
+            string path = null;
+            foreach (var arg in args)
+            {
+                if (arg.StartsWith(ProfileSwitch, StringComparison.OrdinalIgnoreCase))
+                {
+                    path = arg.Substring(ProfileSwitch.Length);
+                }
+            }
+
+            return path;
+        }
+
+        /// <summary>
+        /// Warm up from the profile at the given path on a background thread of the lowest
+        /// priority, so that it only uses otherwise idle processors.
+        /// </summary>
+        public static void Start(string profilePath)
+        {
+            var thread = new Thread(() => WarmUp(profilePath))
+            {
+                IsBackground = true,
+                Priority = ThreadPriority.Lowest,
+                Name = "Warmup"
+            };
+            thread.Start();
+        }
+
+        /// <summary>
+        /// Read the languages and references named in a profile, most used first.
+        /// </summary>
+        internal static void Read(IEnumerable<string> lines, List<string> languages, List<string> references)
+        {
+            foreach (var line in lines)
+            {
+                var parts = line.Split(new[] { ' ' }, 3);
+                if (parts.Length != 3)
+                {
+                    continue;
+                }
+
+                if (parts[0] == LanguageKind)
+                {
+                    languages.Add(parts[2]);
+                }
+                else if (parts[0] == ReferenceKind)
+                {
+                    references.Add(parts[2]);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Load the references into the metadata cache.  Returns those which could be loaded.
+        /// </summary>
+        internal static List<MetadataReference> PreloadReferences(IEnumerable<string> paths, CancellationToken cancellationToken)
+        {
+            var references = new List<MetadataReference>();
+            foreach (var path in paths)
+            {
+                cancellationToken.ThrowIfCancellationRequested();
+                if (!PathUtilities.IsAbsolute(path) || !File.Exists(path))
+                {
+                    continue;
+                }
+
+                try
+                {
+                    var reference = CompilerRequestHandler.AssemblyReferenceProvider.GetReference(path);
+                    reference.GetMetadata();
+                    references.Add(reference);
+                }
+                catch (Exception e)
+                {
+                    // A reference which can't be loaded now will fail the same way for the compilation
+                    // which needs it, and report it there.
+                    CompilerServerLogger.LogException(e, string.Format("Could not preload reference '{0}'.", path));
+                }
+            }
+
+            return references;
+        }
+
+        private static void WarmUp(string profilePath)
+        {
+            try
+            {
+                var languages = new List<string>();
+                var paths = new List<string>();
+                Read(ReadProfileLines(profilePath), languages, paths);
+                CompilerServerLogger.Log("Warming up {0} languages and {1} references from '{2}'.", languages.Count, paths.Count, profilePath);
+
+                var references = PreloadReferences(paths, CancellationToken.None);
+
+                // Compiling something small JIT compiles most of the compiler.  Whether it succeeds
+                // doesn't matter.
+                foreach (var language in languages)
+                {
+                    if (language == CSharpLanguage)
+                    {
+                        CSharpCompilation.Create(
+                            "Warmup",
+                            new[] { CSharpSyntaxTree.ParseText("class C { static void Main() { System.Console.WriteLine(); } }") },
+                            references,
+                            new CSharpCompilationOptions(OutputKind.ConsoleApplication)).Emit(new MemoryStream());
+                    }
+                    else if (language == VisualBasicLanguage)
+                    {
+                        VisualBasicCompilation.Create(
+                            "Warmup",
+                            new[] { VisualBasicSyntaxTree.ParseText("Module M\r\nSub Main()\r\nSystem.Console.WriteLine()\r\nEnd Sub\r\nEnd Module") },
+                            references,
+                            new VisualBasicCompilationOptions(OutputKind.ConsoleApplication)).Emit(new MemoryStream());
+                    }
+                }
+
+                CompilerServerLogger.Log("Warm up complete.");
+            }
+            catch (Exception e)
+            {
+                CompilerServerLogger.LogException(e, "Warm up failed.");
+            }
+        }
+
+        /// <summary>
+        /// Clients briefly lock the profile while they update it, so retry a read which fails.
+        /// </summary>
+        private static string[] ReadProfileLines(string profilePath)
+        {
+            for (int attempt = 1; ; attempt++)
+            {
+                try
+                {
+                    using (var stream = new FileStream(profilePath, FileMode.Open, FileAccess.Read, FileShare.ReadWrite | FileShare.Delete))
+                    using (var reader = new StreamReader(stream))
+                    {
+                        return reader.ReadToEnd().Split(new[] { "\r\n", "\n" }, StringSplitOptions.RemoveEmptyEntries);
+                    }
+                }
+                catch (IOException) when (attempt < 3)
+                {
+                    Thread.Sleep(100);
+                }
+            }
+        }
+    }
+}
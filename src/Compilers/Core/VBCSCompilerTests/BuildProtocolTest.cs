@@ -1,8 +1,12 @@
-﻿using Roslyn.Test.Utilities;
+﻿using Microsoft.Win32.SafeHandles;
+using Roslyn.Test.Utilities;
 using System;
 using System.Collections.Generic;
 using System.Collections.Immutable;
+using System.Diagnostics;
 using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.IO.Pipes;
 using System.Linq;
 using System.Text;
 using System.Threading;
@@ -31,6 +35,45 @@ public void ReadWriteCompleted()
             }).Wait();
         }
 
+        [Fact]
+        public void ReadWriteBusy()
+        {
+            Task.Run(async () =>
+            {
+                var response = new BusyBuildResponse(retryAfterMilliseconds: 1500, queueDepth: 7);
+                var memoryStream = new MemoryStream();
+                await response.WriteAsync(memoryStream, default(CancellationToken)).ConfigureAwait(false);
+                Assert.True(memoryStream.Position > 0);
+                memoryStream.Position = 0;
+                var read = (BusyBuildResponse)(await BuildResponse.ReadAsync(memoryStream, default(CancellationToken)).ConfigureAwait(false));
+                Assert.Equal(1500, read.RetryAfterMilliseconds);
+                Assert.Equal(7, read.QueueDepth);
+            }).Wait();
+        }
+
+        [Fact]
+        public void ReadWriteSharedMemory()
+        {
+            Task.Run(async () =>
+            {
+                var completed = new CompletedBuildResponse(1, utf8output: true, output: "a string", errorOutput: "b string");
+                var response = SharedMemoryCompletedBuildResponse.TryCreate(completed, Process.GetCurrentProcess().Id);
+                Assert.NotNull(response);
+                var memoryStream = new MemoryStream();
+                await response.WriteAsync(memoryStream, default(CancellationToken)).ConfigureAwait(false);
+                memoryStream.Position = 0;
+                var read = (SharedMemoryCompletedBuildResponse)(await BuildResponse.ReadAsync(memoryStream, default(CancellationToken)).ConfigureAwait(false));
+                Assert.Equal(1, read.ReturnCode);
+                Assert.True(read.Utf8Output);
+                Assert.Equal(response.Section, read.Section);
+                Assert.Equal(8, read.OutputLength);
+                Assert.Equal(8, read.ErrorOutputLength);
+
+                // The section was handed to this process.
+                new SafeFileHandle(new IntPtr(read.Section), ownsHandle: true).Dispose();
+            }).Wait();
+        }
+
         [Fact]
         public void ReadWriteRequest()
         {
@@ -58,5 +101,103 @@ public void ReadWriteRequest()
                 Assert.Equal("file", read.Arguments[1].Value);
             }).Wait();
         }
+
+        [Fact]
+        public void ReadWriteUtf8()
+        {
+            Task.Run(async () =>
+            {
+                var arguments = ImmutableArray.Create(
+                    new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.CurrentDirectory, argumentIndex: 0, value: "directory"),
+                    new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.CommandLineArgument, argumentIndex: 0, value: "caf\u00e9 \u65e5\u672c \ud83d\ude00"));
+                var utf16Stream = new MemoryStream();
+                await new BuildRequest(BuildProtocolConstants.Utf16ProtocolVersion, BuildProtocolConstants.RequestLanguage.CSharpCompile, arguments)
+                    .WriteAsync(utf16Stream, default(CancellationToken)).ConfigureAwait(false);
+                var utf8Stream = new MemoryStream();
+                await new BuildRequest(BuildProtocolConstants.ProtocolVersion, BuildProtocolConstants.RequestLanguage.CSharpCompile, arguments)
+                    .WriteAsync(utf8Stream, default(CancellationToken)).ConfigureAwait(false);
+
+                // UTF-8 halves the ASCII argument and saves three bytes on the other.
+                Assert.Equal(utf16Stream.Length - "directory".Length - 3, utf8Stream.Length);
+
+                foreach (var stream in new[] { utf16Stream, utf8Stream })
+                {
+                    stream.Position = 0;
+                    var read = await BuildRequest.ReadAsync(stream, default(CancellationToken)).ConfigureAwait(false);
+                    Assert.Equal(arguments[0].Value, read.Arguments[0].Value);
+                    Assert.Equal(arguments[1].Value, read.Arguments[1].Value);
+                }
+
+                var response = new CompletedBuildResponse(0, utf8output: false, output: "caf\u00e9", errorOutput: "error");
+                var responseStream = new MemoryStream();
+                await response.WriteAsync(responseStream, BuildProtocolConstants.ProtocolVersion, default(CancellationToken)).ConfigureAwait(false);
+                responseStream.Position = 0;
+                var readResponse = (CompletedBuildResponse)(await BuildResponse.ReadAsync(responseStream, BuildProtocolConstants.ProtocolVersion, default(CancellationToken)).ConfigureAwait(false));
+                Assert.Equal("caf\u00e9", readResponse.Output);
+                Assert.Equal("error", readResponse.ErrorOutput);
+            }).Wait();
+        }
+
+        [Fact]
+        public void SharedMemoryTransport()
+        {
+            Task.Run(async () =>
+            {
+                var pipeName = Guid.NewGuid().ToString("N");
+                using (var serverPipe = new NamedPipeServerStream(pipeName, PipeDirection.InOut, 1, PipeTransmissionMode.Byte, PipeOptions.Asynchronous))
+                using (var clientPipe = new NamedPipeClientStream(".", pipeName, PipeDirection.InOut, PipeOptions.Asynchronous))
+                using (var section = MemoryMappedFile.CreateNew(null, SharedMemoryTransportStream.SectionSize))
+                using (var view = section.CreateViewAccessor())
+                {
+                    var connected = serverPipe.WaitForConnectionAsync();
+                    clientPipe.Connect();
+                    await connected.ConfigureAwait(false);
+
+                    // The client sends its own handle to the section, and this process is also
+                    // the client, so the server duplicates the section from itself.
+                    var frame = new byte[sizeof(int) + sizeof(long)];
+                    BitConverter.GetBytes(BuildProtocolConstants.SharedMemoryTransportRequest).CopyTo(frame, 0);
+                    BitConverter.GetBytes(section.SafeMemoryMappedFileHandle.DangerousGetHandle().ToInt64()).CopyTo(frame, sizeof(int));
+                    Assert.True(SharedMemoryTransportStream.IsTransportFrame(frame));
+
+                    using (var transport = SharedMemoryTransportStream.Adopt(frame, serverPipe, Process.GetCurrentProcess().Id))
+                    {
+                        // The server finds the request ring empty and waits for the client to ring.
+                        var request = new BuildRequest(
+                            BuildProtocolConstants.ProtocolVersion,
+                            BuildProtocolConstants.RequestLanguage.CSharpCompile,
+                            ImmutableArray.Create(new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.CurrentDirectory, argumentIndex: 0, value: "directory")));
+                        var requestStream = new MemoryStream();
+                        await request.WriteAsync(requestStream, default(CancellationToken)).ConfigureAwait(false);
+                        var readTask = BuildRequest.ReadAsync(transport, default(CancellationToken));
+                        while (view.ReadInt32(SharedMemoryTransportStream.ServerWaitingOffset) == 0)
+                        {
+                            await Task.Delay(1).ConfigureAwait(false);
+                        }
+                        view.WriteArray(SharedMemoryTransportStream.HeaderSize, requestStream.ToArray(), 0, (int)requestStream.Length);
+                        view.Write(SharedMemoryTransportStream.RequestHeadOffset, (int)requestStream.Length);
+                        view.Write(SharedMemoryTransportStream.ServerWaitingOffset, 0);
+                        clientPipe.WriteByte(1);
+
+                        var read = await readTask.ConfigureAwait(false);
+                        Assert.Equal(BuildProtocolConstants.RequestLanguage.CSharpCompile, read.Language);
+                        Assert.Equal("directory", read.Arguments[0].Value);
+                        Assert.Equal((int)requestStream.Length, view.ReadInt32(SharedMemoryTransportStream.RequestTailOffset));
+
+                        // The server rings for the client waiting on the response ring.
+                        view.Write(SharedMemoryTransportStream.ClientWaitingOffset, 1);
+                        var response = new CompletedBuildResponse(0, utf8output: false, output: "output", errorOutput: "");
+                        await response.WriteAsync(transport, default(CancellationToken)).ConfigureAwait(false);
+                        Assert.Equal(1, clientPipe.ReadByte());
+                        Assert.Equal(0, view.ReadInt32(SharedMemoryTransportStream.ClientWaitingOffset));
+
+                        var responseBytes = new byte[view.ReadInt32(SharedMemoryTransportStream.ResponseHeadOffset)];
+                        view.ReadArray(SharedMemoryTransportStream.HeaderSize + SharedMemoryTransportStream.RingSize, responseBytes, 0, responseBytes.Length);
+                        var readResponse = (CompletedBuildResponse)(await BuildResponse.ReadAsync(new MemoryStream(responseBytes), default(CancellationToken)).ConfigureAwait(false));
+                        Assert.Equal("output", readResponse.Output);
+                    }
+                }
+            }).Wait();
+        }
     }
 }
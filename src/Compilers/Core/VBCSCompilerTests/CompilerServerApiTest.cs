@@ -5,6 +5,7 @@
 using System.Collections.Immutable;
 using System.Diagnostics;
 using System.IO;
+using System.IO.MemoryMappedFiles;
 using System.Linq;
 using System.Reflection;
 using System.Runtime.InteropServices;
@@ -26,27 +27,42 @@ public class CompilerServerApiTest : TestBase
         private sealed class TestableClientConnection : IClientConnection
         {
             internal string LoggingIdentifier = string.Empty;
+            internal Task<BuildRequest> PrepareRequestTask;
             internal Task<BuildRequest> ReadBuildRequestTask = TaskFromException<BuildRequest>(new Exception());
             internal Task WriteBuildResponseTask = TaskFromException(new Exception());
-            internal Task MonitorTask = TaskFromException(new Exception());
+            internal Task<bool> MonitorTask = TaskFromException<bool>(new Exception());
             internal Action CloseAction = delegate { };
+            internal BuildResponse WrittenResponse;
 
             string IClientConnection.LoggingIdentifier
             {
                 get { return LoggingIdentifier; }
             }
 
+            int IClientConnection.ClientProcessId
+            {
+                get { return 0; }
+            }
+
             Task<BuildRequest> IClientConnection.ReadBuildRequest(CancellationToken cancellationToken)
             {
+                var prepareRequestTask = PrepareRequestTask;
+                if (prepareRequestTask != null)
+                {
+                    PrepareRequestTask = null;
+                    return prepareRequestTask;
+                }
+
                 return ReadBuildRequestTask;
             }
 
             Task IClientConnection.WriteBuildResponse(BuildResponse response, CancellationToken cancellationToken)
             {
+                WrittenResponse = response;
                 return WriteBuildResponseTask;
             }
 
-            Task IClientConnection.CreateMonitorDisconnectTask(CancellationToken cancellationToken)
+            Task<bool> IClientConnection.CreateMonitorDisconnectTask(CancellationToken cancellationToken)
             {
                 return MonitorTask;
             }
@@ -139,7 +155,7 @@ private async Task<BuildResponse> RunCSharpCompile(string pipeName, string sourc
                 var buildRequest = await CreateBuildRequest(sourceText, keepAlive).ConfigureAwait(false);
                 namedPipe.Connect(Timeout.Infinite);
                 await buildRequest.WriteAsync(namedPipe, default(CancellationToken)).ConfigureAwait(false);
-                return await BuildResponse.ReadAsync(namedPipe, default(CancellationToken)).ConfigureAwait(false);
+                return await BuildResponse.ReadAsync(namedPipe, buildRequest.ProtocolVersion, default(CancellationToken)).ConfigureAwait(false);
             }
         }
 
@@ -160,7 +176,7 @@ private static Mock<IRequestHandler> CreateNopRequestHandler()
         public void NotifyCallBackOnRequestHandlerException()
         {
             var clientConnection = new TestableClientConnection();
-            clientConnection.MonitorTask = Task.Delay(-1);
+            clientConnection.MonitorTask = new TaskCompletionSource<bool>().Task;
             clientConnection.ReadBuildRequestTask = Task.FromResult(s_emptyCSharpBuildRequest);
 
             var ex = new Exception();
@@ -209,7 +225,7 @@ public void ClientDisconnectCancelBuildAndReturnsFailure()
             // started monitoring the disconnect task.  Can now initiate a disconnect in a known
             // state.
             var cancellationToken = handlerTaskSource.Task.Result;
-            monitorTaskSource.SetResult(true);
+            monitorTaskSource.SetResult(false);
 
             Assert.Equal(ServerDispatcher.CompletionReason.ClientDisconnect, serveTask.Result);
             Assert.True(cancellationToken.IsCancellationRequested);
@@ -219,6 +235,100 @@ public void ClientDisconnectCancelBuildAndReturnsFailure()
             releaseHandlerSource.SetResult(true);
         }
 
+        [Fact]
+        public void ClientCancelCancelsBuild()
+        {
+            var clientConnection = new TestableClientConnection();
+            clientConnection.ReadBuildRequestTask = Task.FromResult(s_emptyCSharpBuildRequest);
+
+            var monitorTaskSource = new TaskCompletionSource<bool>();
+            clientConnection.MonitorTask = monitorTaskSource.Task;
+
+            var handler = new Mock<IRequestHandler>();
+            var handlerTaskSource = new TaskCompletionSource<CancellationToken>();
+            var releaseHandlerSource = new TaskCompletionSource<bool>();
+            var handlerFinished = false;
+            handler
+                .Setup(x => x.HandleRequest(It.IsAny<BuildRequest>(), It.IsAny<CancellationToken>()))
+                .Callback<BuildRequest, CancellationToken>((_, t) =>
+                {
+                    handlerTaskSource.SetResult(t);
+                    releaseHandlerSource.Task.Wait();
+                    handlerFinished = true;
+                })
+                .Returns(s_emptyBuildResponse);
+
+            // The client may write the outputs once the pipe closes, so that must wait for the
+            // cancelled build to stop.
+            var closedAfterBuild = false;
+            clientConnection.CloseAction = () => closedAfterBuild = handlerFinished;
+
+            var client = new ServerDispatcher.Connection(clientConnection, handler.Object);
+            var serveTask = client.ServeConnection(new TaskCompletionSource<TimeSpan?>());
+
+            var cancellationToken = handlerTaskSource.Task.Result;
+            monitorTaskSource.SetResult(true);
+            cancellationToken.WaitHandle.WaitOne();
+            releaseHandlerSource.SetResult(true);
+
+            Assert.Equal(ServerDispatcher.CompletionReason.ClientCancel, serveTask.Result);
+            Assert.True(cancellationToken.IsCancellationRequested);
+            Assert.True(closedAfterBuild);
+        }
+
+        /// <summary>
+        /// With the shared memory transport a doorbell the client rang late may still be on the
+        /// pipe when it asks to cancel.
+        /// </summary>
+        [Fact]
+        public void MonitorSkipsDoorbellBeforeCancelFrame()
+        {
+            Task.Run(async () =>
+            {
+                var pipeName = Guid.NewGuid().ToString("N");
+                using (var serverPipe = new NamedPipeServerStream(pipeName, PipeDirection.InOut, 1, PipeTransmissionMode.Byte, PipeOptions.Asynchronous))
+                using (var clientPipe = new NamedPipeClientStream(".", pipeName, PipeDirection.InOut, PipeOptions.Asynchronous))
+                {
+                    var connected = serverPipe.WaitForConnectionAsync();
+                    clientPipe.Connect();
+                    await connected.ConfigureAwait(false);
+
+                    var bytes = new List<byte> { 1 };
+                    bytes.AddRange(BitConverter.GetBytes(sizeof(int)));
+                    bytes.AddRange(BitConverter.GetBytes(BuildProtocolConstants.CancelRequest));
+                    clientPipe.Write(bytes.ToArray(), 0, bytes.Count);
+
+                    var connection = new NamedPipeClientConnection(serverPipe);
+                    Assert.True(await connection.CreateMonitorDisconnectTask(CancellationToken.None).ConfigureAwait(false));
+                }
+            }).Wait();
+        }
+
+        [Fact]
+        public void DeadlineExpiredCancelsBuild()
+        {
+            var clientConnection = new TestableClientConnection();
+            clientConnection.MonitorTask = new TaskCompletionSource<bool>().Task;
+            clientConnection.ReadBuildRequestTask = Task.FromResult(new BuildRequest(
+                1,
+                BuildProtocolConstants.RequestLanguage.CSharpCompile,
+                ImmutableArray.Create(new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.Deadline, 0, "10"))));
+
+            var handler = new Mock<IRequestHandler>();
+            handler
+                .Setup(x => x.HandleRequest(It.IsAny<BuildRequest>(), It.IsAny<CancellationToken>()))
+                .Callback<BuildRequest, CancellationToken>((_, t) =>
+                {
+                    t.WaitHandle.WaitOne();
+                    t.ThrowIfCancellationRequested();
+                })
+                .Returns(s_emptyBuildResponse);
+
+            var client = new ServerDispatcher.Connection(clientConnection, handler.Object);
+            Assert.Equal(ServerDispatcher.CompletionReason.DeadlineExpired, client.ServeConnection().Result);
+            Assert.Null(clientConnection.WrittenResponse);
+        }
+
         [Fact]
         public void ReadError()
         {
@@ -242,7 +352,7 @@ public void ReadError()
         public void WriteError()
         {
             var clientConnection = new TestableClientConnection();
-            clientConnection.MonitorTask = Task.Delay(-1);
+            clientConnection.MonitorTask = new TaskCompletionSource<bool>().Task;
             clientConnection.ReadBuildRequestTask = Task.FromResult(s_emptyCSharpBuildRequest);
             clientConnection.WriteBuildResponseTask = TaskFromException(new Exception());
             var handler = new Mock<IRequestHandler>();
@@ -254,6 +364,92 @@ public void WriteError()
             Assert.Equal(ServerDispatcher.CompletionReason.ClientDisconnect, client.ServeConnection().Result);
         }
 
+        [Fact]
+        public void PrepareRequestPrecedesRequest()
+        {
+            var prepareRequest = new BuildRequest(
+                BuildProtocolConstants.ProtocolVersion,
+                BuildProtocolConstants.RequestLanguage.Prepare,
+                ImmutableArray.Create(
+                    new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.CurrentDirectory, 0, @"c:\"),
+                    new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.ReferencePath, 0, typeof(object).Assembly.Location),
+                    new BuildRequest.Argument(BuildProtocolConstants.ArgumentId.SourcePath, 0, @"c:\does\not\exist.cs")));
+
+            var clientConnection = new TestableClientConnection();
+            clientConnection.MonitorTask = new TaskCompletionSource<bool>().Task;
+            clientConnection.PrepareRequestTask = Task.FromResult(prepareRequest);
+            clientConnection.ReadBuildRequestTask = Task.FromResult(s_emptyCSharpBuildRequest);
+            clientConnection.WriteBuildResponseTask = Task.FromResult(true);
+            var handler = new Mock<IRequestHandler>();
+            handler
+                .Setup(x => x.HandleRequest(It.IsAny<BuildRequest>(), It.IsAny<CancellationToken>()))
+                .Returns(s_emptyBuildResponse);
+
+            var client = new ServerDispatcher.Connection(clientConnection, handler.Object);
+            Assert.Equal(ServerDispatcher.CompletionReason.Completed, client.ServeConnection().Result);
+            handler.Verify(x => x.HandleRequest(s_emptyCSharpBuildRequest, It.IsAny<CancellationToken>()), Times.Once());
+        }
+
+        [Fact]
+        public void FullQueueDeclinesRequest()
+        {
+            var queue = new ServerDispatcher.CompilationQueue(maxConcurrent: 1, maxQueued: 1);
+            Assert.True(queue.TryEnqueue());
+            queue.WaitForTurnAsync(BuildProtocolConstants.Priority.Normal, CancellationToken.None).Wait();
+            Assert.True(queue.TryEnqueue());
+
+            var clientConnection = new TestableClientConnection();
+            clientConnection.ReadBuildRequestTask = Task.FromResult(s_emptyCSharpBuildRequest);
+            clientConnection.WriteBuildResponseTask = Task.FromResult(true);
+            var handler = new Mock<IRequestHandler>(MockBehavior.Strict);
+
+            var client = new ServerDispatcher.Connection(clientConnection, handler.Object, queue);
+            Assert.Equal(ServerDispatcher.CompletionReason.CompilationNotStarted, client.ServeConnection().Result);
+            Assert.IsType<BusyBuildResponse>(clientConnection.WrittenResponse);
+
+            // Interactive requests may fill the line to twice its length, but no further.
+            Assert.True(queue.TryEnqueue(BuildProtocolConstants.Priority.Interactive));
+            Assert.False(queue.TryEnqueue(BuildProtocolConstants.Priority.Interactive));
+        }
+
+        [Fact]
+        public void QueueServesInteractiveRequestsFirst()
+        {
+            var queue = new ServerDispatcher.CompilationQueue(maxConcurrent: 1, maxQueued: 10);
+            Assert.True(queue.TryEnqueue());
+            queue.WaitForTurnAsync(BuildProtocolConstants.Priority.Normal, CancellationToken.None).Wait();
+
+            Assert.True(queue.TryEnqueue(BuildProtocolConstants.Priority.Background));
+            var background = queue.WaitForTurnAsync(BuildProtocolConstants.Priority.Background, CancellationToken.None);
+            Assert.True(queue.TryEnqueue(BuildProtocolConstants.Priority.Interactive));
+            var interactive = queue.WaitForTurnAsync(BuildProtocolConstants.Priority.Interactive, CancellationToken.None);
+            Assert.Equal(2, queue.QueueDepth);
+
+            queue.Leave(TimeSpan.FromSeconds(1));
+            Assert.True(interactive.Wait(TimeSpan.FromSeconds(10)));
+            Assert.False(background.IsCompleted);
+
+            queue.Leave(TimeSpan.FromSeconds(1));
+            Assert.True(background.Wait(TimeSpan.FromSeconds(10)));
+            Assert.Equal(0, queue.QueueDepth);
+        }
+
+        [Fact]
+        public void ReadWarmupProfile()
+        {
+            Assert.Equal(@"c:\state\warmup", WarmupProfile.GetProfilePath(new[] { @"/warmupprofile:c:\state\warmup" }));
+            Assert.Null(WarmupProfile.GetProfilePath(new string[] { }));
+
+            var languages = new List<string>();
+            var references = new List<string>();
+            WarmupProfile.Read(
+                new[] { "lang 12 csharp", "ref 10 c:\\lib\\a b.dll", "ref 3 c:\\lib\\c.dll", "candidate 2 c:\\lib\\d.dll", "garbage", "lang 1 vb" },
+                languages,
+                references);
+            Assert.Equal(new[] { "csharp", "vb" }, languages);
+            Assert.Equal(new[] { @"c:\lib\a b.dll", @"c:\lib\c.dll" }, references);
+        }
+
         [Fact]
         public void KeepAliveNoConnections()
         {
@@ -349,6 +545,88 @@ public async Task KeepAliveAfterSimultaneousConnection()
             Assert.True((DateTime.Now - listener.LastProcessedTime.Value) > keepAlive);
         }
 
+        /// <summary>
+        /// Ensure the server signals the ready event created by the client which started it, and that
+        /// the pipe accepts connections once it has.
+        /// </summary>
+        [Fact]
+        public async Task SignalsReadyEventWhenListening()
+        {
+            var cts = new CancellationTokenSource();
+            var pipeName = Guid.NewGuid().ToString();
+            using (var readyEvent = new EventWaitHandle(false, EventResetMode.ManualReset, pipeName + BuildProtocolConstants.ServerReadyEventSuffix))
+            {
+                var dispatcherTask = Task.Run(() =>
+                {
+                    var dispatcher = new ServerDispatcher(CreateNopRequestHandler().Object, new EmptyDiagnosticListener());
+                    dispatcher.ListenAndDispatchConnections(pipeName, keepAlive: null, watchAnalyzerFiles: false, cancellationToken: cts.Token);
+                });
+
+                Assert.True(readyEvent.WaitOne(TimeSpan.FromSeconds(30)));
+
+                // Clients only send a prepare request to a server which says it accepts one.
+                EventWaitHandle prepareRequestEvent;
+                Assert.True(EventWaitHandle.TryOpenExisting(pipeName + BuildProtocolConstants.PrepareRequestSuffix, out prepareRequestEvent));
+                prepareRequestEvent.Dispose();
+
+                using (var namedPipe = new NamedPipeClientStream(".", pipeName, PipeDirection.InOut))
+                {
+                    namedPipe.Connect(0);
+                    Assert.True(namedPipe.IsConnected);
+                }
+
+                cts.Cancel();
+                await dispatcherTask.ConfigureAwait(false);
+            }
+        }
+
+        /// <summary>
+        /// A listener mapping may name handles which aren't instances of the server's pipe.  The
+        /// server must leave them alone, and create its own pipe instead.
+        /// </summary>
+        [Fact]
+        public async Task IgnoresListenerMappingWithoutPipes()
+        {
+            var cts = new CancellationTokenSource();
+            var pipeName = Guid.NewGuid().ToString();
+            var path = Path.Combine(Temp.CreateDirectory().Path, "file");
+            using (var file = new FileStream(path, FileMode.Create))
+            using (var mapping = MemoryMappedFile.CreateNew(pipeName + BuildProtocolConstants.ListenerMappingSuffix, 6 * sizeof(long)))
+            using (var readyEvent = new EventWaitHandle(false, EventResetMode.ManualReset, pipeName + BuildProtocolConstants.ServerReadyEventSuffix))
+            {
+                using (var view = mapping.CreateViewAccessor())
+                {
+                    var fileHandle = file.SafeFileHandle.DangerousGetHandle().ToInt64();
+                    view.Write(0, fileHandle);
+                    view.Write(8, 1000L);
+                    for (int i = 0; i < 4; i++)
+                    {
+                        view.Write(16 + (i * 8), fileHandle);
+                    }
+                }
+
+                var dispatcherTask = Task.Run(() =>
+                {
+                    var dispatcher = new ServerDispatcher(CreateNopRequestHandler().Object, new EmptyDiagnosticListener());
+                    dispatcher.ListenAndDispatchConnections(pipeName, keepAlive: null, watchAnalyzerFiles: false, cancellationToken: cts.Token);
+                });
+
+                Assert.True(readyEvent.WaitOne(TimeSpan.FromSeconds(30)));
+                using (var namedPipe = new NamedPipeClientStream(".", pipeName, PipeDirection.InOut))
+                {
+                    namedPipe.Connect(0);
+                    Assert.True(namedPipe.IsConnected);
+                }
+
+                // The file is still open.
+                file.WriteByte(1);
+                file.Flush();
+
+                cts.Cancel();
+                await dispatcherTask.ConfigureAwait(false);
+            }
+        }
+
         [Fact(Skip = "DevDiv 1095079"), WorkItem(1095079)]
         public async Task FirstClientCanOverrideDefaultTimeout()
         {